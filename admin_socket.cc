@@ -0,0 +1,566 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "admin_socket.h"
+#include "statistics.h"
+#include "timestore.h"
+#include "commit_queue.h"
+#include "database.h"
+#include "store_client.h"
+#include "retry_limiter.h"
+#include <sstream>
+#include <list>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <ctime>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <glibmm.h>
+
+/**
+ * how often the admin thread checks if it should stop, in milliseconds
+ */
+#define ADMIN_POLL_INTERVAL_MS 500
+
+/**
+ * how long we wait for the next command on a connection, in seconds
+ */
+#define ADMIN_IDLE_TIMEOUT 60
+
+/**
+ * how many connections are served at the same time
+ */
+#define ADMIN_MAX_CONNECTIONS 16
+
+/**
+ * how long a lookup waits for the database of the committer, in milliseconds
+ */
+#define ADMIN_LOOKUP_TIMEOUT_MS 1000
+
+/**
+ * the help text of the admin socket
+ */
+#define ADMIN_HELP \
+    "stats                             show the statistics counters\n" \
+    "lookup <key>                      show the database entry of a key\n" \
+    "whitelist add <network> [<ttl>]   whitelist a client network, for ttl seconds\n" \
+    "whitelist del <network>           remove a client network from the runtime whitelist\n" \
+    "whitelist list                    list the runtime whitelist\n" \
+    "whitelist flush                   remove all entries from the runtime whitelist\n" \
+    "cache stats                       show how many entries the caches hold\n" \
+    "cache flush [store|retry]         drop the entries of all caches, or of one of them\n" \
+    "cache resize store <entries>      change the maximum number of entries of the store cache\n" \
+    "expire <days> [<hours>]           start expiring database entries older than days, or hours if never passed\n" \
+    "compact                           start compacting the database\n" \
+    "job                               show the state of the last expire or compact\n" \
+    "quit                              close the connection\n"
+
+namespace couriergrey {
+    /**
+     * the listening admin socket
+     */
+    static int admin_fd = -1;
+
+    /**
+     * where the admin socket has been created
+     */
+    static std::string admin_path;
+
+    /**
+     * the inode of the admin socket we created
+     */
+    static ino_t admin_inode = 0;
+
+    /**
+     * the runtime whitelist managed using the admin socket
+     */
+    static runtime_whitelist* admin_whitelist = NULL;
+
+    /**
+     * the thread serving the admin socket
+     */
+    static Glib::Thread* admin_thread = NULL;
+
+    /**
+     * set to stop the admin thread
+     */
+    static volatile gint admin_stopping = 0;
+
+    /**
+     * a connection to the admin socket
+     */
+    struct admin_connection {
+	/**
+	 * the connected socket
+	 */
+	int fd;
+
+	/**
+	 * what has been received and not yet executed
+	 */
+	std::string received;
+
+	/**
+	 * when the last command has been received
+	 */
+	std::time_t last_active;
+    };
+
+    /**
+     * format the answer to a command
+     */
+    static std::string answer(bool ok, std::string const& message, std::string const& data = std::string()) {
+	return data + (ok ? "OK " : "ERROR ") + message + "\n";
+    }
+
+    /**
+     * format a point in time
+     */
+    static std::string format_time(std::time_t time) {
+	struct std::tm time_tm;
+	gmtime_r(&time, &time_tm);
+	char formatted[128];
+	if (std::strftime(formatted, sizeof(formatted), "%Y-%m-%dT%H:%M:%SZ", &time_tm) == 0) {
+	    return std::string();
+	}
+	return formatted;
+    }
+
+    /**
+     * the thread running the last expire or compact, NULL if none has been started
+     */
+    static Glib::Thread* job_thread = NULL;
+
+    /**
+     * the command run by job_thread, protected by job_mutex
+     */
+    static std::string job_name;
+
+    /**
+     * when job_thread has been started, protected by job_mutex
+     */
+    static std::time_t job_started = 0;
+
+    /**
+     * if job_thread is still running, protected by job_mutex
+     */
+    static bool job_running = false;
+
+    /**
+     * if the job succeeded, protected by job_mutex
+     */
+    static bool job_succeeded = false;
+
+    /**
+     * the result or error message of the job, protected by job_mutex
+     */
+    static std::string job_result;
+
+    /**
+     * protecting the state of the job
+     */
+    static Glib::Mutex job_mutex;
+
+    /**
+     * the days to keep entries for an expire job
+     */
+    static int job_expire_days = 0;
+
+    /**
+     * the hours to keep entries that never passed greylisting for an expire job
+     */
+    static int job_expire_unpassed_hours = 0;
+
+    /**
+     * the thread running an expire or compact
+     */
+    static void run_job() {
+	bool succeeded = true;
+	std::ostringstream result;
+	try {
+	    if (job_name == "expire") {
+		result << timestore::expire_online(job_expire_days, job_expire_unpassed_hours) << " entries expired";
+	    } else {
+		database::compaction_result compaction = database::compact_online();
+		result << compaction.records << " records copied, " << compaction.replayed << " writes replayed, blocked for " << compaction.blocked_us << " us";
+	    }
+	} catch (Glib::ustring msg) {
+	    succeeded = false;
+	    result << msg;
+	}
+
+	Glib::Mutex::Lock lock(job_mutex);
+	job_running = false;
+	job_succeeded = succeeded;
+	job_result = result.str();
+    }
+
+    /**
+     * start an expire or compact in the background, unless one is still running
+     *
+     * @return the answer to the command
+     */
+    static std::string start_job(std::string const& name) {
+	{
+	    Glib::Mutex::Lock lock(job_mutex);
+	    if (job_running) {
+		return answer(false, job_name + " is still running");
+	    }
+	}
+
+	// the previous job has finished
+	if (job_thread) {
+	    job_thread->join();
+	    job_thread = NULL;
+	}
+
+	{
+	    Glib::Mutex::Lock lock(job_mutex);
+	    job_name = name;
+	    job_started = std::time(NULL);
+	    job_running = true;
+	    job_result.erase();
+	}
+	job_thread = Glib::Thread::create(sigc::ptr_fun(&run_job), true);
+	return answer(true, name + " started, see job for its state");
+    }
+
+    std::string admin_socket::execute(std::string const& command, bool& quit) {
+	std::istringstream words(command);
+	std::string verb;
+	words >> verb;
+
+	try {
+	    if (verb.empty()) {
+		return answer(false, "empty command");
+	    } else if (verb == "help") {
+		return answer(true, "help", ADMIN_HELP);
+	    } else if (verb == "quit") {
+		quit = true;
+		return answer(true, "bye");
+	    } else if (verb == "stats") {
+		return answer(true, "stats", statistics::format() + "\n");
+	    } else if (verb == "lookup") {
+		std::string key;
+		words >> key;
+		if (key.empty()) {
+		    return answer(false, "usage: lookup <key>");
+		}
+
+		// only the committer keeps the database open, we do not open it ourselves
+		if (!commit_queue::is_running()) {
+		    return answer(false, "lookup needs --groupcommit, the database is not kept open otherwise");
+		}
+		timestore::entry times;
+		if (!commit_queue(ADMIN_LOOKUP_TIMEOUT_MS).find(key, times)) {
+		    return answer(false, "not found");
+		}
+		return answer(true, "found", "first " + format_time(times.first_connect) + "\nlast " + format_time(times.last_connect) + "\nnetwork " + times.client_network + "\n");
+	    } else if (verb == "whitelist") {
+		std::string action;
+		std::string network;
+		long ttl = 0;
+		words >> action >> network >> ttl;
+
+		if (action == "add" && !network.empty()) {
+		    admin_whitelist->add(network, ttl);
+		    return answer(true, "added");
+		} else if (action == "del" && !network.empty()) {
+		    return admin_whitelist->remove(network) ? answer(true, "removed") : answer(false, "not found");
+		} else if (action == "list") {
+		    return answer(true, "list", admin_whitelist->list());
+		} else if (action == "flush") {
+		    admin_whitelist->clear();
+		    return answer(true, "flushed");
+		}
+		return answer(false, "usage: whitelist add <network> [<ttl>] | del <network> | list | flush");
+	    } else if (verb == "cache") {
+		std::string action;
+		std::string cache;
+		words >> action >> cache;
+
+		if (action == "stats") {
+		    std::ostringstream stats;
+		    stats << "store " << store_client::cached_entries() << " of " << store_client::cache_capacity() << "\n";
+		    stats << "retry " << retry_limiter::tracked_clients() << " of " << retry_limiter::capacity() << "\n";
+		    return answer(true, "cache stats", stats.str());
+		} else if (action == "flush" && (cache.empty() || cache == "store" || cache == "retry")) {
+		    if (cache != "retry") {
+			store_client::flush_cache();
+		    }
+		    if (cache != "store") {
+			retry_limiter::flush();
+		    }
+		    return answer(true, "flushed");
+		} else if (action == "resize" && cache == "store") {
+		    long entries = -1;
+		    words >> entries;
+		    if (entries >= 0) {
+			store_client::resize_cache(entries);
+			return answer(true, "resized");
+		    }
+		}
+		return answer(false, "usage: cache stats | flush [store|retry] | resize store <entries>");
+	    } else if (verb == "expire") {
+		int days = 0;
+		int unpassed_hours = 0;
+		words >> days >> unpassed_hours;
+		if (days <= 0 || unpassed_hours < 0) {
+		    return answer(false, "usage: expire <days> [<hours>]");
+		}
+
+		job_expire_days = days;
+		job_expire_unpassed_hours = unpassed_hours;
+		return start_job("expire");
+	    } else if (verb == "compact") {
+		return start_job("compact");
+	    } else if (verb == "job") {
+		Glib::Mutex::Lock lock(job_mutex);
+		if (!job_thread) {
+		    return answer(true, "idle, no job started");
+		} else if (job_running) {
+		    return answer(true, "running " + job_name + " since " + format_time(job_started));
+		}
+		return answer(job_succeeded, (job_succeeded ? "finished " : "failed ") + job_name + " started " + format_time(job_started), job_result + "\n");
+	    }
+	} catch (Glib::ustring msg) {
+	    return answer(false, msg);
+	}
+
+	return answer(false, "unknown command, try help");
+    }
+
+    /**
+     * read from a connection and execute the complete commands received
+     *
+     * @return false if the connection should be closed
+     */
+    static bool serve_connection(admin_connection& connection) {
+	char buffer[1024];
+	ssize_t bytes_read = ::read(connection.fd, buffer, sizeof(buffer));
+	if (bytes_read <= 0) {
+	    return bytes_read < 0 && errno == EINTR;
+	}
+	connection.received.append(buffer, bytes_read);
+	connection.last_active = std::time(NULL);
+
+	std::string::size_type line_end;
+	while ((line_end = connection.received.find('\n')) != std::string::npos) {
+	    std::string command = connection.received.substr(0, line_end);
+	    connection.received.erase(0, line_end + 1);
+	    if (!command.empty() && command[command.length()-1] == '\r') {
+		command.erase(command.length()-1);
+	    }
+
+	    bool quit = false;
+	    std::string const response = admin_socket::execute(command, quit);
+	    if (::write(connection.fd, response.c_str(), response.length()) != static_cast<ssize_t>(response.length()) || quit) {
+		return false;
+	    }
+	}
+	return true;
+    }
+
+    /**
+     * the admin thread
+     *
+     * All connections are polled together, the commands are executed one after the other.
+     */
+    static void run_admin() {
+	std::list<admin_connection> connections;
+
+	while (!g_atomic_int_get(&admin_stopping)) {
+	    std::vector<struct pollfd> readable(connections.size() + 1);
+	    std::memset(&readable[0], 0, readable.size() * sizeof(struct pollfd));
+	    readable[0].fd = admin_fd;
+	    readable[0].events = POLLIN;
+	    std::vector<struct pollfd>::size_type i = 1;
+	    for (std::list<admin_connection>::const_iterator p = connections.begin(); p != connections.end(); ++p, ++i) {
+		readable[i].fd = p->fd;
+		readable[i].events = POLLIN;
+	    }
+
+	    int ready = ::poll(&readable[0], readable.size(), ADMIN_POLL_INTERVAL_MS);
+	    std::time_t const now = std::time(NULL);
+
+	    // serve the connected clients, drop the idle ones
+	    i = 1;
+	    for (std::list<admin_connection>::iterator p = connections.begin(); p != connections.end(); ++i) {
+		bool keep = true;
+		if (ready > 0 && readable[i].revents) {
+		    keep = serve_connection(*p);
+		} else if (now - p->last_active >= ADMIN_IDLE_TIMEOUT) {
+		    keep = false;
+		}
+
+		if (keep) {
+		    ++p;
+		} else {
+		    ::close(p->fd);
+		    p = connections.erase(p);
+		}
+	    }
+
+	    if (ready > 0 && (readable[0].revents & POLLIN)) {
+		int fd = ::accept(admin_fd, NULL, 0);
+		if (fd != -1 && connections.size() >= ADMIN_MAX_CONNECTIONS) {
+		    ::close(fd);
+		} else if (fd != -1) {
+		    admin_connection connection;
+		    connection.fd = fd;
+		    connection.last_active = now;
+		    connections.push_back(connection);
+		}
+	    }
+	}
+
+	for (std::list<admin_connection>::const_iterator p = connections.begin(); p != connections.end(); ++p) {
+	    ::close(p->fd);
+	}
+    }
+
+    bool admin_socket::send(std::string const& path, std::string const& command, std::string& response) {
+	struct sockaddr_un addr;
+	if (path.length() >= sizeof(addr.sun_path)) {
+	    throw Glib::ustring(N_("Admin socket name to long: ")) + path;
+	}
+
+	int fd = ::socket(PF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+	    throw Glib::ustring(N_("Problem creating a unix domain socket: ")) + std::strerror(errno);
+	}
+
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+	std::string const line = command + "\n";
+	if (::connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) || ::write(fd, line.c_str(), line.length()) != static_cast<ssize_t>(line.length())) {
+	    Glib::ustring msg = Glib::ustring(N_("Could not send command to admin socket ")) + path + ": " + std::strerror(errno);
+	    ::close(fd);
+	    throw msg;
+	}
+
+	// the answer ends with the line starting with OK or ERROR
+	response.erase();
+	std::string::size_type line_start = 0;
+	for (;;) {
+	    std::string::size_type line_end = response.find('\n', line_start);
+	    if (line_end != std::string::npos) {
+		std::string const status = response.substr(line_start, line_end - line_start);
+		if (status.compare(0, 3, "OK ") == 0 || status.compare(0, 6, "ERROR ") == 0) {
+		    ::close(fd);
+		    return status[0] == 'O';
+		}
+		line_start = line_end + 1;
+		continue;
+	    }
+
+	    char buffer[1024];
+	    ssize_t bytes_read = ::read(fd, buffer, sizeof(buffer));
+	    if (bytes_read < 0 && errno == EINTR) {
+		continue;
+	    }
+	    if (bytes_read <= 0) {
+		break;
+	    }
+	    response.append(buffer, bytes_read);
+	}
+
+	::close(fd);
+	throw Glib::ustring(N_("Connection to admin socket closed before the answer was complete: ")) + path;
+    }
+
+    void admin_socket::start(std::string const& path, runtime_whitelist& used_runtime_whitelist) {
+	struct sockaddr_un addr;
+	if (path.length() >= sizeof(addr.sun_path)) {
+	    throw Glib::ustring(N_("Admin socket name to long: ")) + path;
+	}
+
+	// remove a socket left over by a previous instance
+	if (::unlink(path.c_str()) && errno != ENOENT) {
+	    throw Glib::ustring(N_("Problem creating admin socket at location ")) + path + ": " + std::strerror(errno);
+	}
+
+	admin_fd = ::socket(PF_UNIX, SOCK_STREAM, 0);
+	if (admin_fd == -1) {
+	    throw Glib::ustring(N_("Problem creating a unix domain socket: ")) + std::strerror(errno);
+	}
+
+	// only the user running couriergrey may use the socket
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+	mode_t previous_umask = ::umask(S_IRWXG | S_IRWXO);
+	int ret = ::bind(admin_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+	::umask(previous_umask);
+	if (ret || ::chmod(path.c_str(), S_IRUSR | S_IWUSR) || ::listen(admin_fd, 5)) {
+	    Glib::ustring msg = Glib::ustring(N_("Could not create admin socket ")) + path + ": " + std::strerror(errno);
+	    ::close(admin_fd);
+	    admin_fd = -1;
+	    throw msg;
+	}
+
+	struct stat socket_stat;
+	if (::stat(path.c_str(), &socket_stat) == 0) {
+	    admin_inode = socket_stat.st_ino;
+	}
+
+	admin_path = path;
+	admin_whitelist = &used_runtime_whitelist;
+	g_atomic_int_set(&admin_stopping, 0);
+	admin_thread = Glib::Thread::create(sigc::ptr_fun(&run_admin), true);
+    }
+
+    void admin_socket::stop() {
+	if (!admin_thread) {
+	    return;
+	}
+
+	g_atomic_int_set(&admin_stopping, 1);
+	admin_thread->join();
+	admin_thread = NULL;
+
+	// let a running expire or compact finish
+	if (job_thread) {
+	    job_thread->join();
+	    job_thread = NULL;
+	}
+
+	::close(admin_fd);
+	admin_fd = -1;
+
+	// after a handover our successor has already replaced the socket
+	struct stat socket_stat;
+	if (::stat(admin_path.c_str(), &socket_stat) == 0 && socket_stat.st_ino == admin_inode) {
+	    ::unlink(admin_path.c_str());
+	}
+    }
+}
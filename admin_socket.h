@@ -0,0 +1,87 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef ADMIN_SOCKET_H
+#define ADMIN_SOCKET_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <string>
+
+#include <runtime_whitelist.h>
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * the admin socket lets administrators query and control the running daemon
+     *
+     * The socket is only accessible by the user running couriergrey. Commands are
+     * sent one per line; each answer consists of zero or more lines of data, followed
+     * by a line "OK" or "ERROR" and a message. The connections are served by a thread
+     * of their own, executing the commands one after the other. Expiry and compaction
+     * are started in another thread, one at a time, and their state is queried using
+     * the job command, so that they do not block the other connections.
+     */
+    class admin_socket {
+	public:
+	    /**
+	     * create the socket and start the thread serving it
+	     *
+	     * @param path where to create the socket
+	     * @param used_runtime_whitelist the runtime whitelist managed using the socket
+	     * @throws Glib::ustring if the socket cannot be created
+	     */
+	    static void start(std::string const& path, runtime_whitelist& used_runtime_whitelist);
+
+	    /**
+	     * stop the thread and remove the socket
+	     */
+	    static void stop();
+
+	    /**
+	     * execute a command
+	     *
+	     * @param command the command line
+	     * @param quit set to true if the connection should be closed
+	     * @return the answer to send
+	     */
+	    static std::string execute(std::string const& command, bool& quit);
+
+	    /**
+	     * send a command to the admin socket of a running daemon
+	     *
+	     * @param path the location of the admin socket
+	     * @param command the command line, without line feed
+	     * @param response where to store the answer, including the final OK or ERROR line
+	     * @return true if the daemon answered with OK
+	     * @throws Glib::ustring if the daemon cannot be reached
+	     */
+	    static bool send(std::string const& path, std::string const& command, std::string& response);
+    };
+}
+
+#endif // ADMIN_SOCKET_H
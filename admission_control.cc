@@ -0,0 +1,67 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "admission_control.h"
+#include "statistics.h"
+
+namespace couriergrey {
+    admission_control::admission_control(int shed_threshold_ms) : shed_threshold_ms(shed_threshold_ms) {
+    }
+
+    bool admission_control::admit() {
+	struct ::timespec now;
+	::clock_gettime(CLOCK_MONOTONIC, &now);
+
+	Glib::Mutex::Lock lock(queue_mutex);
+
+	// shed if the oldest waiting request has been waiting too long already
+	if (shed_threshold_ms > 0 && !queued.empty()) {
+	    long waiting_ms = (now.tv_sec - queued.front().tv_sec) * 1000 + (now.tv_nsec - queued.front().tv_nsec) / 1000000;
+	    if (waiting_ms > shed_threshold_ms) {
+		statistics::increment(statistics::requests_shed);
+		return false;
+	    }
+	}
+
+	queued.push_back(now);
+	statistics::increment(statistics::requests_accepted);
+	statistics::increment(statistics::requests_in_flight);
+	return true;
+    }
+
+    void admission_control::started() {
+	Glib::Mutex::Lock lock(queue_mutex);
+
+	// requests are started in the order they have been queued
+	if (!queued.empty()) {
+	    queued.pop_front();
+	}
+    }
+
+    void admission_control::finished() {
+	statistics::add(statistics::requests_in_flight, -1);
+    }
+}
@@ -0,0 +1,92 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef ADMISSION_CONTROL_H
+#define ADMISSION_CONTROL_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <deque>
+#include <ctime>
+#include <glibmm.h>
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * admission_control keeps track of the requests waiting for a worker thread
+     *
+     * If the oldest waiting request has been waiting longer than the shed threshold,
+     * the filter is overloaded and new connections should be answered with a tempfail
+     * immediately, instead of queueing them as well.
+     */
+    class admission_control {
+	public:
+	    /**
+	     * create an admission_control instance
+	     *
+	     * @param shed_threshold_ms queueing delay in milliseconds after which connections are shed, 0 to never shed
+	     */
+	    admission_control(int shed_threshold_ms);
+
+	    /**
+	     * check if a newly accepted connection should be processed
+	     *
+	     * If the connection is admitted, it is queued and started() has to be
+	     * called when processing starts, and finished() when it is done.
+	     *
+	     * @return true if the connection is admitted, false if it should be shed
+	     */
+	    bool admit();
+
+	    /**
+	     * a worker started to process the oldest queued request
+	     */
+	    void started();
+
+	    /**
+	     * a worker finished processing a request
+	     */
+	    void finished();
+	private:
+	    /**
+	     * queueing delay after which connections are shed, 0 to never shed
+	     */
+	    long shed_threshold_ms;
+
+	    /**
+	     * when the queued requests have been accepted (oldest first)
+	     */
+	    std::deque<struct ::timespec> queued;
+
+	    /**
+	     * protects queued
+	     */
+	    Glib::Mutex queue_mutex;
+    };
+}
+
+#endif // ADMISSION_CONTROL_H
@@ -0,0 +1,94 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "allocation_counter.h"
+
+#ifdef COUNT_ALLOCATIONS
+
+#include <new>
+#include <cstdlib>
+
+/**
+ * exception specifications of the replaced allocation functions, dynamic ones do not exist since C++17
+ */
+#if __cplusplus < 201103L
+#   define ALLOCATION_THROWS throw(std::bad_alloc)
+#   define ALLOCATION_NOTHROW throw()
+#else
+#   define ALLOCATION_THROWS
+#   define ALLOCATION_NOTHROW noexcept
+#endif
+
+/**
+ * number of allocations done by the current thread
+ */
+static __thread long allocations_in_thread = 0;
+
+void* operator new(std::size_t size) ALLOCATION_THROWS {
+    allocations_in_thread++;
+    void* result = std::malloc(size ? size : 1);
+    if (result == NULL) {
+	throw std::bad_alloc();
+    }
+    return result;
+}
+
+void* operator new[](std::size_t size) ALLOCATION_THROWS {
+    return operator new(size);
+}
+
+void* operator new(std::size_t size, std::nothrow_t const&) ALLOCATION_NOTHROW {
+    allocations_in_thread++;
+    return std::malloc(size ? size : 1);
+}
+
+void* operator new[](std::size_t size, std::nothrow_t const& nothrow) ALLOCATION_NOTHROW {
+    return operator new(size, nothrow);
+}
+
+void operator delete(void* ptr) ALLOCATION_NOTHROW {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) ALLOCATION_NOTHROW {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::nothrow_t const&) ALLOCATION_NOTHROW {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::nothrow_t const&) ALLOCATION_NOTHROW {
+    std::free(ptr);
+}
+
+namespace couriergrey {
+    long allocation_counter::thread_allocations() {
+	return allocations_in_thread;
+    }
+}
+
+#endif // COUNT_ALLOCATIONS
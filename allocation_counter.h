@@ -0,0 +1,52 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef ALLOCATION_COUNTER_H
+#define ALLOCATION_COUNTER_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * count the allocations done using the global operator new
+     *
+     * This is only available if couriergrey has been configured with
+     * --enable-allocation-counter, which replaces the global operator new and delete.
+     * It is meant to verify that the processing of a request does not need the
+     * global heap.
+     */
+    class allocation_counter {
+	public:
+	    /**
+	     * get the number of allocations done by the calling thread so far
+	     */
+	    static long thread_allocations();
+    };
+}
+
+#endif // ALLOCATION_COUNTER_H
@@ -0,0 +1,481 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "client_index.h"
+#include "decision_log.h"
+#include "ip_address.h"
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <cstdio>
+#include <glibmm.h>
+#include <arpa/inet.h>
+
+/**
+ * the name of the file containing the index, next to the greylisting database
+ */
+#define CLIENT_INDEX_FILE_NAME "clientindex.gdbm"
+
+/**
+ * number of prefix bits each level of buckets adds to the one above it
+ */
+#define CLIENT_INDEX_BUCKET_BITS 8
+
+/**
+ * how long the updater tries to open the index, in milliseconds
+ */
+#define CLIENT_INDEX_OPEN_TIMEOUT_MS 1000
+
+/**
+ * how long the updater waits before retrying after a failure, in milliseconds
+ */
+#define CLIENT_INDEX_RETRY_DELAY_MS 1000
+
+/**
+ * maximum number of changes waiting for the updater, further changes are dropped
+ */
+#define CLIENT_INDEX_MAX_QUEUED 100000
+
+/**
+ * how long a lookup waits for the updater to apply the changes queued before it, in milliseconds
+ */
+#define CLIENT_INDEX_FLUSH_TIMEOUT_MS 5000
+
+namespace couriergrey {
+    /**
+     * get the key of the record listing the keys using a client network
+     */
+    static std::string keys_record(std::string const& client_network) {
+	return std::string("k") + '\0' + client_network;
+    }
+
+    /**
+     * get the key of the record listing the contents of a bucket
+     */
+    static std::string bucket_record(std::string const& bucket) {
+	return std::string("b") + '\0' + bucket;
+    }
+
+    /**
+     * get the name of the bucket of a level containing an address
+     */
+    static std::string bucket_name(ip_address const& address, int level) {
+	char network_address[INET6_ADDRSTRLEN];
+	address.masked(level).format(network_address, sizeof(network_address));
+	char name[INET6_ADDRSTRLEN + 8];
+	std::snprintf(name, sizeof(name), "%s/%d", network_address, level);
+	return name;
+    }
+
+    /**
+     * get the level of the bucket listing a client network, the deepest level above its prefix
+     */
+    static int home_level(int prefix) {
+	return prefix > 0 ? (prefix - 1) / CLIENT_INDEX_BUCKET_BITS * CLIENT_INDEX_BUCKET_BITS : 0;
+    }
+
+    /**
+     * split the value of a record into its items, each of them is terminated by a null character
+     */
+    static std::list<std::string> split_items(std::string const& value) {
+	std::list<std::string> items;
+	std::string::size_type start = 0;
+	for (std::string::size_type end = value.find('\0'); end != std::string::npos; end = value.find('\0', start)) {
+	    items.push_back(value.substr(start, end - start));
+	    start = end + 1;
+	}
+	return items;
+    }
+
+    /**
+     * find an item in the value of a record
+     *
+     * @return the position of the item, std::string::npos if it is not contained
+     */
+    static std::string::size_type find_item(std::string const& value, std::string const& item) {
+	std::string const terminated = item + '\0';
+	for (std::string::size_type found = value.find(terminated); found != std::string::npos; found = value.find(terminated, found + 1)) {
+	    if (found == 0 || value[found - 1] == '\0') {
+		return found;
+	    }
+	}
+	return std::string::npos;
+    }
+
+    /**
+     * list a client network in its bucket, and the buckets in the ones above them as far as necessary
+     */
+    static void link_network(database& db, std::string const& client_network) {
+	int prefix = 0;
+	ip_address address("::");
+	try {
+	    address = ip_address::parse_network(client_network, prefix);
+	} catch (std::invalid_argument const&) {
+	    // not a network, it cannot be looked up anyway
+	    return;
+	}
+
+	std::string item = "k" + client_network;
+	for (int level = home_level(prefix); level >= 0; level -= CLIENT_INDEX_BUCKET_BITS) {
+	    std::string const record = bucket_record(bucket_name(address, level));
+	    std::string value = db.fetch(record);
+	    if (find_item(value, item) != std::string::npos) {
+		return;
+	    }
+	    bool const existed = !value.empty();
+	    value.append(item).append(1, '\0');
+	    db.store(record, value);
+
+	    // an existing bucket is already listed above
+	    if (existed) {
+		return;
+	    }
+	    item = "b" + bucket_name(address, level);
+	}
+    }
+
+    /**
+     * remove a client network from its bucket, and drop the buckets that become empty
+     */
+    static void unlink_network(database& db, std::string const& client_network) {
+	int prefix = 0;
+	ip_address address("::");
+	try {
+	    address = ip_address::parse_network(client_network, prefix);
+	} catch (std::invalid_argument const&) {
+	    return;
+	}
+
+	std::string item = "k" + client_network;
+	for (int level = home_level(prefix); level >= 0; level -= CLIENT_INDEX_BUCKET_BITS) {
+	    std::string const record = bucket_record(bucket_name(address, level));
+	    std::string value = db.fetch(record);
+	    std::string::size_type found = find_item(value, item);
+	    if (found == std::string::npos) {
+		return;
+	    }
+	    value.erase(found, item.length() + 1);
+	    if (!value.empty()) {
+		db.store(record, value);
+		return;
+	    }
+	    db.del(record);
+	    item = "b" + bucket_name(address, level);
+	}
+    }
+
+    /**
+     * collect the keys of the client networks in a bucket and the buckets below it, that overlap a network
+     */
+    static void collect_bucket(database& db, std::string const& bucket, ip_address const& network_address, int prefix, std::list<std::pair<std::string, std::string> >& found) {
+	std::list<std::string> const items = split_items(db.fetch(bucket_record(bucket)));
+	for (std::list<std::string>::const_iterator p = items.begin(); p != items.end(); ++p) {
+	    if (p->empty()) {
+		continue;
+	    }
+	    std::string const name = p->substr(1);
+
+	    // the networks overlap if the smaller one is inside the larger one
+	    try {
+		int item_prefix = 0;
+		ip_address item_address = ip_address::parse_network(name, item_prefix);
+		if (!item_address.is_in_net(network_address, std::min(prefix, item_prefix))) {
+		    continue;
+		}
+	    } catch (std::invalid_argument const&) {
+		continue;
+	    }
+
+	    if ((*p)[0] == 'b') {
+		collect_bucket(db, name, network_address, prefix, found);
+		continue;
+	    }
+	    std::list<std::string> const keys = split_items(db.fetch(keys_record(name)));
+	    for (std::list<std::string>::const_iterator key = keys.begin(); key != keys.end(); ++key) {
+		found.push_back(std::make_pair(name, *key));
+	    }
+	}
+    }
+
+    /**
+     * the changes waiting for the updater, protected by updater_mutex
+     */
+    static std::list<client_index::change> queued_changes;
+
+    /**
+     * if changes have been dropped because too many were waiting, protected by updater_mutex
+     */
+    static bool changes_dropped = false;
+
+    /**
+     * number of times changes have been queued, protected by updater_mutex
+     */
+    static unsigned long enqueued_count = 0;
+
+    /**
+     * number of times changes have been queued, that the updater is done with, protected by updater_mutex
+     */
+    static unsigned long done_count = 0;
+
+    /**
+     * protecting queued_changes, changes_dropped, enqueued_count, done_count and updater_stopping
+     */
+    static Glib::Mutex updater_mutex;
+
+    /**
+     * signalled if changes have been queued or the updater should stop
+     */
+    static Glib::Cond updater_wakeup;
+
+    /**
+     * signalled if the updater is done with queued changes
+     */
+    static Glib::Cond updater_done;
+
+    /**
+     * set to stop the updater thread
+     */
+    static bool updater_stopping = false;
+
+    /**
+     * the updater thread
+     */
+    static Glib::Thread* updater_thread = NULL;
+
+    /**
+     * apply changes to the index, without waiting for it longer than CLIENT_INDEX_OPEN_TIMEOUT_MS
+     *
+     * @return true if the changes have been applied
+     */
+    static bool apply_changes(std::list<client_index::change> const& changes) {
+	try {
+	    client_index index(false, CLIENT_INDEX_OPEN_TIMEOUT_MS);
+	    index.update(changes);
+	} catch (Glib::ustring msg) {
+	    decision_log::notice("Could not update the client index: %s", msg.c_str());
+	    return false;
+	}
+	return true;
+    }
+
+    /**
+     * the updater thread
+     */
+    static void run_updater() {
+	Glib::Mutex::Lock lock(updater_mutex);
+
+	for (;;) {
+	    while (queued_changes.empty() && !updater_stopping) {
+		updater_wakeup.wait(updater_mutex);
+	    }
+	    if (queued_changes.empty()) {
+		return;
+	    }
+
+	    std::list<client_index::change> changes;
+	    changes.swap(queued_changes);
+	    changes_dropped = false;
+	    unsigned long const taken_count = enqueued_count;
+	    lock.release();
+	    bool applied = apply_changes(changes);
+	    lock.acquire();
+
+	    if (applied) {
+		done_count = taken_count;
+		updater_done.broadcast();
+		continue;
+	    }
+
+	    // keep the changes for the next attempt, before the ones queued meanwhile
+	    queued_changes.splice(queued_changes.begin(), changes);
+	    if (updater_stopping) {
+		// the index can be rebuilt, the entries are what counts
+		decision_log::notice("Dropping %lu client index changes at shutdown", static_cast<unsigned long>(queued_changes.size()));
+		queued_changes.clear();
+		done_count = enqueued_count;
+		updater_done.broadcast();
+		return;
+	    }
+	    Glib::TimeVal until;
+	    until.assign_current_time();
+	    until.add_milliseconds(CLIENT_INDEX_RETRY_DELAY_MS);
+	    while (!updater_stopping && updater_wakeup.timed_wait(updater_mutex, until))
+		;
+	}
+    }
+
+    client_index::client_index(bool read_only, int timeout_ms) : db(NULL), read_only(read_only), timeout_ms(timeout_ms) {
+	::clock_gettime(CLOCK_MONOTONIC, &created);
+    }
+
+    client_index::~client_index() {
+	delete db;
+	db = NULL;
+    }
+
+    database& client_index::get_db() {
+	if (!db) {
+	    // what is left of the time we have been given
+	    int remaining_ms = timeout_ms;
+	    if (timeout_ms >= 0) {
+		struct ::timespec now;
+		::clock_gettime(CLOCK_MONOTONIC, &now);
+		long elapsed_ms = (now.tv_sec - created.tv_sec) * 1000L + (now.tv_nsec - created.tv_nsec) / 1000000L;
+		remaining_ms = elapsed_ms < timeout_ms ? timeout_ms - elapsed_ms : 0;
+	    }
+
+	    db = new database(database::get_directory() + "/" CLIENT_INDEX_FILE_NAME, remaining_ms, read_only);
+	}
+	return *db;
+    }
+
+    void client_index::add(std::string const& client_network, std::string const& key) {
+	std::list<change> changes(1);
+	changes.back().client_network = client_network;
+	changes.back().key = key;
+	changes.back().added = true;
+	update(changes);
+    }
+
+    void client_index::remove(std::string const& client_network, std::string const& key) {
+	std::list<change> changes(1);
+	changes.back().client_network = client_network;
+	changes.back().key = key;
+	changes.back().added = false;
+	update(changes);
+    }
+
+    void client_index::update(std::list<change> const& changes) {
+	// the changes of each client network, so that its record is written only once
+	std::map<std::string, std::list<change const*> > by_network;
+	for (std::list<change>::const_iterator p = changes.begin(); p != changes.end(); ++p) {
+	    by_network[p->client_network].push_back(&*p);
+	}
+
+	database& index_db = get_db();
+	for (std::map<std::string, std::list<change const*> >::const_iterator network = by_network.begin(); network != by_network.end(); ++network) {
+	    std::string const record = keys_record(network->first);
+	    std::string value = index_db.fetch(record);
+	    bool const existed = !value.empty();
+
+	    for (std::list<change const*>::const_iterator p = network->second.begin(); p != network->second.end(); ++p) {
+		std::string::size_type found = find_item(value, (*p)->key);
+		if ((*p)->added && found == std::string::npos) {
+		    value.append((*p)->key).append(1, '\0');
+		} else if (!(*p)->added && found != std::string::npos) {
+		    value.erase(found, (*p)->key.length() + 1);
+		}
+	    }
+
+	    // the buckets only list the client networks that have keys
+	    if (!value.empty()) {
+		index_db.store(record, value);
+		if (!existed) {
+		    link_network(index_db, network->first);
+		}
+	    } else if (existed) {
+		index_db.del(record);
+		unlink_network(index_db, network->first);
+	    }
+	}
+    }
+
+    std::list<std::pair<std::string, std::string> > client_index::lookup(std::string const& network) {
+	int prefix = 0;
+	ip_address network_address("::");
+	try {
+	    network_address = ip_address::parse_network(network, prefix);
+	} catch (std::invalid_argument const&) {
+	    throw Glib::ustring(N_("Not a valid address or network: ")) + network;
+	}
+
+	// walk down from the top bucket of the address family, only into the buckets overlapping the network
+	std::list<std::pair<std::string, std::string> > found;
+	collect_bucket(get_db(), bucket_name(network_address, 0), network_address, prefix, found);
+	return found;
+    }
+
+    void client_index::start_updater() {
+	updater_stopping = false;
+	updater_thread = Glib::Thread::create(sigc::ptr_fun(&run_updater), true);
+    }
+
+    void client_index::stop_updater() {
+	if (!updater_thread) {
+	    return;
+	}
+
+	{
+	    Glib::Mutex::Lock lock(updater_mutex);
+	    updater_stopping = true;
+	    updater_wakeup.signal();
+	}
+	updater_thread->join();
+	updater_thread = NULL;
+    }
+
+    bool client_index::updater_running() {
+	return updater_thread != NULL;
+    }
+
+    void client_index::enqueue(std::list<change> const& changes) {
+	Glib::Mutex::Lock lock(updater_mutex);
+
+	// the index can be rebuilt, but memory must not grow while it cannot be opened
+	if (queued_changes.size() + changes.size() > CLIENT_INDEX_MAX_QUEUED) {
+	    if (!changes_dropped) {
+		decision_log::notice("Too many client index changes waiting, dropping changes until the index can be updated again");
+		changes_dropped = true;
+	    }
+	    return;
+	}
+
+	queued_changes.insert(queued_changes.end(), changes.begin(), changes.end());
+	enqueued_count++;
+	updater_wakeup.signal();
+    }
+
+    void client_index::flush() {
+	if (!updater_running()) {
+	    return;
+	}
+
+	Glib::Mutex::Lock lock(updater_mutex);
+	unsigned long const target_count = enqueued_count;
+	Glib::TimeVal until;
+	until.assign_current_time();
+	until.add_milliseconds(CLIENT_INDEX_FLUSH_TIMEOUT_MS);
+	while (done_count < target_count && updater_done.timed_wait(updater_mutex, until))
+	    ;
+    }
+
+    void client_index::clear() {
+	std::list<std::string> const records = get_db().get_keys();
+	for (std::list<std::string>::const_iterator p = records.begin(); p != records.end(); ++p) {
+	    get_db().del(*p);
+	}
+    }
+}
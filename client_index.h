@@ -0,0 +1,193 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef CLIENT_INDEX_H
+#define CLIENT_INDEX_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <string>
+#include <list>
+#include <utility>
+#include <ctime>
+
+#include <database.h>
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * secondary index of the greylisting database by client network
+     *
+     * The index is kept in a separate database file. For each client network
+     * (address/prefix) there is a record listing the keys of the greylisting
+     * database using it. The client networks are listed in buckets of fixed
+     * prefix lengths (every eight bits), each bucket also lists the buckets
+     * below it that are not empty. A lookup walks down from the top bucket of
+     * the address family and only fetches the buckets and client networks
+     * overlapping the network it looks for. The index file is only opened when
+     * it is used.
+     */
+    class client_index {
+	public:
+	    /**
+	     * a change of the index
+	     */
+	    struct change {
+		/**
+		 * the client network the key is indexed for
+		 */
+		std::string client_network;
+
+		/**
+		 * the key of the greylisting database
+		 */
+		std::string key;
+
+		/**
+		 * if the key is added to the index, or removed
+		 */
+		bool added;
+	    };
+
+	    /**
+	     * create an index instance
+	     *
+	     * @param read_only open the index as reader, it cannot be changed then
+	     * @param timeout_ms how long, counted from now, we may try to open the index in milliseconds, -1 for the default retries
+	     */
+	    client_index(bool read_only = false, int timeout_ms = -1);
+
+	    /**
+	     * destruct an index instance
+	     */
+	    ~client_index();
+
+	    /**
+	     * add a key to the index
+	     *
+	     * @param client_network the client network used by the key
+	     * @param key the key of the greylisting database
+	     */
+	    void add(std::string const& client_network, std::string const& key);
+
+	    /**
+	     * remove a key from the index
+	     *
+	     * @param client_network the client network used by the key
+	     * @param key the key of the greylisting database
+	     */
+	    void remove(std::string const& client_network, std::string const& key);
+
+	    /**
+	     * add and remove several keys at once, the record of each client network is written once
+	     *
+	     * @param changes the changes, in the order they have been made
+	     */
+	    void update(std::list<change> const& changes);
+
+	    /**
+	     * get the indexed keys of client networks overlapping a network
+	     *
+	     * @param network a single address or address/prefix
+	     * @return pairs of the client network as stored in the index and the key using it
+	     * @throws Glib::ustring if network is not valid
+	     */
+	    std::list<std::pair<std::string, std::string> > lookup(std::string const& network);
+
+	    /**
+	     * remove all entries from the index
+	     */
+	    void clear();
+
+	    /**
+	     * start the thread updating the index in the background
+	     *
+	     * Changes passed to enqueue() are applied by this thread, that waits for the
+	     * index only for a limited time and retries later if it cannot be opened.
+	     */
+	    static void start_updater();
+
+	    /**
+	     * stop the updater thread after trying once more to apply the queued changes
+	     */
+	    static void stop_updater();
+
+	    /**
+	     * check if the updater thread is running
+	     */
+	    static bool updater_running();
+
+	    /**
+	     * queue changes for the updater thread
+	     *
+	     * @param changes the changes, in the order they have been made
+	     */
+	    static void enqueue(std::list<change> const& changes);
+
+	    /**
+	     * wait for a limited time until the updater thread has applied the changes queued so far
+	     */
+	    static void flush();
+	private:
+	    /**
+	     * the database of the index, NULL if not yet opened
+	     */
+	    database* db;
+
+	    /**
+	     * if the index is opened as reader
+	     */
+	    bool read_only;
+
+	    /**
+	     * how long we may try to open the index in milliseconds, -1 for the default retries
+	     */
+	    int timeout_ms;
+
+	    /**
+	     * when the instance has been created, the timeout is counted from then
+	     */
+	    struct ::timespec created;
+
+	    /**
+	     * get the database of the index, opening it if necessary
+	     */
+	    database& get_db();
+
+	    /**
+	     * instances cannot be copied
+	     */
+	    client_index(client_index const&);
+
+	    /**
+	     * instances cannot be assigned
+	     */
+	    client_index& operator=(client_index const&);
+    };
+}
+
+#endif // CLIENT_INDEX_H
@@ -0,0 +1,473 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "commit_queue.h"
+#include "decision_log.h"
+#include "statistics.h"
+#include "triplet_cache.h"
+#include "probes.h"
+#include <map>
+#include <glibmm.h>
+
+/**
+ * how long to wait before retrying to commit a batch after a failure, in milliseconds
+ */
+#define COMMIT_RETRY_DELAY_MS 100
+
+/**
+ * how long the committer tries to open the database, in milliseconds
+ */
+#define COMMIT_OPEN_TIMEOUT_MS 1000
+
+/**
+ * how long the database is kept open before it is released to others, in milliseconds
+ */
+#define COMMIT_HOLD_MS 1000
+
+/**
+ * how long the database is left closed after it has been released, in milliseconds
+ */
+#define COMMIT_RELEASE_MS 100
+
+/**
+ * how long workers wait for the database by default, in milliseconds
+ */
+#define COMMIT_READ_TIMEOUT_MS 10000
+
+namespace couriergrey {
+    /**
+     * the writes of a batch, a later write of a key replaces the earlier
+     */
+    typedef std::map<std::string, timestore::entry> write_batch;
+
+    /**
+     * the writes waiting for the next batch, protected by queue_mutex
+     */
+    static write_batch pending;
+
+    /**
+     * the writes currently being committed, only changed by the committer while holding queue_mutex
+     */
+    static write_batch committing;
+
+    /**
+     * protecting pending, committing and committer_stopping
+     */
+    static Glib::Mutex queue_mutex;
+
+    /**
+     * signalled if writes have been queued or the committer should stop
+     */
+    static Glib::Cond queue_wakeup;
+
+    /**
+     * set to stop the committer thread
+     */
+    static bool committer_stopping = false;
+
+    /**
+     * the committer thread
+     */
+    static Glib::Thread* committer_thread = NULL;
+
+    /**
+     * how long the committer waits for more writes to join a batch, in milliseconds
+     */
+    static int batch_delay_ms = 0;
+
+    /**
+     * if batches are synced to disk
+     */
+    static bool sync_batches = false;
+
+    /**
+     * the database kept open by the committer, NULL if it is closed, only used while holding database_in_use
+     */
+    static timestore* shared_database = NULL;
+
+    /**
+     * when shared_database has been opened
+     */
+    static struct ::timespec shared_database_opened;
+
+    /**
+     * when shared_database has been closed the last time
+     */
+    static struct ::timespec shared_database_released;
+
+    /**
+     * if a thread is using shared_database, protected by database_mutex
+     */
+    static bool database_in_use = false;
+
+    /**
+     * if the committer is waiting for shared_database, workers let it go first, protected by database_mutex
+     */
+    static bool committer_waiting = false;
+
+    /**
+     * protecting database_in_use and committer_waiting
+     */
+    static Glib::Mutex database_mutex;
+
+    /**
+     * signalled if shared_database is not in use anymore
+     */
+    static Glib::Cond database_available;
+
+    /**
+     * milliseconds since a point in time on the monotonic clock
+     */
+    static long elapsed_ms(struct ::timespec const& since) {
+	struct ::timespec now;
+	::clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since.tv_sec) * 1000L + (now.tv_nsec - since.tv_nsec) / 1000000L;
+    }
+
+    /**
+     * wait until shared_database can be used
+     *
+     * @param timeout_ms how long to wait in milliseconds, -1 to wait as long as necessary
+     * @param committer if the committer is waiting, which is not kept waiting by workers
+     * @return true if shared_database can be used now, false if the time is up
+     */
+    static bool acquire_database(long timeout_ms, bool committer) {
+	Glib::Mutex::Lock lock(database_mutex);
+
+	Glib::TimeVal until;
+	until.assign_current_time();
+	until.add_milliseconds(timeout_ms);
+	if (committer) {
+	    committer_waiting = true;
+	}
+	while (database_in_use || (!committer && committer_waiting)) {
+	    if (timeout_ms < 0) {
+		database_available.wait(database_mutex);
+	    } else if (!database_available.timed_wait(database_mutex, until)) {
+		if (committer) {
+		    committer_waiting = false;
+		}
+		return false;
+	    }
+	}
+	if (committer) {
+	    committer_waiting = false;
+	}
+	database_in_use = true;
+	return true;
+    }
+
+    /**
+     * stop using shared_database, and close it if it has been held long enough
+     *
+     * @param close close it in any case
+     */
+    static void release_database(bool close) {
+	if (shared_database && (close || elapsed_ms(shared_database_opened) >= COMMIT_HOLD_MS)) {
+	    delete shared_database;
+	    shared_database = NULL;
+	    ::clock_gettime(CLOCK_MONOTONIC, &shared_database_released);
+	}
+
+	Glib::Mutex::Lock lock(database_mutex);
+	database_in_use = false;
+	database_available.broadcast();
+    }
+
+    /**
+     * get shared_database, opening it if necessary (it has to be acquired)
+     *
+     * @param timeout_ms how long to try opening the database in milliseconds
+     * @throws Glib::ustring if the database cannot be opened in time
+     */
+    static timestore& open_database(long timeout_ms) {
+	if (shared_database) {
+	    return *shared_database;
+	}
+
+	// give the others their turn, after the database has been released
+	long const released_ms = elapsed_ms(shared_database_released);
+	if (released_ms < COMMIT_RELEASE_MS) {
+	    long const pause_ms = COMMIT_RELEASE_MS - released_ms;
+	    if (pause_ms >= timeout_ms) {
+		throw Glib::ustring(N_("The database is released to other processes currently"));
+	    }
+	    struct ::timespec pause;
+	    pause.tv_sec = pause_ms / 1000;
+	    pause.tv_nsec = (pause_ms % 1000) * 1000000L;
+	    ::nanosleep(&pause, NULL);
+	    timeout_ms -= pause_ms;
+	}
+
+	shared_database = new timestore(timeout_ms);
+	::clock_gettime(CLOCK_MONOTONIC, &shared_database_opened);
+	return *shared_database;
+    }
+
+    /**
+     * get the value of an uncommitted write, the caller has to hold queue_mutex
+     */
+    static bool find_queued(std::string const& key, timestore::entry& value) {
+	write_batch::const_iterator p = pending.find(key);
+	if (p != pending.end()) {
+	    value = p->second;
+	    return true;
+	}
+
+	p = committing.find(key);
+	if (p != committing.end()) {
+	    value = p->second;
+	    return true;
+	}
+
+	return false;
+    }
+
+    /**
+     * write a batch to the database
+     *
+     * @return true if the batch has been written
+     */
+    static bool commit_batch(write_batch const& batch) {
+	acquire_database(-1, true);
+	try {
+	    timestore& db = open_database(COMMIT_OPEN_TIMEOUT_MS);
+	    for (write_batch::const_iterator p = batch.begin(); p != batch.end(); ++p) {
+		db.store(p->first, p->second.first_connect, p->second.last_connect, p->second.client_network);
+	    }
+	    if (sync_batches) {
+		db.sync();
+	    }
+	} catch (Glib::ustring msg) {
+	    release_database(true);
+	    decision_log::notice("Could not commit %lu writes: %s", static_cast<unsigned long>(batch.size()), msg.c_str());
+	    return false;
+	}
+	release_database(false);
+
+	statistics::increment(statistics::commit_batches);
+	statistics::add(statistics::commit_writes, batch.size());
+	return true;
+    }
+
+    /**
+     * wait until a point in time, unless the committer is stopped
+     */
+    static void wait_unless_stopping(int milliseconds) {
+	Glib::TimeVal until;
+	until.assign_current_time();
+	until.add_milliseconds(milliseconds);
+	while (!committer_stopping && queue_wakeup.timed_wait(queue_mutex, until))
+	    ;
+    }
+
+    /**
+     * the committer thread
+     */
+    static void run_committer() {
+	Glib::Mutex::Lock lock(queue_mutex);
+
+	for (;;) {
+	    // nothing to write for a while? let others use the database meanwhile
+	    while (pending.empty() && !committer_stopping) {
+		Glib::TimeVal idle_until;
+		idle_until.assign_current_time();
+		idle_until.add_milliseconds(COMMIT_HOLD_MS);
+		if (!queue_wakeup.timed_wait(queue_mutex, idle_until)) {
+		    lock.release();
+		    acquire_database(-1, true);
+		    release_database(true);
+		    lock.acquire();
+		}
+	    }
+	    if (pending.empty()) {
+		// never wait for the database while holding queue_mutex, readers holding the database look up queued writes
+		lock.release();
+		acquire_database(-1, true);
+		release_database(true);
+		return;
+	    }
+
+	    // give other workers the chance to add their writes to the batch
+	    if (batch_delay_ms > 0) {
+		wait_unless_stopping(batch_delay_ms);
+	    }
+
+	    committing.swap(pending);
+	    lock.release();
+	    bool committed = commit_batch(committing);
+	    lock.acquire();
+
+	    if (!committed) {
+		// keep the writes for the next batch, unless there is a newer write for the key
+		pending.insert(committing.begin(), committing.end());
+		if (committer_stopping) {
+		    decision_log::notice("Dropping %lu uncommitted writes at shutdown", static_cast<unsigned long>(pending.size()));
+		    pending.clear();
+		} else {
+		    wait_unless_stopping(COMMIT_RETRY_DELAY_MS);
+		}
+	    }
+	    committing.clear();
+	}
+    }
+
+    void commit_queue::start(int max_delay_ms, bool sync) {
+	batch_delay_ms = max_delay_ms;
+	sync_batches = sync;
+	committer_stopping = false;
+
+	// create the database if it does not exist yet
+	{
+	    timestore db;
+	}
+
+	committer_thread = Glib::Thread::create(sigc::ptr_fun(&run_committer), true);
+    }
+
+    void commit_queue::stop() {
+	if (!committer_thread) {
+	    return;
+	}
+
+	{
+	    Glib::Mutex::Lock lock(queue_mutex);
+	    committer_stopping = true;
+	    queue_wakeup.signal();
+	}
+	committer_thread->join();
+	committer_thread = NULL;
+    }
+
+    bool commit_queue::is_running() {
+	return committer_thread != NULL;
+    }
+
+    void commit_queue::enqueue(std::string const& key, timestore::entry const& value) {
+	Glib::Mutex::Lock lock(queue_mutex);
+	pending[key] = value;
+	queue_wakeup.signal();
+    }
+
+    void commit_queue::enqueue(key const* keys, std::size_t count, timestore::entry const* values) {
+	Glib::Mutex::Lock lock(queue_mutex);
+	for (std::size_t i = 0; i < count; i++) {
+	    pending[std::string(keys[i].data, keys[i].length)] = values[i];
+	}
+	queue_wakeup.signal();
+    }
+
+    bool commit_queue::lookup(std::string const& key, timestore::entry& value) {
+	Glib::Mutex::Lock lock(queue_mutex);
+	return find_queued(key, value);
+    }
+
+    std::size_t commit_queue::lookup(key const* keys, std::size_t count, timestore::entry* values) {
+	Glib::Mutex::Lock lock(queue_mutex);
+
+	std::size_t found_count = 0;
+	for (std::size_t i = 0; i < count; i++) {
+	    if (find_queued(std::string(keys[i].data, keys[i].length), values[i])) {
+		found_count++;
+	    }
+	}
+	return found_count;
+    }
+
+    commit_queue::commit_queue(int timeout_ms) : timeout_ms(timeout_ms) {
+	::clock_gettime(CLOCK_MONOTONIC, &created);
+    }
+
+    void commit_queue::fetch_entries(key const* keys, std::size_t count, entry* values) const {
+	// writes that have not been committed yet are newer than the database content
+	if (lookup(keys, count, values) == count) {
+	    return;
+	}
+
+	// a key may have been queued meanwhile, the queued write is still the newer one
+	timestore& db = use_database();
+	try {
+	    for (std::size_t i = 0; i < count; i++) {
+		std::string const name(keys[i].data, keys[i].length);
+		if (!lookup(name, values[i])) {
+		    values[i] = db.fetch_entry(name);
+		}
+	    }
+	} catch (Glib::ustring) {
+	    release_database(true);
+	    throw;
+	}
+	release_database(false);
+    }
+
+    bool commit_queue::find(std::string const& key, entry& value) const {
+	// writes that have not been committed yet are newer than the database content
+	if (lookup(key, value)) {
+	    return true;
+	}
+
+	timestore& db = use_database();
+	bool found = false;
+	try {
+	    found = db.contains(key);
+	    if (found) {
+		value = db.fetch_entry(key);
+	    }
+	} catch (Glib::ustring) {
+	    release_database(true);
+	    throw;
+	}
+	release_database(false);
+
+	return found;
+    }
+
+    timestore& commit_queue::use_database() const {
+	// what is left of the time we have been given
+	long const total_ms = timeout_ms < 0 ? COMMIT_READ_TIMEOUT_MS : timeout_ms;
+	long const remaining_ms = total_ms - elapsed_ms(created);
+	if (remaining_ms <= 0 || !acquire_database(remaining_ms, false)) {
+	    throw Glib::ustring(N_("Timeout waiting for the database"));
+	}
+
+	try {
+	    long const open_timeout_ms = total_ms - elapsed_ms(created);
+	    return open_database(open_timeout_ms > 0 ? open_timeout_ms : 0);
+	} catch (Glib::ustring) {
+	    release_database(true);
+	    throw;
+	}
+    }
+
+    void commit_queue::store_entries(key const* keys, std::size_t count, entry const* values) {
+	// let the committer write them together with the writes of other requests
+	for (std::size_t i = 0; i < count; i++) {
+	    COURIERGREY_PROBE2(timestore_store, keys[i].length, 1);
+	    triplet_cache::store(keys[i].data, keys[i].length, values[i]);
+	}
+	enqueue(keys, count, values);
+    }
+}
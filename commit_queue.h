@@ -0,0 +1,167 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef COMMIT_QUEUE_H
+#define COMMIT_QUEUE_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <string>
+#include <vector>
+#include <ctime>
+
+#include <timestore.h>
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * the commit_queue collects the writes of all workers and commits them in batches
+     *
+     * Workers put their writes into the queue and continue. A committer thread takes
+     * all queued writes and writes them to the database at once. The database is
+     * kept open as writer between the batches, and workers read through the same
+     * handle instead of opening the database themselves, so that the committer is
+     * not kept from the writer lock by their reads. The handle is closed for a short
+     * time after it has been held for a second, or when it is not used, to let
+     * others (e.g. expiry, compaction or the command line tools) use the database.
+     * Writes that have not yet been committed are still found by lookup() and
+     * fetch_entries(), so workers read their own writes and those of the others.
+     *
+     * Writes that are queued when the process dies are lost.
+     */
+    class commit_queue : public entry_store {
+	public:
+	    /**
+	     * start the committer thread
+	     *
+	     * @param max_delay_ms how long the committer waits for more writes to join a batch
+	     * @param sync if each batch should be synced to disk before the next one is started
+	     * @throws Glib::ustring if the database cannot be opened
+	     */
+	    static void start(int max_delay_ms, bool sync);
+
+	    /**
+	     * stop the committer thread after all queued writes have been committed
+	     */
+	    static void stop();
+
+	    /**
+	     * check if writes are queued (i.e. the committer thread is running)
+	     */
+	    static bool is_running();
+
+	    /**
+	     * queue a write
+	     *
+	     * A queued write replaces an earlier queued write of the same key.
+	     *
+	     * @param key the key to write
+	     * @param value the value to write
+	     */
+	    static void enqueue(std::string const& key, timestore::entry const& value);
+
+	    /**
+	     * queue the writes of several keys at once
+	     *
+	     * @param keys the keys to write
+	     * @param count the number of keys
+	     * @param values the values to write, in the order of the keys
+	     */
+	    static void enqueue(key const* keys, std::size_t count, timestore::entry const* values);
+
+	    /**
+	     * get the value of a write that has not been committed yet
+	     *
+	     * @param key the key to look for
+	     * @param value where to store the value
+	     * @return true if there is an uncommitted write for the key
+	     */
+	    static bool lookup(std::string const& key, timestore::entry& value);
+
+	    /**
+	     * get the values of uncommitted writes of several keys at once
+	     *
+	     * @param keys the keys to look for
+	     * @param count the number of keys
+	     * @param values where to store the values, in the order of the keys, left unchanged for keys without an uncommitted write
+	     * @return number of keys that have an uncommitted write
+	     */
+	    static std::size_t lookup(key const* keys, std::size_t count, timestore::entry* values);
+
+	    /**
+	     * create an instance to read and write through the committer
+	     *
+	     * @param timeout_ms how long, counted from now, we may wait for the database in milliseconds, -1 for the default
+	     */
+	    commit_queue(int timeout_ms = -1);
+
+	    using entry_store::fetch_entries;
+	    using entry_store::store_entries;
+
+	    /**
+	     * fetch the entries of several keys, from the queued writes or the database of the committer
+	     *
+	     * @throws Glib::ustring if the database cannot be used in time
+	     */
+	    void fetch_entries(key const* keys, std::size_t count, entry* values) const;
+
+	    /**
+	     * get the entry of a key, from the queued writes or the database of the committer
+	     *
+	     * @param key the key to look for
+	     * @param value where to store the entry
+	     * @return false if there is no entry for the key
+	     * @throws Glib::ustring if the database cannot be used in time
+	     */
+	    bool find(std::string const& key, entry& value) const;
+
+	    /**
+	     * queue the writes of several keys
+	     */
+	    void store_entries(key const* keys, std::size_t count, entry const* values);
+	private:
+	    /**
+	     * wait for the database of the committer, within the time we have been given
+	     *
+	     * @return the database, that has to be released again after use
+	     * @throws Glib::ustring if the database cannot be used in time
+	     */
+	    timestore& use_database() const;
+
+	    /**
+	     * how long we may wait for the database in milliseconds, -1 for the default
+	     */
+	    int timeout_ms;
+
+	    /**
+	     * when the instance has been created, the timeout is counted from then
+	     */
+	    struct ::timespec created;
+    };
+}
+
+#endif // COMMIT_QUEUE_H
@@ -0,0 +1,112 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "compactor.h"
+#include "database.h"
+#include "decision_log.h"
+#include "statistics.h"
+#include <glibmm.h>
+
+namespace couriergrey {
+    /**
+     * the thread compacting the database
+     */
+    static Glib::Thread* compactor_thread = NULL;
+
+    /**
+     * time between two compactions in seconds
+     */
+    static long compaction_interval = 0;
+
+    /**
+     * set to stop the compactor thread, protected by compactor_mutex
+     */
+    static bool compactor_stopping = false;
+
+    /**
+     * protecting compactor_stopping
+     */
+    static Glib::Mutex compactor_mutex;
+
+    /**
+     * signalled if the compactor thread should stop
+     */
+    static Glib::Cond compactor_wakeup;
+
+    /**
+     * the compactor thread
+     */
+    static void run_compactions() {
+	Glib::Mutex::Lock lock(compactor_mutex);
+
+	for (;;) {
+	    // wait for the next compaction to be due
+	    Glib::TimeVal due;
+	    due.assign_current_time();
+	    due.add_seconds(compaction_interval);
+	    while (!compactor_stopping && compactor_wakeup.timed_wait(compactor_mutex, due))
+		;
+	    if (compactor_stopping) {
+		return;
+	    }
+
+	    lock.release();
+	    try {
+		database::compaction_result result = database::compact_online();
+		statistics::increment(statistics::compactions);
+		decision_log::notice("Compacted database: %ld records copied, %ld writes replayed, blocked for %ld us", result.records, result.replayed, result.blocked_us);
+	    } catch (Glib::ustring msg) {
+		statistics::increment(statistics::compactions_failed);
+		decision_log::notice("Could not compact database: %s", msg.c_str());
+	    }
+	    lock.acquire();
+	}
+    }
+
+    void compactor::start(int interval_minutes) {
+	if (interval_minutes <= 0) {
+	    return;
+	}
+
+	compaction_interval = interval_minutes * 60L;
+	compactor_stopping = false;
+	compactor_thread = Glib::Thread::create(sigc::ptr_fun(&run_compactions), true);
+    }
+
+    void compactor::stop() {
+	if (!compactor_thread) {
+	    return;
+	}
+
+	{
+	    Glib::Mutex::Lock lock(compactor_mutex);
+	    compactor_stopping = true;
+	    compactor_wakeup.signal();
+	}
+	compactor_thread->join();
+	compactor_thread = NULL;
+    }
+}
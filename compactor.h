@@ -0,0 +1,56 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef COMPACTOR_H
+#define COMPACTOR_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * the compactor periodically compacts the database in the background
+     *
+     * The database stays in use while it is compacted, see database::compact_online().
+     */
+    class compactor {
+	public:
+	    /**
+	     * start the compactor thread
+	     *
+	     * @param interval_minutes time between two compactions, 0 to not compact the database
+	     */
+	    static void start(int interval_minutes);
+
+	    /**
+	     * stop the compactor thread, waiting for a running compaction to finish
+	     */
+	    static void stop();
+    };
+}
+
+#endif // COMPACTOR_H
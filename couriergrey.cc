@@ -38,28 +38,323 @@
 #include <poll.h>
 #include <glibmm.h>
 #include <list>
+#include <sstream>
 #include <syslog.h>
 #include <netinet/in.h>
 #include <popt.h>
+#include <csignal>
+#include <fcntl.h>
 
 #define SOCKET_BACKLOG_SIZE 10
 
+/**
+ * set by the signal handler when the request traces should be dumped
+ */
+static volatile std::sig_atomic_t dump_traces_requested = 0;
+
+/**
+ * set by the signal handler when the statistics should be logged
+ */
+static volatile std::sig_atomic_t log_statistics_requested = 0;
+
+/**
+ * set by the signal handler when we should hand over to a new instance
+ */
+static volatile std::sig_atomic_t handover_requested = 0;
+
+/**
+ * the signal handlers write to this pipe to wake up the main loop, -1 if there is none
+ *
+ * Any of our threads may get a signal, so the poll() of the main loop is not
+ * necessarily interrupted by it.
+ */
+static int signal_pipe[2] = { -1, -1 };
+
+/**
+ * wake up the main loop from a signal handler
+ */
+static void wake_main_loop() {
+    if (signal_pipe[1] == -1) {
+	return;
+    }
+
+    int saved_errno = errno;
+    char wakeup = 0;
+    if (::write(signal_pipe[1], &wakeup, 1) < 0) {
+	// the pipe is full, the main loop wakes up anyway
+    }
+    errno = saved_errno;
+}
+
+/**
+ * signal handler for SIGUSR1
+ */
+static void request_trace_dump(int) {
+    dump_traces_requested = 1;
+    wake_main_loop();
+}
+
+/**
+ * signal handler for SIGUSR2
+ */
+static void statistics_log(int) {
+    log_statistics_requested = 1;
+    wake_main_loop();
+}
+
+/**
+ * signal handler for SIGHUP
+ */
+static void handover_request(int) {
+    handover_requested = 1;
+    wake_main_loop();
+}
+
+/**
+ * set by the signal handler when we should stop (in prefork mode)
+ */
+static volatile std::sig_atomic_t terminate_requested = 0;
+
+/**
+ * signal handler for SIGTERM
+ */
+static void terminate_request(int) {
+    terminate_requested = 1;
+}
+
+/**
+ * signal handler for SIGCHLD, only there to interrupt waiting
+ */
+static void child_exited(int) {
+}
+
+/**
+ * install a signal handler
+ *
+ * The handler is installed without SA_RESTART, so that waiting for I/O events in
+ * the thread getting the signal is interrupted.
+ */
+static void install_handler(int signum, void (*handler)(int)) {
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = handler;
+    ::sigemptyset(&action.sa_mask);
+    ::sigaction(signum, &action, NULL);
+}
+
+/**
+ * print a database entry the way --dumpdatabase does
+ */
+static void print_entry(std::string const& key, couriergrey::timestore::entry const& times) {
+    std::cout << key << std::endl;
+    struct std::tm first_time_tm;
+    gmtime_r(&times.first_connect, &first_time_tm);
+    struct std::tm last_time_tm;
+    gmtime_r(&times.last_connect, &last_time_tm);
+    char first_time[128];
+    char last_time[128];
+    std::size_t first_time_size = strftime(first_time, sizeof(first_time), "%Y-%m-%dT%H:%M:%SZ", &first_time_tm);
+    std::size_t last_time_size = strftime(last_time, sizeof(last_time), "%Y-%m-%dT%H:%M:%SZ", &last_time_tm);
+    if (times.last_connect - times.first_connect >= 120) {
+	std::cout << " A";
+    }
+    std::cout << "\t";
+    if (first_time_size > 0) {
+	std::cout << first_time << " ";
+    }
+    if (last_time_size > 0) {
+	std::cout << last_time;
+    }
+    if (!times.client_network.empty()) {
+	std::cout << " " << times.client_network;
+    }
+    std::cout << std::endl;
+}
+
+/**
+ * the response sent to connections that are shed because of overload
+ */
+#define OVERLOAD_RESPONSE "451 " PACKAGE " is overloaded currently. Please try again later.\n"
+
+/**
+ * how long we wait for a successor to get ready, in milliseconds
+ */
+#define HANDOVER_TIMEOUT_MS 30000
+
+/**
+ * the cache the worker processes share in prefork mode
+ */
+#define TRIPLET_CACHE_FILE LOCALSTATEDIR "/cache/" PACKAGE "/triplets.cache"
+
+/**
+ * number of entries in the triplet cache
+ */
+#define TRIPLET_CACHE_SLOTS 65536
+
+/**
+ * how often the master checks for exited workers in prefork mode, in milliseconds
+ */
+#define PREFORK_POLL_INTERVAL_MS 1000
+
+/**
+ * hand over to a new instance
+ *
+ * @return true if the successor has taken over
+ */
+static bool hand_over(int argc, char const** argv, int domain_socket, couriergrey::whitelist& used_whitelist, char const* whitelist_image_location) {
+    // let the successor map the whitelist instead of parsing it again
+    if (!used_whitelist.is_mapped()) {
+	try {
+	    used_whitelist.compile(whitelist_image_location);
+	} catch (Glib::ustring msg) {
+	    ::syslog(LOG_NOTICE, "Cannot write whitelist image for the successor: %s", msg.c_str());
+	}
+    }
+
+    try {
+	pid_t successor = couriergrey::handover::start_successor(argc, argv, domain_socket);
+	if (couriergrey::handover::wait_for_successor(successor, HANDOVER_TIMEOUT_MS)) {
+	    ::syslog(LOG_INFO, "%s handed over to process %d", PACKAGE, static_cast<int>(successor));
+	    return true;
+	}
+	::syslog(LOG_ERR, "Successor did not start up, continuing to serve");
+    } catch (Glib::ustring msg) {
+	::syslog(LOG_ERR, "Cannot hand over to a successor: %s", msg.c_str());
+    }
+    return false;
+}
+
+/**
+ * supervise the worker processes in prefork mode, until we are told to stop
+ *
+ * @param handed_over set to true if we stopped because a successor has taken over
+ * @return true in a restarted worker process, false in the master after the workers have been stopped
+ */
+static bool supervise(int argc, char const** argv, int domain_socket, couriergrey::whitelist& used_whitelist, char const* whitelist_image_location, bool& handed_over) {
+    for (;;) {
+	// stdin is closed by courierfilter if we have to shut down
+	struct pollfd stdin_poll;
+	std::memset(&stdin_poll, 0, sizeof(stdin_poll));
+	stdin_poll.fd = 0;
+
+	int ret = ::poll(&stdin_poll, 1, PREFORK_POLL_INTERVAL_MS);
+
+	if (couriergrey::prefork::restart_exited()) {
+	    return true;
+	}
+
+	// the workers keep their own traces and statistics
+	if (dump_traces_requested) {
+	    dump_traces_requested = 0;
+	    couriergrey::prefork::signal_workers(SIGUSR1);
+	}
+	if (log_statistics_requested) {
+	    log_statistics_requested = 0;
+	    couriergrey::prefork::signal_workers(SIGUSR2);
+	}
+
+	if (terminate_requested) {
+	    break;
+	}
+
+	if (handover_requested) {
+	    handover_requested = 0;
+	    if (hand_over(argc, argv, domain_socket, used_whitelist, whitelist_image_location)) {
+		handed_over = true;
+		break;
+	    }
+	}
+
+	if (ret < 0 && errno != EINTR) {
+	    std::cerr << N_("Error waiting for I/O events: ") << std::strerror(errno) << std::endl;
+	    break;
+	} else if (ret > 0 && (stdin_poll.revents & POLLHUP)) {
+	    break;
+	}
+    }
+
+    couriergrey::prefork::stop();
+    return false;
+}
+
 int main(int argc, char const** argv) {
     int do_version = 0;
     int dump_whitelist = 0;
+    int compile_whitelist = 0;
     int dump_database = 0;
+    int database_statistics = 0;
     int expire_database = 0;
+    int expire_unpassed = 0;
+    char const* query_client = NULL;
+    char const* purge_client = NULL;
+    int rebuild_index = 0;
     int ret = 0;
+    couriergrey::settings config;
     char const* socket_location = LOCALSTATEDIR "/lib/courier/allfilters/couriergrey";
     char const* whitelist_location = CONFIG_DIR "/whitelist_ip";
+    char const* rcpt_whitelist_location = CONFIG_DIR "/whitelist_rcpt";
+    char const* whitelist_image_location = LOCALSTATEDIR "/cache/" PACKAGE "/whitelist_ip.img";
+    char const* slowlog_location = NULL;
+    int slow_threshold = 1000;
+    int socket_backlog = SOCKET_BACKLOG_SIZE;
+    int max_in_flight = 0;
+    int prefork_processes = 0;
+    int shed_threshold = 0;
+    int compact_interval = 0;
+    int group_commit = 0;
+    int commit_delay = 5;
+    int commit_sync = 0;
+    char const* deadline_action = "tempfail";
+    char const* sender_normalization = "none";
+    int per_recipient = 0;
+    int retry_rate = 0;
+    char const* database_options = "defaults";
+    int inherit_socket = -1;
+    int inherit_state = -1;
+    char const* decisionlog_location = NULL;
+    char const* adminsocket_location = NULL;
+    char const* store_location = NULL;
+    int store_cache_ttl = 2000;
 
     struct poptOption options[] = {
 	{ "version", 'v', POPT_ARG_NONE, &do_version, 0, N_("print server version"), NULL},
 	{ "socket", 's', POPT_ARG_STRING, &socket_location, 0, N_("location of the filter domain socket"), "path"},
 	{ "whitelist", 'w', POPT_ARG_STRING, &whitelist_location, 0, N_("location of the whitelist file"), "path"},
+	{ "whitelistimage", 0, POPT_ARG_STRING, &whitelist_image_location, 0, N_("location of the precompiled whitelist image"), "path"},
+	{ "rcptwhitelist", 0, POPT_ARG_STRING, &rcpt_whitelist_location, 0, N_("location of the recipient whitelist file"), "path"},
+	{ "ipv4prefix", 0, POPT_ARG_INT, &config.ipv4_prefix, 0, N_("prefix length IPv4 clients are aggregated to"), "bits"},
+	{ "ipv6prefix", 0, POPT_ARG_INT, &config.ipv6_prefix, 0, N_("prefix length IPv6 clients are aggregated to"), "bits"},
+	{ "slowlog", 0, POPT_ARG_STRING, &slowlog_location, 0, N_("trace requests and log slow ones to this file"), "path"},
+	{ "slowthreshold", 0, POPT_ARG_INT, &slow_threshold, 0, N_("requests taking longer are logged as slow"), "ms"},
+	{ "adminsocket", 0, POPT_ARG_STRING, &adminsocket_location, 0, N_("location of the admin socket"), "path"},
+	{ "decisionlog", 0, POPT_ARG_STRING, &decisionlog_location, 0, N_("log each decision to this file (or to syslog if \"syslog\")"), "path"},
+	{ "backlog", 0, POPT_ARG_INT, &socket_backlog, 0, N_("listen backlog of the filter socket"), "connections"},
+	{ "maxinflight", 0, POPT_ARG_INT, &max_in_flight, 0, N_("maximum number of requests processed concurrently"), "requests"},
+	{ "prefork", 0, POPT_ARG_INT, &prefork_processes, 0, N_("number of worker processes accepting connections"), "processes"},
+	{ "shedthreshold", 0, POPT_ARG_INT, &shed_threshold, 0, N_("tempfail new connections when requests waited longer"), "ms"},
+	{ "retryrate", 0, POPT_ARG_INT, &retry_rate, 0, N_("retries per minute a greylisted client may do before it is answered from memory"), "retries"},
+	{ "perrecipient", 0, POPT_ARG_NONE, &per_recipient, 0, N_("greylist each recipient of a message on its own"), NULL},
+	{ "normalizesender", 0, POPT_ARG_STRING, &sender_normalization, 0, N_("normalize envelope senders (srs, batv, verp, lowercase, all, none)"), "rules"},
+	{ "deadline", 0, POPT_ARG_INT, &config.deadline_ms, 0, N_("maximum time to answer a request"), "ms"},
+	{ "deadlineaction", 0, POPT_ARG_STRING, &deadline_action, 0, N_("how to answer requests missing the deadline (tempfail or accept)"), "action"},
+	{ "store", 0, POPT_ARG_STRING, &store_location, 0, N_("keep the entries in the couriergrey-stored server listening on this socket"), "path"},
+	{ "storecachettl", 0, POPT_ARG_INT, &store_cache_ttl, 0, N_("how long entries of the store server are cached locally"), "ms"},
+	{ "groupcommit", 0, POPT_ARG_NONE, &group_commit, 0, N_("commit database writes of concurrent requests in batches"), NULL},
+	{ "commitdelay", 0, POPT_ARG_INT, &commit_delay, 0, N_("maximum time writes wait for a batch to fill"), "ms"},
+	{ "commitsync", 0, POPT_ARG_NONE, &commit_sync, 0, N_("sync each batch of writes to disk"), NULL},
+	{ "dboptions", 0, POPT_ARG_STRING, &database_options, 0, N_("storage parameters of the database (blocksize=, cachesize=, sync, nommap, preread, ownlock)"), "options"},
+	{ "compactinterval", 0, POPT_ARG_INT, &compact_interval, 0, N_("compact the database in the background at this interval"), "minutes"},
 	{ "expire", 'e', POPT_ARG_INT, &expire_database, 0, N_("expire old database entries"), "days"},
+	{ "expirenew", 0, POPT_ARG_INT, &expire_unpassed, 0, N_("with --expire, expire entries that never passed greylisting after this time"), "hours"},
 	{ "dumpwhitelist", 0, POPT_ARG_NONE, &dump_whitelist, 0, N_("dump the content of the parsed whitelist"), NULL},
+	{ "compilewhitelist", 0, POPT_ARG_NONE, &compile_whitelist, 0, N_("write a precompiled image of the whitelist"), NULL},
 	{ "dumpdatabase", 0, POPT_ARG_NONE, &dump_database, 0, N_("dump the content of the greylisting database"), NULL},
+	{ "stats", 0, POPT_ARG_NONE, &database_statistics, 0, N_("print statistics on the content of the greylisting database"), NULL},
+	{ "queryip", 0, POPT_ARG_STRING, &query_client, 0, N_("show the database entries of a client address or network"), "address[/prefix]"},
+	{ "purgeip", 0, POPT_ARG_STRING, &purge_client, 0, N_("delete the database entries of a client address or network"), "address[/prefix]"},
+	{ "rebuildindex", 0, POPT_ARG_NONE, &rebuild_index, 0, N_("rebuild the index of the database by client address"), NULL},
+	{ "inheritsocket", 0, POPT_ARG_INT | POPT_ARGFLAG_DOC_HIDDEN, &inherit_socket, 0, N_("use the listening socket of the predecessor"), "fd"},
+	{ "inheritstate", 0, POPT_ARG_INT | POPT_ARGFLAG_DOC_HIDDEN, &inherit_state, 0, N_("take over the state of the predecessor"), "fd"},
 	POPT_AUTOHELP
 	POPT_TABLEEND
     };
@@ -93,19 +388,95 @@ int main(int argc, char const** argv) {
 	return 1;
     }
 
+    // how to normalize envelope senders?
+    try {
+	config.sender_normalization = couriergrey::sender_normalizer(sender_normalization);
+    } catch (Glib::ustring msg) {
+	std::cout << msg << std::endl;
+	::closelog();
+	return 1;
+    }
+
+    // how to open the database files?
+    try {
+	couriergrey::database::tune(couriergrey::database_tuning(database_options));
+    } catch (Glib::ustring msg) {
+	std::cout << msg << std::endl;
+	::closelog();
+	return 1;
+    }
+
+    // one greylisting key for each recipient?
+    config.per_recipient = per_recipient != 0;
+
+    // how to answer requests missing their deadline?
+    if (std::strcmp(deadline_action, "accept") == 0) {
+	config.deadline_fail_open = true;
+    } else if (std::strcmp(deadline_action, "tempfail") != 0) {
+	std::cout << N_("Invalid deadline action: ") << deadline_action << std::endl;
+	::closelog();
+	return 1;
+    }
+
+    // the short expiry only modifies --expire
+    if (expire_unpassed > 0 && expire_database <= 0) {
+	std::cout << N_("--expirenew can only be used together with --expire") << std::endl;
+	::closelog();
+	return 1;
+    }
+
+    // with a store server, there is no local database to commit to or to compact
+    if (store_location && (group_commit || compact_interval > 0)) {
+	std::cout << N_("--groupcommit and --compactinterval cannot be used together with --store") << std::endl;
+	::closelog();
+	return 1;
+    }
+
+    // the compactor and the admin socket work within a single process only
+    if (prefork_processes > 0 && (compact_interval > 0 || adminsocket_location)) {
+	std::cout << N_("--compactinterval and --adminsocket cannot be used together with --prefork") << std::endl;
+	::closelog();
+	return 1;
+    }
+
     // print version information?
     if (do_version) {
 	// XXX i20n
 	std::cout << PACKAGE << N_(" version ") << VERSION << std::endl << std::endl;
 	std::cout << N_("Used filter socket is: ") << socket_location << std::endl;
 	std::cout << N_("Used whitelist is: ") << whitelist_location << std::endl;
+	std::cout << N_("Used recipient whitelist is: ") << rcpt_whitelist_location << std::endl;
+	std::cout << N_("Used whitelist image is: ") << whitelist_image_location << std::endl;
 	std::cout << N_("Database is: ") << LOCALSTATEDIR "/cache/" PACKAGE "/deliveryattempts.gdbm" << std::endl;
+	std::cout << N_("Client index is: ") << LOCALSTATEDIR "/cache/" PACKAGE "/clientindex.gdbm" << std::endl;
+	std::cout << N_("Triplet cache is: ") << TRIPLET_CACHE_FILE << std::endl;
 	::closelog();
 	return 0;
     }
 
-    // read whitelist
-    couriergrey::whitelist used_whitelist(whitelist_location);
+    // compile whitelist if requested
+    if (compile_whitelist) {
+	try {
+	    couriergrey::whitelist parsed_whitelist(whitelist_location);
+
+	    std::cout << N_("Writing whitelist image to ") << whitelist_image_location << std::endl;
+
+	    parsed_whitelist.compile(whitelist_image_location);
+
+	    ::closelog();
+	    return 0;
+	} catch (Glib::ustring msg) {
+	    std::cerr << msg << std::endl;
+	    ::closelog();
+	    return 1;
+	}
+    }
+
+    // read whitelist (or map its precompiled image)
+    couriergrey::whitelist used_whitelist(whitelist_location, whitelist_image_location);
+
+    // read recipient whitelist
+    couriergrey::recipient_whitelist used_rcpt_whitelist(rcpt_whitelist_location);
 
     // dump whitelist if requested
     if (dump_whitelist) {
@@ -114,15 +485,97 @@ int main(int argc, char const** argv) {
 	return 0;
     }
 
+    // a daemon running in prefork mode must not serve entries we delete from its cache
+    if (expire_database > 0 || purge_client) {
+	couriergrey::triplet_cache::attach(TRIPLET_CACHE_FILE);
+    }
+
+    // let a running daemon expire the database, so that it is not blocked
+    if (expire_database > 0 && adminsocket_location) {
+	try {
+	    std::ostringstream command;
+	    command << "expire " << expire_database;
+	    if (expire_unpassed > 0) {
+		command << ' ' << expire_unpassed;
+	    }
+	    std::string response;
+	    bool ok = couriergrey::admin_socket::send(adminsocket_location, command.str(), response);
+
+	    // the daemon expires in the background, wait for it to finish
+	    while (ok) {
+		ok = couriergrey::admin_socket::send(adminsocket_location, "job", response);
+		if (response.compare(0, 11, "OK running ") != 0) {
+		    break;
+		}
+		::sleep(1);
+	    }
+	    std::cout << response;
+	    return ok ? 0 : 1;
+	} catch (Glib::ustring msg) {
+	    std::cerr << msg << std::endl;
+	    return 1;
+	}
+    }
+
     // expire database if requested
     if (expire_database > 0) {
 	try {
 	    couriergrey::timestore db;
 
 	    std::cout << N_("Expiring database entries older than ") << expire_database << N_(" days.") << std::endl;
+	    if (expire_unpassed > 0) {
+		std::cout << N_("Expiring entries that never passed greylisting older than ") << expire_unpassed << N_(" hours.") << std::endl;
+	    }
+
+	    db.expire(expire_database, true, expire_unpassed);
+
+	    return 0;
+	} catch (Glib::ustring msg) {
+	    std::cerr << msg << std::endl;
+	    return 1;
+	}
+    }
 
-	    db.expire(expire_database);
+    // rebuild the client index if requested
+    if (rebuild_index) {
+	try {
+	    couriergrey::timestore db;
 
+	    int indexed = db.rebuild_index();
+	    std::cout << N_("Indexed database entries: ") << indexed << std::endl;
+
+	    return 0;
+	} catch (Glib::ustring msg) {
+	    std::cerr << msg << std::endl;
+	    return 1;
+	}
+    }
+
+    // show the entries of a client if requested
+    if (query_client) {
+	try {
+	    couriergrey::timestore db(couriergrey::database::snapshot);
+
+	    std::list<std::string> keys = db.find_client(query_client);
+	    for (std::list<std::string>::const_iterator p = keys.begin(); p != keys.end(); ++p) {
+		print_entry(*p, db.fetch_entry(*p));
+	    }
+	    return 0;
+	} catch (Glib::ustring msg) {
+	    std::cerr << msg << std::endl;
+	    return 1;
+	}
+    }
+
+    // delete the entries of a client if requested
+    if (purge_client) {
+	try {
+	    couriergrey::timestore db;
+
+	    std::list<std::string> keys = db.purge_client(purge_client);
+	    for (std::list<std::string>::const_iterator p = keys.begin(); p != keys.end(); ++p) {
+		std::cout << "Purging: " << *p << std::endl;
+	    }
 	    return 0;
 	} catch (Glib::ustring msg) {
 	    std::cerr << msg << std::endl;
@@ -133,33 +586,13 @@ int main(int argc, char const** argv) {
     // dump database if requested
     if (dump_database) {
 	try {
-	    couriergrey::timestore db;
+	    couriergrey::timestore db(couriergrey::database::snapshot);
 
 	    std::cout << N_("Content of the greylist database:") << std::endl;
 
 	    std::list<std::string> keys = db.get_keys();
 	    for (std::list<std::string>::const_iterator p = keys.begin(); p != keys.end(); ++p) {
-		std::cout << *p << std::endl;
-		std::pair<std::time_t, std::time_t> times = db.fetch(*p);
-		struct std::tm first_time_tm;
-		gmtime_r(&times.first, &first_time_tm);
-		struct std::tm last_time_tm;
-		gmtime_r(&times.second, &last_time_tm);
-		char first_time[128];
-		char last_time[128];
-		std::size_t first_time_size = strftime(first_time, sizeof(first_time), "%Y-%m-%dT%H:%M:%SZ", &first_time_tm);
-		std::size_t last_time_size = strftime(last_time, sizeof(last_time), "%Y-%m-%dT%H:%M:%SZ", &last_time_tm);
-		if (times.second - times.first >= 120) {
-		    std::cout << " A";
-		}
-		std::cout << "\t";
-		if (first_time_size > 0) {
-		    std::cout << first_time << " ";
-		}
-		if (last_time_size > 0) {
-		    std::cout << last_time;
-		}
-		std::cout << std::endl;
+		print_entry(*p, db.fetch_entry(*p));
 	    }
 	    return 0;
 	} catch (Glib::ustring msg) {
@@ -168,9 +601,27 @@ int main(int argc, char const** argv) {
 	}
     }
 
-    // open the domain socket
+    // print statistics on the database if requested
+    if (database_statistics) {
+	try {
+	    couriergrey::database db(-1, couriergrey::database::snapshot);
+
+	    long processors = ::sysconf(_SC_NPROCESSORS_ONLN);
+	    couriergrey::database_report report(processors > 0 ? processors : 1);
+	    report.scan(db);
+	    report.print(std::cout);
+	    return 0;
+	} catch (Glib::ustring msg) {
+	    std::cerr << msg << std::endl;
+	    return 1;
+	}
+    }
+
+    // open the domain socket, or use the one of our predecessor
     int domain_socket = -1;
-    {
+    if (inherit_socket >= 0) {
+	domain_socket = inherit_socket;
+    } else {
 	struct sockaddr_un addr;
 
 	// calculate the temporary location where we create the socket
@@ -225,7 +676,7 @@ int main(int argc, char const** argv) {
 	}
 
 	// start listening on the socket
-	ret = ::listen(domain_socket, SOCKET_BACKLOG_SIZE);
+	ret = ::listen(domain_socket, socket_backlog);
 	if (ret) {
 	    std::cerr << N_("Could not listen on socket ") << temp_location << ": " << std::strerror(errno) << std::endl;
 	    ::closelog();
@@ -241,25 +692,209 @@ int main(int argc, char const** argv) {
 	}
     }
 
-    // close fd #3 to signal that we are ready
+    // keep track of clients retrying too fast, shared by the worker processes
+    if (retry_rate > 0) {
+	try {
+	    couriergrey::retry_limiter::start(retry_rate);
+	} catch (Glib::ustring msg) {
+	    std::cerr << msg << std::endl;
+	    ::closelog();
+	    return 1;
+	}
+    }
+
+    // start the worker processes, the master only supervises them
+    if (prefork_processes > 0) {
+	bool handed_over = false;
+
+	install_handler(SIGTERM, terminate_request);
+	install_handler(SIGCHLD, child_exited);
+	install_handler(SIGHUP, handover_request);
+	install_handler(SIGUSR1, request_trace_dump);
+	install_handler(SIGUSR2, statistics_log);
+
+	try {
+	    // a successor shares the cache with the workers of its predecessor
+	    if (inherit_socket < 0 || !couriergrey::triplet_cache::attach(TRIPLET_CACHE_FILE)) {
+		couriergrey::triplet_cache::create(TRIPLET_CACHE_FILE, TRIPLET_CACHE_SLOTS);
+	    }
+
+	    if (!couriergrey::prefork::start(prefork_processes)) {
+		// close fd #3 to signal that we are ready
+		if (inherit_socket >= 0) {
+		    couriergrey::handover::signal_ready();
+		}
+		::close(3);
+		::syslog(LOG_INFO, "%s started %d worker processes", PACKAGE, prefork_processes);
+	    }
+	} catch (Glib::ustring msg) {
+	    std::cerr << msg << std::endl;
+	    ::closelog();
+	    return 1;
+	}
+
+	if (!couriergrey::prefork::is_worker() && !supervise(argc, argv, domain_socket, used_whitelist, whitelist_image_location, handed_over)) {
+	    // after a handover socket and cache are in use by our successor
+	    ::close(domain_socket);
+	    if (!handed_over) {
+		::unlink(socket_location);
+		::unlink(TRIPLET_CACHE_FILE);
+	    }
+	    ::syslog(LOG_INFO, "%s shut down", PACKAGE);
+	    ::closelog();
+	    return 0;
+	}
+    }
+
+    // enable request tracing if requested
+    if (slowlog_location) {
+	try {
+	    couriergrey::request_trace::enable(slowlog_location, slow_threshold);
+	} catch (Glib::ustring msg) {
+	    std::cerr << msg << std::endl;
+	    ::closelog();
+	    return 1;
+	}
+
+	// the traces are dumped by the main loop, the handler only wakes it up
+	install_handler(SIGUSR1, request_trace_dump);
+    }
+
+    // start writing the log of decisions and notices
+    try {
+	couriergrey::decision_log::start(decisionlog_location ? decisionlog_location : "", couriergrey::prefork::is_worker());
+    } catch (Glib::ustring msg) {
+	std::cerr << msg << std::endl;
+	::closelog();
+	return 1;
+    }
+
+    // take over the state of our predecessor (not into each of the workers)
+    if (inherit_state >= 0 && prefork_processes == 0) {
+	couriergrey::handover::restore_state(inherit_state);
+    }
+
+    // keep the client index up to date in the background, not while answering requests
+    couriergrey::client_index::start_updater();
+
+    // commit the database writes in batches
+    if (group_commit) {
+	try {
+	    couriergrey::commit_queue::start(commit_delay, commit_sync);
+	} catch (Glib::ustring msg) {
+	    std::cerr << msg << std::endl;
+	    ::closelog();
+	    return 1;
+	}
+    }
+
+    // keep the entries in a store server shared with other mail exchangers
+    if (store_location) {
+	couriergrey::store_client::start(store_location, store_cache_ttl);
+    }
+
+    // compact the database in the background
+    couriergrey::compactor::start(compact_interval);
+
+    // the whitelist managed at runtime, and the admin socket to manage it
+    couriergrey::runtime_whitelist used_runtime_whitelist;
+    if (adminsocket_location) {
+	try {
+	    couriergrey::admin_socket::start(adminsocket_location, used_runtime_whitelist);
+	} catch (Glib::ustring msg) {
+	    std::cerr << msg << std::endl;
+	    ::closelog();
+	    return 1;
+	}
+    }
+
+    // let the signal handlers wake up the main loop
+    bool signal_pipe_created = ::pipe(signal_pipe) == 0;
+    for (int end = 0; signal_pipe_created && end < 2; end++) {
+	signal_pipe_created = ::fcntl(signal_pipe[end], F_SETFL, O_NONBLOCK) == 0 && ::fcntl(signal_pipe[end], F_SETFD, FD_CLOEXEC) == 0;
+    }
+    if (!signal_pipe_created) {
+	std::cerr << N_("Cannot create the signal pipe: ") << std::strerror(errno) << std::endl;
+	::closelog();
+	return 1;
+    }
+
+    // hand over to a new instance on SIGHUP (the master does this for the workers)
+    if (couriergrey::prefork::is_worker()) {
+	std::signal(SIGHUP, SIG_IGN);
+    } else {
+	install_handler(SIGHUP, handover_request);
+    }
+
+    // log statistics on SIGUSR2
+    install_handler(SIGUSR2, statistics_log);
+
+    // the threads processing requests, and the control of how many we accept
+    Glib::ThreadPool workers(max_in_flight > 0 ? max_in_flight : -1);
+    couriergrey::admission_control admission(shed_threshold);
+
+    // close fd #3 to signal that we are ready (our predecessor also wants to read it)
+    if (inherit_socket >= 0 && !couriergrey::prefork::is_worker()) {
+	couriergrey::handover::signal_ready();
+    }
     ::close(3);
 
     // log that we are up
     ::syslog(LOG_INFO, "%s started and ready", PACKAGE);
+    bool handed_over = false;
 
     // start waiting for something to happen
     for (;;) {
-	struct pollfd fds[2];
+	struct pollfd fds[3];
 
-	for (int c=0; c<2; c++) {
+	for (int c=0; c<3; c++) {
 	    std::memset(&fds[c], 0, sizeof(struct pollfd));
 	}
-	fds[0].fd = 0;
+	fds[0].fd = couriergrey::prefork::is_worker() ? -1 : 0;
 	fds[1].fd = domain_socket;
 	fds[1].events = POLLIN;
+	fds[2].fd = signal_pipe[0];
+	fds[2].events = POLLIN;
 
-	ret = ::poll(fds, 2, -1);
-	if (ret < 0) {
+	ret = ::poll(fds, 3, -1);
+
+	// woken up by a signal handler? the flags it set are checked below
+	if (ret > 0 && (fds[2].revents & POLLIN)) {
+	    char wakeups[64];
+	    while (::read(signal_pipe[0], wakeups, sizeof(wakeups)) > 0)
+		;
+	}
+
+	// dumping the request traces has been requested?
+	if (dump_traces_requested) {
+	    dump_traces_requested = 0;
+	    couriergrey::request_trace::dump();
+	}
+
+	// logging the statistics has been requested?
+	if (log_statistics_requested) {
+	    log_statistics_requested = 0;
+	    couriergrey::statistics::log();
+	}
+
+	// handing over to a new instance has been requested?
+	if (handover_requested) {
+	    handover_requested = 0;
+	    if (hand_over(argc, argv, domain_socket, used_whitelist, whitelist_image_location)) {
+		handed_over = true;
+		break;
+	    }
+	}
+
+	// the master stops the workers
+	if (terminate_requested) {
+	    break;
+	}
+
+	if (ret < 0 && errno == EINTR) {
+	    // interrupted by a signal
+	    continue;
+	} else if (ret < 0) {
 	    std::cerr << N_("Error waiting for I/O events: ") << std::strerror(errno) << std::endl;
 	    break;
 	} else if (ret > 0) {
@@ -271,12 +906,29 @@ int main(int argc, char const** argv) {
 	    if (fds[1].revents & POLLIN) {
 		// new connection, accept it
 		int accepted_connection = ::accept(domain_socket, NULL, 0);
+		if (accepted_connection == -1) {
+		    continue;
+		}
+		COURIERGREY_PROBE1(request_accept, accepted_connection);
+
+		// overloaded? answer immediately without touching any file
+		if (!admission.admit()) {
+		    if (::write(accepted_connection, OVERLOAD_RESPONSE, sizeof(OVERLOAD_RESPONSE)-1) != sizeof(OVERLOAD_RESPONSE)-1) {
+			::syslog(LOG_NOTICE, "Could not write the overload response: %s", std::strerror(errno));
+		    }
+		    ::close(accepted_connection);
+		    continue;
+		}
 
-		couriergrey::message_processor* processor = new couriergrey::message_processor(accepted_connection, used_whitelist);
+		couriergrey::message_processor* processor = new couriergrey::message_processor(accepted_connection, used_whitelist, used_rcpt_whitelist, used_runtime_whitelist, config, admission);
 		try {
-		    Glib::Thread::create(sigc::mem_fun(*processor, &couriergrey::message_processor::do_process), false);
+		    workers.push(sigc::mem_fun(*processor, &couriergrey::message_processor::do_process));
 		} catch (Glib::ThreadError const& te) {
 		    ::syslog(LOG_INFO, "ThreadError caught in main thread: %s", te.what().c_str());
+		    admission.started();
+		    admission.finished();
+		    ::close(accepted_connection);
+		    delete processor;
 		}
 	    }
 	} else {
@@ -285,9 +937,18 @@ int main(int argc, char const** argv) {
 
     }
 
-    // cleanup
+    // cleanup, after a handover the socket is still in use by our successor
     ::close(domain_socket);
-    ::unlink(socket_location);
+    if (!handed_over && !couriergrey::prefork::is_worker()) {
+	::unlink(socket_location);
+    }
+    workers.shutdown();
+    couriergrey::admin_socket::stop();
+    couriergrey::commit_queue::stop();
+    couriergrey::client_index::stop_updater();
+    couriergrey::store_client::stop();
+    couriergrey::compactor::stop();
+    couriergrey::decision_log::stop();
 
     // log that we are done
     ::syslog(LOG_INFO, "%s shut down", PACKAGE);
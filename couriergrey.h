@@ -27,9 +27,35 @@
 #   include <config.h>
 #endif
 
+#include <sender_normalizer.h>
+#include <settings.h>
+#include <probes.h>
+#include <ip_address.h>
+#include <request_arena.h>
+#include <allocation_counter.h>
+#include <request_trace.h>
+#include <statistics.h>
+#include <admission_control.h>
+#include <decision_log.h>
+#include <database_tuning.h>
 #include <database.h>
+#include <heavy_hitters.h>
+#include <database_report.h>
+#include <compactor.h>
+#include <handover.h>
+#include <client_index.h>
+#include <entry_store.h>
 #include <timestore.h>
+#include <commit_queue.h>
+#include <store_protocol.h>
+#include <store_client.h>
+#include <triplet_cache.h>
+#include <retry_limiter.h>
+#include <prefork.h>
 #include <whitelist.h>
+#include <recipient_whitelist.h>
+#include <runtime_whitelist.h>
+#include <admin_socket.h>
 #include <mail_processor.h>
 #include <message_processor.h>
 
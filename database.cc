@@ -25,33 +25,200 @@
 #endif
 
 #include "database.h"
+#include "probes.h"
 #include <iostream>
 #include <sys/stat.h>
 #include <cstdio>
 #include <stdexcept>
 #include <glibmm.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <sys/ioctl.h>
+#include <sys/file.h>
+#ifdef __linux__
+#   include <linux/fs.h>
+#endif
+
+/**
+ * the directory containing the database files, unless another one is set
+ */
+#define DATABASE_DIRECTORY LOCALSTATEDIR "/cache/" PACKAGE
+
+/**
+ * the name of the file containing the database
+ */
+#define DATABASE_FILE_NAME "deliveryattempts.gdbm"
+
+/**
+ * time between two attempts to open a locked database if a timeout is given, in milliseconds
+ */
+#define DATABASE_RETRY_INTERVAL_MS 50
+
+/**
+ * first interval between attempts to lock the database if we lock it ourselves, doubled up to DATABASE_RETRY_INTERVAL_MS
+ */
+#define DATABASE_LOCK_RETRY_INTERVAL_MS 1
 
 namespace couriergrey {
-    database::database() : db(NULL) {
-	for (int retry = 0; db == NULL && retry < 10; retry++) {
-	    db = ::gdbm_open(LOCALSTATEDIR "/cache/" PACKAGE "/deliveryattempts.gdbm", 0, GDBM_WRCREAT, S_IRUSR | S_IWUSR | S_IRGRP, 0);
+    Glib::RWLock database::swap_lock;
+    bool database::journaling = false;
+    std::list<database::journal_entry> database::journal;
+    Glib::Mutex database::journal_mutex;
+    database_tuning database::tuning;
+    std::string database::directory = DATABASE_DIRECTORY;
+
+    database::database(int timeout_ms, open_mode mode) : db(NULL), is_greylisting_database(true), read_only(mode != writer), lock_fd(-1) {
+	// the file must not be swapped while we are using it
+	swap_lock.reader_lock();
+
+	try {
+	    if (mode == snapshot) {
+		create_snapshot(timeout_ms);
+		open(snapshot_file.c_str(), timeout_ms);
+	    } else {
+		open(greylisting_file().c_str(), timeout_ms);
+	    }
+	} catch (Glib::ustring) {
+	    if (!snapshot_file.empty()) {
+		::unlink(snapshot_file.c_str());
+	    }
+	    swap_lock.reader_unlock();
+	    throw;
+	}
+    }
+
+    database::database(std::string const& filename, int timeout_ms, bool read_only) : db(NULL), is_greylisting_database(false), read_only(read_only), lock_fd(-1) {
+	open(filename.c_str(), timeout_ms);
+    }
+
+    void database::create_snapshot(int timeout_ms) {
+	// a file of our own next to the live database, so that blocks can be shared with it
+	std::string snapshot_template = greylisting_file() + ".snapshot.XXXXXX";
+	int fd = ::mkstemp(&snapshot_template[0]);
+	if (fd == -1) {
+	    throw Glib::ustring(N_("Could not create database snapshot: ")) + std::strerror(errno);
+	}
+	::close(fd);
+	snapshot_file = snapshot_template;
+
+	take_snapshot(snapshot_file, timeout_ms);
+    }
+
+    void database::open(char const* filename, int timeout_ms) {
+	// by default writers try for nine seconds (ten times a second apart, unless we lock ourselves), readers for ten
+	int retry_interval_ms = tuning.own_locking ? DATABASE_LOCK_RETRY_INTERVAL_MS : DATABASE_RETRY_INTERVAL_MS;
+	if (timeout_ms < 0 && read_only) {
+	    timeout_ms = 10 * 1000;
+	} else if (timeout_ms < 0) {
+	    timeout_ms = 9 * 1000;
+	    if (!tuning.own_locking) {
+		retry_interval_ms = 1000;
+	    }
+	}
+
+	int waited_ms = 0;
+	for (int retry = 0; !try_open(filename) && waited_ms < timeout_ms; retry++) {
+	    int sleep_ms = retry_interval_ms < timeout_ms - waited_ms ? retry_interval_ms : timeout_ms - waited_ms;
+	    COURIERGREY_PROBE2(database_open_retry, retry + 1, sleep_ms);
+	    struct ::timespec retry_interval;
+	    retry_interval.tv_sec = sleep_ms / 1000;
+	    retry_interval.tv_nsec = (sleep_ms % 1000) * 1000000L;
+	    ::nanosleep(&retry_interval, NULL);
+	    waited_ms += sleep_ms;
+
+	    // attempts are cheap if we lock ourselves, but do not poll the lock in a busy loop
+	    if (retry_interval_ms < DATABASE_RETRY_INTERVAL_MS) {
+		retry_interval_ms *= 2;
+		if (retry_interval_ms > DATABASE_RETRY_INTERVAL_MS) {
+		    retry_interval_ms = DATABASE_RETRY_INTERVAL_MS;
+		}
+	    }
+	}
+
+	if (!db) {
+	    if (lock_fd != -1) {
+		::close(lock_fd);
+		lock_fd = -1;
+	    }
+	    throw Glib::ustring(N_("Could not open database at ")) + filename;
+	}
+
+	if (tuning.cache_size > 0) {
+	    int cache_size = tuning.cache_size;
+	    ::gdbm_setopt(db, GDBM_CACHESIZE, &cache_size, sizeof(cache_size));
+	}
+    }
+
+    bool database::try_open(char const* filename) {
+	int flags = read_only ? GDBM_READER : GDBM_WRCREAT;
+	if (tuning.sync) {
+	    flags |= GDBM_SYNC;
+	}
+#ifdef GDBM_NOMMAP
+	if (!tuning.mmap) {
+	    flags |= GDBM_NOMMAP;
+	}
+#endif
+#ifdef GDBM_PREREAD
+	if (tuning.preread) {
+	    flags |= GDBM_PREREAD;
+	}
+#endif
+
+	if (!tuning.own_locking) {
+	    db = ::gdbm_open(const_cast<char*>(filename), tuning.block_size, flags, S_IRUSR | S_IWUSR | S_IRGRP, 0);
+	    return db != NULL;
+	}
 
-	    if (db == NULL && retry < 9) {
-		::sleep(1);
+	// take the lock gdbm would take, but without opening the database again for each attempt
+	if (lock_fd == -1) {
+	    lock_fd = ::open(filename, read_only ? O_RDONLY : O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP);
+	    if (lock_fd == -1) {
+		return false;
 	    }
 	}
+	if (::flock(lock_fd, (read_only ? LOCK_SH : LOCK_EX) | LOCK_NB)) {
+	    return false;
+	}
 
+	db = ::gdbm_open(const_cast<char*>(filename), tuning.block_size, flags | GDBM_NOLOCK, S_IRUSR | S_IWUSR | S_IRGRP, 0);
 	if (!db) {
-	    throw Glib::ustring(N_("Could not open database at " LOCALSTATEDIR "/cache/" PACKAGE "/deliveryattempts.gdbm"));
+	    ::flock(lock_fd, LOCK_UN);
+	    return false;
 	}
+	return true;
     }
 
     database::~database() {
+	close();
+    }
+
+    void database::close() {
+	if (!db) {
+	    return;
+	}
+
 	// close the database again
-	if (db) {
-	    ::gdbm_close(db);
-	    db = NULL;
+	::gdbm_close(db);
+	db = NULL;
+
+	// closing releases our lock
+	if (lock_fd != -1) {
+	    ::close(lock_fd);
+	    lock_fd = -1;
+	}
+
+	// nobody else uses our copy
+	if (!snapshot_file.empty()) {
+	    ::unlink(snapshot_file.c_str());
+	}
+
+	if (is_greylisting_database) {
+	    swap_lock.reader_unlock();
 	}
     }
 
@@ -90,12 +257,20 @@ namespace couriergrey {
 	value_datum.dptr = const_cast<char*>(value.c_str());
 	value_datum.dsize = value.length();
 	::gdbm_store(db, key_datum, value_datum, GDBM_REPLACE);
+
+	if (is_greylisting_database) {
+	    journal_write(key, value, false);
+	}
     }
 
     void database::reorganize() {
 	::gdbm_reorganize(db);
     }
 
+    void database::sync() {
+	::gdbm_sync(db);
+    }
+
     void database::del(std::string const& key) {
 	// generate key
 	::datum key_datum;
@@ -104,6 +279,10 @@ namespace couriergrey {
 
 	// delete database entry
 	::gdbm_delete(db, key_datum);
+
+	if (is_greylisting_database) {
+	    journal_write(key, std::string(), true);
+	}
     }
 
     std::list<std::string> database::get_keys() {
@@ -121,4 +300,250 @@ namespace couriergrey {
 
 	return result;
     }
+
+    void database::scan(record_visitor& visitor) {
+	::datum key = ::gdbm_firstkey(db);
+	while (key.dptr) {
+	    ::datum value = ::gdbm_fetch(db, key);
+	    if (value.dptr) {
+		visitor.visit(std::string(key.dptr, key.dsize), std::string(value.dptr, value.dsize));
+		std::free(value.dptr);
+	    }
+
+	    ::datum next_key = ::gdbm_nextkey(db, key);
+	    std::free(key.dptr);
+	    key = next_key;
+	}
+    }
+
+    void database::journal_write(std::string const& key, std::string const& value, bool deleted) {
+	// we hold swap_lock as reader, so journaling cannot change
+	if (!journaling) {
+	    return;
+	}
+
+	journal_entry entry;
+	entry.key = key;
+	entry.value = value;
+	entry.deleted = deleted;
+
+	Glib::Mutex::Lock lock(journal_mutex);
+	journal.push_back(entry);
+    }
+
+    void database::take_snapshot(std::string const& snapshot_file, int timeout_ms) {
+	// like readers, we retry often as writers only hold the lock for short batches
+	if (timeout_ms < 0) {
+	    timeout_ms = 10 * 1000;
+	}
+	int const retry_interval_ms = DATABASE_RETRY_INTERVAL_MS;
+
+	// keep writers away while we copy
+	std::string const live_file = greylisting_file();
+	::GDBM_FILE live = ::gdbm_open(const_cast<char*>(live_file.c_str()), 0, GDBM_READER, 0, 0);
+	for (int retry = 0; !live && retry < timeout_ms / retry_interval_ms; retry++) {
+	    COURIERGREY_PROBE2(database_open_retry, retry + 1, retry_interval_ms);
+	    struct ::timespec retry_interval;
+	    retry_interval.tv_sec = retry_interval_ms / 1000;
+	    retry_interval.tv_nsec = (retry_interval_ms % 1000) * 1000000L;
+	    ::nanosleep(&retry_interval, NULL);
+	    live = ::gdbm_open(const_cast<char*>(live_file.c_str()), 0, GDBM_READER, 0, 0);
+	}
+	if (!live) {
+	    throw Glib::ustring(N_("Could not open database at ")) + live_file;
+	}
+
+	int source = ::open(live_file.c_str(), O_RDONLY);
+	int destination = ::open(snapshot_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (source == -1 || destination == -1) {
+	    Glib::ustring msg = Glib::ustring(N_("Could not create database snapshot: ")) + std::strerror(errno);
+	    if (source != -1)
+		::close(source);
+	    if (destination != -1)
+		::close(destination);
+	    ::gdbm_close(live);
+	    throw msg;
+	}
+
+	// share the blocks with the live database if the filesystem can do it, copy them otherwise
+	bool copied = false;
+#ifdef FICLONE
+	copied = ::ioctl(destination, FICLONE, source) == 0;
+#endif
+	while (!copied) {
+	    char buffer[65536];
+	    ssize_t bytes_read = ::read(source, buffer, sizeof(buffer));
+	    if (bytes_read == 0) {
+		copied = true;
+		break;
+	    }
+	    if (bytes_read < 0 && errno == EINTR) {
+		continue;
+	    }
+	    if (bytes_read < 0 || ::write(destination, buffer, bytes_read) != bytes_read) {
+		break;
+	    }
+	}
+
+	::close(source);
+	::close(destination);
+	::gdbm_close(live);
+
+	if (!copied) {
+	    throw Glib::ustring(N_("Could not copy database to snapshot ")) + snapshot_file;
+	}
+    }
+
+    long database::copy_records(std::string const& snapshot_file, std::string const& compact_file) {
+	::GDBM_FILE snapshot = ::gdbm_open(const_cast<char*>(snapshot_file.c_str()), 0, GDBM_READER | GDBM_NOLOCK, 0, 0);
+	if (!snapshot) {
+	    throw Glib::ustring(N_("Could not open database snapshot ")) + snapshot_file;
+	}
+
+	// a block size set meanwhile applies to the compacted file
+	::GDBM_FILE compacted = ::gdbm_open(const_cast<char*>(compact_file.c_str()), tuning.block_size, GDBM_NEWDB, S_IRUSR | S_IWUSR | S_IRGRP, 0);
+	if (!compacted) {
+	    ::gdbm_close(snapshot);
+	    throw Glib::ustring(N_("Could not create compacted database ")) + compact_file;
+	}
+
+	long records = 0;
+	for (::datum key = ::gdbm_firstkey(snapshot); key.dptr; ) {
+	    ::datum value = ::gdbm_fetch(snapshot, key);
+	    if (value.dptr) {
+		::gdbm_store(compacted, key, value, GDBM_REPLACE);
+		std::free(value.dptr);
+		records++;
+	    }
+
+	    ::datum next_key = ::gdbm_nextkey(snapshot, key);
+	    std::free(key.dptr);
+	    key = next_key;
+	}
+
+	::gdbm_sync(compacted);
+	::gdbm_close(compacted);
+	::gdbm_close(snapshot);
+
+	return records;
+    }
+
+    long database::replay_and_swap(std::string const& compact_file) {
+	::GDBM_FILE compacted = ::gdbm_open(const_cast<char*>(compact_file.c_str()), 0, GDBM_WRITER, 0, 0);
+	if (!compacted) {
+	    throw Glib::ustring(N_("Could not open compacted database ")) + compact_file;
+	}
+
+	long replayed = 0;
+	{
+	    Glib::Mutex::Lock lock(journal_mutex);
+	    for (std::list<journal_entry>::const_iterator p = journal.begin(); p != journal.end(); ++p) {
+		::datum key_datum;
+		key_datum.dptr = const_cast<char*>(p->key.c_str());
+		key_datum.dsize = p->key.length();
+
+		if (p->deleted) {
+		    ::gdbm_delete(compacted, key_datum);
+		} else {
+		    ::datum value_datum;
+		    value_datum.dptr = const_cast<char*>(p->value.c_str());
+		    value_datum.dsize = p->value.length();
+		    ::gdbm_store(compacted, key_datum, value_datum, GDBM_REPLACE);
+		}
+		replayed++;
+	    }
+	    journal.clear();
+	}
+
+	::gdbm_sync(compacted);
+	::gdbm_close(compacted);
+
+	if (std::rename(compact_file.c_str(), greylisting_file().c_str())) {
+	    throw Glib::ustring(N_("Could not move compacted database in place: ")) + std::strerror(errno);
+	}
+
+	return replayed;
+    }
+
+    void database::abort_compaction(std::string const& snapshot_file, std::string const& compact_file) {
+	{
+	    Glib::RWLock::WriterLock lock(swap_lock);
+	    journaling = false;
+
+	    Glib::Mutex::Lock journal_lock(journal_mutex);
+	    journal.clear();
+	}
+
+	::unlink(snapshot_file.c_str());
+	::unlink(compact_file.c_str());
+    }
+
+    /**
+     * get the microseconds passed since a point in time
+     */
+    static long microseconds_since(struct ::timespec const& start) {
+	struct ::timespec now;
+	::clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start.tv_sec) * 1000000L + (now.tv_nsec - start.tv_nsec) / 1000;
+    }
+
+    database::compaction_result database::compact_online() {
+	std::string snapshot_file = greylisting_file() + ".snapshot";
+	std::string compact_file = greylisting_file() + ".compact";
+	compaction_result result;
+	result.records = 0;
+	result.replayed = 0;
+	result.blocked_us = 0;
+
+	try {
+	    struct ::timespec blocked_since;
+
+	    // start journaling while no request uses the database
+	    {
+		Glib::RWLock::WriterLock lock(swap_lock);
+		::clock_gettime(CLOCK_MONOTONIC, &blocked_since);
+		journaling = true;
+		result.blocked_us += microseconds_since(blocked_since);
+	    }
+
+	    // writes completed before are in the snapshot, writes done meanwhile wait for it or get journaled
+	    ::clock_gettime(CLOCK_MONOTONIC, &blocked_since);
+	    take_snapshot(snapshot_file, -1);
+	    result.blocked_us += microseconds_since(blocked_since);
+
+	    // copy the records, requests can use the live database meanwhile
+	    result.records = copy_records(snapshot_file, compact_file);
+	    ::unlink(snapshot_file.c_str());
+
+	    // apply what has been written meanwhile and swap the files
+	    {
+		Glib::RWLock::WriterLock lock(swap_lock);
+		::clock_gettime(CLOCK_MONOTONIC, &blocked_since);
+		result.replayed = replay_and_swap(compact_file);
+		journaling = false;
+		result.blocked_us += microseconds_since(blocked_since);
+	    }
+	} catch (Glib::ustring) {
+	    abort_compaction(snapshot_file, compact_file);
+	    throw;
+	}
+
+	return result;
+    }
+
+    void database::tune(database_tuning const& parameters) {
+	tuning = parameters;
+    }
+
+    void database::set_directory(std::string const& path) {
+	directory = path;
+    }
+
+    std::string const& database::get_directory() {
+	return directory;
+    }
+
+    std::string database::greylisting_file() {
+	return directory + "/" DATABASE_FILE_NAME;
+    }
 }
@@ -31,6 +31,9 @@
 #include <list>
 
 #include <gdbm.h>
+#include <glibmm.h>
+
+#include <database_tuning.h>
 
 #ifndef N_
 #   define N_(n) (n)
@@ -43,15 +46,57 @@ namespace couriergrey {
     class database {
 	public:
 	    /**
-	     * create a database instance
+	     * how the greylisting database is opened
+	     */
+	    enum open_mode {
+		/**
+		 * open the database as writer, nobody else can use it at the same time
+		 */
+		writer,
+
+		/**
+		 * open the database as reader, other readers can use it at the same time
+		 */
+		reader,
+
+		/**
+		 * open a private point-in-time copy of the database
+		 *
+		 * The live database is only locked while the copy is taken, which is
+		 * done by sharing the blocks of the file if the filesystem supports it.
+		 */
+		snapshot
+	    };
+
+	    /**
+	     * create a database instance for the greylisting database
+	     *
+	     * @param timeout_ms how long to try opening the database in milliseconds, -1 for the default retries
+	     * @param mode how to open the database
 	     */
-	    database();
+	    database(int timeout_ms = -1, open_mode mode = writer);
+
+	    /**
+	     * create a database instance for another database file
+	     *
+	     * Only the greylisting database takes part in online compaction.
+	     *
+	     * @param filename the file of the database
+	     * @param timeout_ms how long to try opening the database in milliseconds, -1 for the default retries
+	     * @param read_only open the database as reader, other readers can use it at the same time
+	     */
+	    database(std::string const& filename, int timeout_ms = -1, bool read_only = false);
 
 	    /**
 	     * destruct a database instance
 	     */
 	    ~database();
 
+	    /**
+	     * release the database before the instance is destructed, it cannot be used anymore then
+	     */
+	    void close();
+
 	    /**
 	     * fetch a value from a key
 	     */
@@ -74,15 +119,228 @@ namespace couriergrey {
 	     */
 	    void reorganize();
 
+	    /**
+	     * write all changes to disk
+	     */
+	    void sync();
+
 	    /**
 	     * get all the keys in the database
 	     */
 	    std::list<std::string> get_keys();
+
+	    /**
+	     * interface of classes processing all records of a database
+	     */
+	    class record_visitor {
+		public:
+		    virtual ~record_visitor() {}
+
+		    /**
+		     * called for each record
+		     */
+		    virtual void visit(std::string const& key, std::string const& value) = 0;
+	    };
+
+	    /**
+	     * call a visitor for each record, without collecting all keys first
+	     */
+	    void scan(record_visitor& visitor);
+
+	    /**
+	     * result of an online compaction
+	     */
+	    struct compaction_result {
+		/**
+		 * number of records copied from the snapshot
+		 */
+		long records;
+
+		/**
+		 * number of journaled writes replayed to the compacted database
+		 */
+		long replayed;
+
+		/**
+		 * time other threads could not write the database, in microseconds
+		 */
+		long blocked_us;
+	    };
+
+	    /**
+	     * compact the database while it is in use
+	     *
+	     * A snapshot of the database is taken and copied to a new file, while the
+	     * writes done by this process meanwhile are journaled. The journal is then
+	     * replayed to the new file, which is atomically renamed to replace the live
+	     * database. Readers only have to wait while the journal is replayed, writers
+	     * also while the snapshot is taken.
+	     *
+	     * Writes done by other processes after the snapshot has been taken are lost.
+	     *
+	     * @throws Glib::ustring if the database could not be compacted
+	     */
+	    static compaction_result compact_online();
+
+	    /**
+	     * set the storage parameters databases are opened with from now on
+	     */
+	    static void tune(database_tuning const& parameters);
+
+	    /**
+	     * set the directory of the greylisting database and the files kept next to it, before any of them is opened
+	     */
+	    static void set_directory(std::string const& path);
+
+	    /**
+	     * get the directory of the greylisting database and the files kept next to it
+	     */
+	    static std::string const& get_directory();
 	private:
+	    /**
+	     * the storage parameters databases are opened with
+	     */
+	    static database_tuning tuning;
+
+	    /**
+	     * the directory of the greylisting database
+	     */
+	    static std::string directory;
+
+	    /**
+	     * get the file of the greylisting database
+	     */
+	    static std::string greylisting_file();
+
+	    /**
+	     * a write done while the database is being compacted
+	     */
+	    struct journal_entry {
+		/**
+		 * the key that has been written
+		 */
+		std::string key;
+
+		/**
+		 * the value that has been stored
+		 */
+		std::string value;
+
+		/**
+		 * if the key has been deleted instead
+		 */
+		bool deleted;
+	    };
+
+	    /**
+	     * instances hold this lock as readers, online compaction as writer to swap the files
+	     */
+	    static Glib::RWLock swap_lock;
+
+	    /**
+	     * if writes have to be journaled, only changed while holding swap_lock as writer
+	     */
+	    static bool journaling;
+
+	    /**
+	     * the writes done while the database is compacted
+	     */
+	    static std::list<journal_entry> journal;
+
+	    /**
+	     * protecting journal
+	     */
+	    static Glib::Mutex journal_mutex;
+
+	    /**
+	     * add a write to the journal if the database is being compacted
+	     */
+	    static void journal_write(std::string const& key, std::string const& value, bool deleted);
+
+	    /**
+	     * copy the live database to a snapshot file
+	     *
+	     * The database is locked as reader while it is copied, retrying while a
+	     * writer holds it. Without a filesystem sharing the blocks this blocks the
+	     * writers for the time of a full copy.
+	     *
+	     * @param snapshot_file where to create the copy
+	     * @param timeout_ms how long to try at most in milliseconds, -1 for the default retries
+	     */
+	    static void take_snapshot(std::string const& snapshot_file, int timeout_ms);
+
+	    /**
+	     * copy all records of the snapshot to a new database file
+	     *
+	     * @return number of copied records
+	     */
+	    static long copy_records(std::string const& snapshot_file, std::string const& compact_file);
+
+	    /**
+	     * replay the journal to the compacted database and move it in place
+	     *
+	     * @return number of replayed writes
+	     */
+	    static long replay_and_swap(std::string const& compact_file);
+
+	    /**
+	     * stop journaling and remove temporary files after a failed compaction
+	     */
+	    static void abort_compaction(std::string const& snapshot_file, std::string const& compact_file);
+
 	    /**
 	     * The GDMB database handle
 	     */
 	    ::GDBM_FILE db;
+
+	    /**
+	     * if this is the greylisting database, that can be compacted online
+	     */
+	    bool is_greylisting_database;
+
+	    /**
+	     * if the database has been opened as reader
+	     */
+	    bool read_only;
+
+	    /**
+	     * file descriptor we hold our own lock of the file on, -1 if gdbm locks the file
+	     */
+	    int lock_fd;
+
+	    /**
+	     * the private copy of the database we opened, empty if we opened the live database
+	     */
+	    std::string snapshot_file;
+
+	    /**
+	     * create a private copy of the live database, retrying while it is locked by a writer
+	     *
+	     * @param timeout_ms how long to try at most in milliseconds, -1 for the default retries
+	     */
+	    void create_snapshot(int timeout_ms);
+
+	    /**
+	     * try to open a database file once
+	     *
+	     * @return true if the database has been opened
+	     */
+	    bool try_open(char const* filename);
+
+	    /**
+	     * open a database file
+	     *
+	     * If the database is locked by another writer, we retry ten times a second
+	     * apart, or every DATABASE_RETRY_INTERVAL_MS until the timeout has passed.
+	     * Readers always retry every DATABASE_RETRY_INTERVAL_MS, as writers only
+	     * hold the lock for short batches. If we lock the file ourselves, an attempt
+	     * is cheap and we start retrying after DATABASE_LOCK_RETRY_INTERVAL_MS,
+	     * doubling the interval up to DATABASE_RETRY_INTERVAL_MS.
+	     *
+	     * @param filename the file to open
+	     * @param timeout_ms how long to try at most in milliseconds, -1 for the default retries
+	     */
+	    void open(char const* filename, int timeout_ms = -1);
     };
 }
 
@@ -0,0 +1,303 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "database_report.h"
+#include "ip_address.h"
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+/**
+ * number of records passed to an aggregator at once
+ */
+#define REPORT_CHUNK_SIZE 4096
+
+/**
+ * number of chunks that may wait for an aggregator, the scan pauses if there are more
+ */
+#define REPORT_QUEUE_LENGTH 64
+
+/**
+ * number of clients and networks the heavy hitters sketches count at most
+ */
+#define REPORT_SKETCH_CAPACITY 4096
+
+/**
+ * number of clients and networks listed in the report
+ */
+#define REPORT_TOP_ENTRIES 20
+
+/**
+ * entries with delivery attempts this far apart (in seconds) have passed greylisting, as marked by --dumpdatabase
+ */
+#define GREYLISTING_DELAY 120
+
+/**
+ * prefix lengths clients are aggregated to for the list of networks
+ */
+#define REPORT_IPV4_PREFIX 24
+#define REPORT_IPV6_PREFIX 48
+
+namespace couriergrey {
+    /**
+     * upper bounds of the ranges the ages of entries are counted in, in seconds
+     */
+    static const long age_limits[database_report::age_ranges-1] = { 3600, 86400, 7 * 86400, 30 * 86400, 90 * 86400 };
+
+    /**
+     * the names of the ranges the ages of entries are counted in
+     */
+    static char const* const age_names[database_report::age_ranges] = { "< 1 hour", "< 1 day", "< 7 days", "< 30 days", "< 90 days", ">= 90 days" };
+
+    /**
+     * get the range an age is counted in
+     */
+    static int age_range(long age) {
+	int range = 0;
+	while (range < database_report::age_ranges-1 && age >= age_limits[range]) {
+	    range++;
+	}
+	return range;
+    }
+
+    database_report::totals::totals() : entries(0), passed(0), unparsable(0), clients(REPORT_SKETCH_CAPACITY), networks(REPORT_SKETCH_CAPACITY) {
+	for (int i = 0; i < age_ranges; i++) {
+	    first_age[i] = last_age[i] = 0;
+	}
+    }
+
+    void database_report::totals::merge(totals const& other) {
+	entries += other.entries;
+	passed += other.passed;
+	unparsable += other.unparsable;
+	for (int i = 0; i < age_ranges; i++) {
+	    first_age[i] += other.first_age[i];
+	    last_age[i] += other.last_age[i];
+	}
+	clients.merge(other.clients);
+	networks.merge(other.networks);
+    }
+
+    database_report::database_report(int threads) : thread_count(threads > 0 ? threads : 1), now(0), scan_seconds(0), collecting(new record_chunk), scan_done(false) {
+	collecting->reserve(REPORT_CHUNK_SIZE);
+    }
+
+    database_report::~database_report() {
+	delete collecting;
+	for (std::list<record_chunk*>::iterator p = queued.begin(); p != queued.end(); ++p) {
+	    delete *p;
+	}
+    }
+
+    void database_report::scan(database& db) {
+	struct ::timeval started;
+	::gettimeofday(&started, NULL);
+	now = started.tv_sec;
+
+	std::vector<totals*> partial;
+	std::vector<Glib::Thread*> aggregators;
+	for (int i = 0; i < thread_count; i++) {
+	    partial.push_back(new totals);
+	    aggregators.push_back(Glib::Thread::create(sigc::bind(sigc::mem_fun(*this, &database_report::aggregate), partial.back()), true));
+	}
+
+	db.scan(*this);
+	queue_chunk();
+
+	{
+	    Glib::Mutex::Lock lock(queue_mutex);
+	    scan_done = true;
+	    chunk_queued.broadcast();
+	}
+
+	for (int i = 0; i < thread_count; i++) {
+	    aggregators[i]->join();
+	    result.merge(*partial[i]);
+	    delete partial[i];
+	}
+
+	struct ::timeval finished;
+	::gettimeofday(&finished, NULL);
+	scan_seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_usec - started.tv_usec) / 1000000.0;
+    }
+
+    void database_report::visit(std::string const& key, std::string const& value) {
+	collecting->push_back(std::make_pair(key, value));
+	if (collecting->size() >= REPORT_CHUNK_SIZE) {
+	    queue_chunk();
+	}
+    }
+
+    void database_report::queue_chunk() {
+	if (collecting->empty()) {
+	    return;
+	}
+
+	Glib::Mutex::Lock lock(queue_mutex);
+	while (queued.size() >= REPORT_QUEUE_LENGTH) {
+	    chunk_taken.wait(queue_mutex);
+	}
+	queued.push_back(collecting);
+	chunk_queued.signal();
+
+	collecting = new record_chunk;
+	collecting->reserve(REPORT_CHUNK_SIZE);
+    }
+
+    void database_report::aggregate(totals* result) {
+	for (;;) {
+	    record_chunk* chunk = NULL;
+
+	    {
+		Glib::Mutex::Lock lock(queue_mutex);
+		while (queued.empty() && !scan_done) {
+		    chunk_queued.wait(queue_mutex);
+		}
+		if (queued.empty()) {
+		    return;
+		}
+		chunk = queued.front();
+		queued.pop_front();
+		chunk_taken.signal();
+	    }
+
+	    for (record_chunk::const_iterator p = chunk->begin(); p != chunk->end(); ++p) {
+		count(*result, p->first, p->second);
+	    }
+	    delete chunk;
+	}
+    }
+
+    void database_report::count(totals& result, std::string const& key, std::string const& value) const {
+	// the value is "first_connect last_connect [client_network]"
+	char const* field = value.c_str();
+	char* field_end = NULL;
+	long first_connect = std::strtol(field, &field_end, 10);
+	if (field_end == field) {
+	    result.unparsable++;
+	    return;
+	}
+	field = field_end;
+	long last_connect = std::strtol(field, &field_end, 10);
+	if (field_end == field) {
+	    result.unparsable++;
+	    return;
+	}
+	while (*field_end == ' ') {
+	    field_end++;
+	}
+
+	result.entries++;
+	if (last_connect - first_connect >= GREYLISTING_DELAY) {
+	    result.passed++;
+	}
+	result.first_age[age_range(now - first_connect)]++;
+	result.last_age[age_range(now - last_connect)]++;
+
+	// the client as used in the key, older entries only have it in the key ("sender/client/recipients")
+	std::string client(field_end);
+	if (client.empty()) {
+	    std::string::size_type client_start = key.find('/');
+	    if (client_start == std::string::npos) {
+		return;
+	    }
+	    client = key.substr(client_start + 1, key.find('/', client_start + 1) - client_start - 1);
+	}
+	result.clients.offer(client);
+
+	// the network of the client
+	std::string::size_type prefix_start = client.find('/');
+	std::string address = client.substr(0, prefix_start);
+	try {
+	    ip_address client_address(address.c_str());
+	    int prefix = client_address.is_ipv4() ? REPORT_IPV4_PREFIX : REPORT_IPV6_PREFIX;
+	    if (prefix_start != std::string::npos) {
+		int client_prefix = std::atoi(client.c_str() + prefix_start + 1);
+		if (client_prefix < prefix) {
+		    prefix = client_prefix;
+		}
+	    }
+
+	    char network_address[INET6_ADDRSTRLEN];
+	    client_address.masked(prefix).format(network_address, sizeof(network_address));
+	    char network[INET6_ADDRSTRLEN+4];
+	    std::snprintf(network, sizeof(network), "%s/%d", network_address, prefix);
+	    result.networks.offer(network);
+	} catch (std::invalid_argument const&) {
+	    // not an address, there is no network to count it for
+	}
+    }
+
+    /**
+     * print a list of heavy hitters
+     */
+    static void print_top(std::ostream& out, heavy_hitters const& counted) {
+	std::list<heavy_hitters::item> const top = counted.top(REPORT_TOP_ENTRIES);
+	for (std::list<heavy_hitters::item>::const_iterator p = top.begin(); p != top.end(); ++p) {
+	    out << "\t" << p->count;
+	    if (p->error > 0) {
+		out << " (+/- " << p->error << ")";
+	    }
+	    out << "\t" << p->name << std::endl;
+	}
+    }
+
+    void database_report::print(std::ostream& out) const {
+	out << N_("Entries: ") << result.entries << std::endl;
+	out << N_("Passed greylisting: ") << result.passed;
+	if (result.entries > 0) {
+	    char percentage[16];
+	    std::snprintf(percentage, sizeof(percentage), "%.1f", 100.0 * result.passed / result.entries);
+	    out << " (" << percentage << " %)";
+	}
+	out << std::endl;
+	if (result.unparsable > 0) {
+	    out << N_("Unparsable records: ") << result.unparsable << std::endl;
+	}
+
+	out << std::endl << N_("Time since the first delivery attempt:") << std::endl;
+	for (int i = 0; i < age_ranges; i++) {
+	    out << "\t" << age_names[i] << "\t" << result.first_age[i] << std::endl;
+	}
+
+	out << std::endl << N_("Time since the last delivery attempt:") << std::endl;
+	for (int i = 0; i < age_ranges; i++) {
+	    out << "\t" << age_names[i] << "\t" << result.last_age[i] << std::endl;
+	}
+
+	out << std::endl << N_("Top clients:") << std::endl;
+	print_top(out, result.clients);
+
+	out << std::endl << N_("Top networks:") << std::endl;
+	print_top(out, result.networks);
+
+	char duration[16];
+	std::snprintf(duration, sizeof(duration), "%.2f", scan_seconds);
+	out << std::endl << N_("Scanned in ") << duration << N_(" s using ") << thread_count << N_(" aggregator threads") << std::endl;
+    }
+}
@@ -0,0 +1,178 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef DATABASE_REPORT_H
+#define DATABASE_REPORT_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <string>
+#include <vector>
+#include <list>
+#include <ostream>
+#include <ctime>
+#include <glibmm.h>
+
+#include <database.h>
+#include <heavy_hitters.h>
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * statistics on the content of the greylisting database (--stats)
+     *
+     * The calling thread scans the database and passes the records in chunks to
+     * aggregator threads. Each aggregator keeps its own totals, which are merged
+     * after the scan, so the aggregators never wait for each other.
+     */
+    class database_report : public database::record_visitor {
+	public:
+	    /**
+	     * create a report
+	     *
+	     * @param threads number of aggregator threads
+	     */
+	    database_report(int threads);
+
+	    /**
+	     * destruct a report
+	     */
+	    ~database_report();
+
+	    /**
+	     * scan a database and aggregate its records
+	     */
+	    void scan(database& db);
+
+	    /**
+	     * print the report
+	     */
+	    void print(std::ostream& out) const;
+
+	    /**
+	     * collect a record while scanning
+	     */
+	    void visit(std::string const& key, std::string const& value);
+
+	    /**
+	     * number of ranges the ages of entries are counted in
+	     */
+	    static const int age_ranges = 6;
+	private:
+	    /**
+	     * the aggregated values
+	     */
+	    struct totals {
+		totals();
+
+		/**
+		 * add the values of other totals
+		 */
+		void merge(totals const& other);
+
+		long entries;
+		long passed;		/**< entries that have passed greylisting */
+		long unparsable;	/**< records with a value that could not be parsed */
+		long first_age[age_ranges];	/**< entries by time since their first delivery attempt */
+		long last_age[age_ranges];	/**< entries by time since their last delivery attempt */
+		heavy_hitters clients;	/**< entries by client as used in the key */
+		heavy_hitters networks;	/**< entries by the network of the client */
+	    };
+
+	    /**
+	     * records passed to an aggregator at once
+	     */
+	    typedef std::vector<std::pair<std::string, std::string> > record_chunk;
+
+	    /**
+	     * aggregate chunks until the scan is done (aggregator thread)
+	     */
+	    void aggregate(totals* result);
+
+	    /**
+	     * add a record to totals
+	     */
+	    void count(totals& result, std::string const& key, std::string const& value) const;
+
+	    /**
+	     * pass the chunk collected by visit() to the aggregators
+	     */
+	    void queue_chunk();
+
+	    /**
+	     * number of aggregator threads
+	     */
+	    int thread_count;
+
+	    /**
+	     * the time the ages of entries are calculated relative to
+	     */
+	    std::time_t now;
+
+	    /**
+	     * how long the scan took, in seconds
+	     */
+	    double scan_seconds;
+
+	    /**
+	     * the records collected by visit() but not yet queued
+	     */
+	    record_chunk* collecting;
+
+	    /**
+	     * chunks waiting for an aggregator, protected by queue_mutex
+	     */
+	    std::list<record_chunk*> queued;
+
+	    /**
+	     * set when all chunks have been queued, protected by queue_mutex
+	     */
+	    bool scan_done;
+
+	    /**
+	     * protecting queued and scan_done
+	     */
+	    Glib::Mutex queue_mutex;
+
+	    /**
+	     * signalled if a chunk has been queued or the scan is done
+	     */
+	    Glib::Cond chunk_queued;
+
+	    /**
+	     * signalled if an aggregator took a chunk
+	     */
+	    Glib::Cond chunk_taken;
+
+	    /**
+	     * the merged totals of all aggregators
+	     */
+	    totals result;
+    };
+}
+
+#endif // DATABASE_REPORT_H
@@ -0,0 +1,111 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "database_tuning.h"
+#include <sstream>
+#include <cstdlib>
+#include <glibmm.h>
+#include <gdbm.h>
+
+namespace couriergrey {
+    /**
+     * parse the value of a numeric option
+     */
+    static int option_value(std::string const& option, std::string const& value) {
+	char* value_end = NULL;
+	long parsed = std::strtol(value.c_str(), &value_end, 10);
+	if (value.empty() || *value_end != '\0' || parsed < 0 || parsed > 0x7fffffff) {
+	    throw Glib::ustring(N_("Invalid value for database option ")) + option + ": " + value;
+	}
+	return parsed;
+    }
+
+    database_tuning::database_tuning(std::string const& options) : block_size(0), cache_size(0), sync(false), mmap(true), preread(false), own_locking(false) {
+	std::string::size_type start = 0;
+	while (start <= options.length()) {
+	    std::string::size_type end = options.find(',', start);
+	    if (end == std::string::npos) {
+		end = options.length();
+	    }
+	    std::string const option = options.substr(start, end - start);
+	    start = end + 1;
+
+	    std::string::size_type equals = option.find('=');
+	    std::string const name = option.substr(0, equals);
+	    std::string const value = equals == std::string::npos ? std::string() : option.substr(equals + 1);
+
+	    if (name == "blocksize") {
+		block_size = option_value(name, value);
+	    } else if (name == "cachesize") {
+		cache_size = option_value(name, value);
+	    } else if (name == "sync") {
+		sync = true;
+	    } else if (name == "nommap") {
+#ifdef GDBM_NOMMAP
+		mmap = false;
+#else
+		throw Glib::ustring(N_("The gdbm library does not support database option ")) + name;
+#endif
+	    } else if (name == "preread") {
+#ifdef GDBM_PREREAD
+		preread = true;
+#else
+		throw Glib::ustring(N_("The gdbm library does not support database option ")) + name;
+#endif
+	    } else if (name == "ownlock") {
+		own_locking = true;
+	    } else if (name != "defaults" && !name.empty()) {
+		throw Glib::ustring(N_("Unknown database option: ")) + name;
+	    }
+	}
+    }
+
+    std::string database_tuning::describe() const {
+	std::ostringstream result;
+
+	if (block_size > 0) {
+	    result << ",blocksize=" << block_size;
+	}
+	if (cache_size > 0) {
+	    result << ",cachesize=" << cache_size;
+	}
+	if (sync) {
+	    result << ",sync";
+	}
+	if (!mmap) {
+	    result << ",nommap";
+	}
+	if (preread) {
+	    result << ",preread";
+	}
+	if (own_locking) {
+	    result << ",ownlock";
+	}
+
+	std::string const description = result.str();
+	return description.empty() ? "defaults" : description.substr(1);
+    }
+}
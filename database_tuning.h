@@ -0,0 +1,91 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef DATABASE_TUNING_H
+#define DATABASE_TUNING_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <string>
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * the storage parameters the gdbm files are opened with
+     */
+    struct database_tuning {
+	/**
+	 * create the default parameters, as couriergrey used them before they could be tuned
+	 */
+	database_tuning() : block_size(0), cache_size(0), sync(false), mmap(true), preread(false), own_locking(false) {}
+
+	/**
+	 * create parameters from a list of options
+	 *
+	 * @param options comma separated list of blocksize=BYTES, cachesize=BUCKETS, sync, nommap, preread and ownlock, or "defaults"
+	 * @throws Glib::ustring if an option is unknown, has an invalid value or is not supported by the gdbm library
+	 */
+	database_tuning(std::string const& options);
+
+	/**
+	 * describe the parameters in the format they are parsed from
+	 */
+	std::string describe() const;
+
+	/**
+	 * block size of newly created files in bytes, 0 for the block size of the file system
+	 */
+	int block_size;
+
+	/**
+	 * number of buckets gdbm caches in memory, 0 for the default of gdbm
+	 */
+	int cache_size;
+
+	/**
+	 * if each write is synced to disk
+	 */
+	bool sync;
+
+	/**
+	 * if gdbm may access the file by mapping it to memory (if the library supports it)
+	 */
+	bool mmap;
+
+	/**
+	 * if the whole file is read when it is mapped (if the library supports it)
+	 */
+	bool preread;
+
+	/**
+	 * if the file is locked by us instead of gdbm, so that waiting for the lock does not reopen the file
+	 */
+	bool own_locking;
+    };
+}
+
+#endif // DATABASE_TUNING_H
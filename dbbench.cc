@@ -0,0 +1,321 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+/*
+ * couriergrey-dbbench: run a greylisting workload against a scratch database
+ * for different storage parameters, to choose the parameters from data
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "database.h"
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <list>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <popt.h>
+#include <glibmm.h>
+
+/**
+ * the storage parameters benchmarked if no matrix is given, one per entry
+ */
+static char const* const default_matrix[] = {
+    "defaults",
+    "blocksize=512",
+    "blocksize=1024",
+    "blocksize=4096",
+    "cachesize=100",
+    "cachesize=1000",
+    "nommap",
+    "preread",
+    "ownlock",
+    "sync",
+    "blocksize=512,cachesize=1000,ownlock",
+    NULL
+};
+
+/**
+ * share of requests for a triplet already in the database (retries), in percent
+ */
+#define KNOWN_TRIPLET_PERCENT 70
+
+/**
+ * entries older than this are expired, in days (the preloaded entries are up to twice as old)
+ */
+#define EXPIRE_DAYS 30
+
+/**
+ * how long a request may wait for the database lock, in milliseconds
+ */
+#define OPEN_TIMEOUT_MS 10000
+
+/**
+ * the work and the results of a benchmark thread
+ */
+struct bench_worker {
+    std::string filename;
+    int requests;
+    int keys;
+    unsigned seed;
+    int failures;
+    std::vector<long> latencies_us;
+};
+
+/**
+ * current time in microseconds
+ */
+static long long now_us() {
+    struct ::timeval now;
+    ::gettimeofday(&now, NULL);
+    return static_cast<long long>(now.tv_sec) * 1000000 + now.tv_usec;
+}
+
+/**
+ * the key of a triplet, built the way couriergrey builds it
+ */
+static std::string triplet_key(int number) {
+    std::ostringstream key;
+    key << "sender" << number << "@example.org/192.0.2." << number % 256 << "/rcpt" << number % 1000 << "@example.net";
+    return key.str();
+}
+
+/**
+ * the value of an entry
+ */
+static std::string entry_value(std::time_t first_connect, std::time_t last_connect, int number) {
+    std::ostringstream value;
+    value << first_connect << ' ' << last_connect << " 192.0.2." << number % 256 << "/32";
+    return value.str();
+}
+
+/**
+ * size of a file in kilobytes
+ */
+static long file_size_kb(std::string const& filename) {
+    struct ::stat file_stat;
+    if (::stat(filename.c_str(), &file_stat)) {
+	return -1;
+    }
+    return file_stat.st_size / 1024;
+}
+
+/**
+ * fill the scratch database with entries of different ages
+ */
+static void preload(std::string const& filename, int keys) {
+    couriergrey::database db(filename, OPEN_TIMEOUT_MS);
+    std::time_t now = std::time(NULL);
+    for (int i = 0; i < keys; i++) {
+	std::time_t last_connect = now - (static_cast<long>(i) * 2 * EXPIRE_DAYS * 86400 / keys);
+	db.store(triplet_key(i), entry_value(last_connect - 300, last_connect, i));
+    }
+}
+
+/**
+ * process requests as couriergrey does: open the database, fetch the entry, store it, close the database
+ */
+static void run_requests(bench_worker* worker) {
+    for (int i = 0; i < worker->requests; i++) {
+	int number = static_cast<int>(::rand_r(&worker->seed) % 100) < KNOWN_TRIPLET_PERCENT
+	    ? ::rand_r(&worker->seed) % worker->keys
+	    : worker->keys + ::rand_r(&worker->seed);
+	std::string const key = triplet_key(number);
+
+	long long started = now_us();
+	try {
+	    couriergrey::database db(worker->filename, OPEN_TIMEOUT_MS);
+	    std::string const value = db.fetch(key);
+	    std::time_t now = std::time(NULL);
+	    std::time_t first_connect = value.empty() ? now : std::strtol(value.c_str(), NULL, 10);
+	    db.store(key, entry_value(first_connect, now, number));
+	} catch (Glib::ustring msg) {
+	    worker->failures++;
+	    continue;
+	}
+	worker->latencies_us.push_back(now_us() - started);
+    }
+}
+
+/**
+ * delete the old entries and reorganize the database, as couriergrey --expire does
+ *
+ * @return number of expired entries
+ */
+static int expire(std::string const& filename) {
+    couriergrey::database db(filename, OPEN_TIMEOUT_MS);
+    std::time_t now = std::time(NULL);
+    int expired = 0;
+
+    std::list<std::string> const keys = db.get_keys();
+    for (std::list<std::string>::const_iterator p = keys.begin(); p != keys.end(); ++p) {
+	std::string const value = db.fetch(*p);
+	char const* last_connect = std::strchr(value.c_str(), ' ');
+	if (last_connect && now - std::strtol(last_connect, NULL, 10) > EXPIRE_DAYS * 86400) {
+	    db.del(*p);
+	    expired++;
+	}
+    }
+    db.reorganize();
+
+    return expired;
+}
+
+/**
+ * benchmark one combination of storage parameters and print a line of results
+ */
+static void benchmark(std::string const& options, std::string const& filename, int keys, int requests, int threads) {
+    couriergrey::database::tune(couriergrey::database_tuning(options));
+    ::unlink(filename.c_str());
+
+    preload(filename, keys);
+
+    // process the requests in parallel
+    std::vector<bench_worker> workers(threads);
+    std::vector<Glib::Thread*> running;
+    long long started = now_us();
+    for (int i = 0; i < threads; i++) {
+	workers[i].filename = filename;
+	workers[i].requests = requests / threads + (i < requests % threads ? 1 : 0);
+	workers[i].keys = keys;
+	workers[i].seed = i + 1;
+	workers[i].failures = 0;
+	workers[i].latencies_us.reserve(workers[i].requests);
+	running.push_back(Glib::Thread::create(sigc::bind(sigc::ptr_fun(&run_requests), &workers[i]), true));
+    }
+    std::vector<long> latencies_us;
+    int failures = 0;
+    for (int i = 0; i < threads; i++) {
+	running[i]->join();
+	latencies_us.insert(latencies_us.end(), workers[i].latencies_us.begin(), workers[i].latencies_us.end());
+	failures += workers[i].failures;
+    }
+    double seconds = (now_us() - started) / 1000000.0;
+    long size_kb = file_size_kb(filename);
+
+    long long expire_started = now_us();
+    expire(filename);
+    long expire_ms = (now_us() - expire_started) / 1000;
+
+    std::sort(latencies_us.begin(), latencies_us.end());
+    long p50 = latencies_us.empty() ? 0 : latencies_us[latencies_us.size() / 2];
+    long p99 = latencies_us.empty() ? 0 : latencies_us[latencies_us.size() * 99 / 100];
+    long max = latencies_us.empty() ? 0 : latencies_us.back();
+
+    std::cout << std::left << std::setw(40) << options << std::right
+	<< std::setw(10) << static_cast<long>(latencies_us.size() / seconds)
+	<< std::setw(10) << p50
+	<< std::setw(10) << p99
+	<< std::setw(10) << max
+	<< std::setw(8) << failures
+	<< std::setw(10) << size_kb
+	<< std::setw(10) << expire_ms
+	<< std::setw(10) << file_size_kb(filename) << std::endl;
+
+    ::unlink(filename.c_str());
+}
+
+int main(int argc, char const** argv) {
+    int keys = 50000;
+    int requests = 20000;
+    int threads = 4;
+    char const* matrix = NULL;
+    char const* directory = "/tmp";
+    int ret = 0;
+
+    struct poptOption options[] = {
+	{ "keys", 0, POPT_ARG_INT, &keys, 0, N_("number of entries in the database before the benchmark"), "entries"},
+	{ "requests", 0, POPT_ARG_INT, &requests, 0, N_("number of requests for each combination of parameters"), "requests"},
+	{ "threads", 0, POPT_ARG_INT, &threads, 0, N_("number of requests processed concurrently"), "threads"},
+	{ "matrix", 0, POPT_ARG_STRING, &matrix, 0, N_("combinations of database options to benchmark, separated by semicolons"), "options;..."},
+	{ "directory", 0, POPT_ARG_STRING, &directory, 0, N_("directory to create the scratch database in"), "path"},
+	POPT_AUTOHELP
+	POPT_TABLEEND
+    };
+
+    Glib::thread_init();
+
+    poptContext pCtx = poptGetContext(NULL, argc, argv, options, 0);
+    while ((ret = poptGetNextOpt(pCtx)) >= 0) {
+    }
+    if (ret < -1) {
+	std::cout << poptBadOption(pCtx, POPT_BADOPTION_NOALIAS) << ": " << poptStrerror(ret) << std::endl;
+	return 1;
+    }
+    if (keys < 1 || requests < 1 || threads < 1) {
+	std::cout << N_("Keys, requests and threads have to be positive") << std::endl;
+	return 1;
+    }
+
+    // the combinations to benchmark
+    std::vector<std::string> combinations;
+    if (matrix) {
+	std::string const matrix_string = matrix;
+	std::string::size_type start = 0;
+	while (start <= matrix_string.length()) {
+	    std::string::size_type end = matrix_string.find(';', start);
+	    if (end == std::string::npos) {
+		end = matrix_string.length();
+	    }
+	    combinations.push_back(matrix_string.substr(start, end - start));
+	    start = end + 1;
+	}
+    } else {
+	for (int i = 0; default_matrix[i]; i++) {
+	    combinations.push_back(default_matrix[i]);
+	}
+    }
+
+    std::string const filename = std::string(directory) + "/" PACKAGE "-dbbench.gdbm";
+
+    std::cout << keys << N_(" entries, ") << requests << N_(" requests, ") << threads << N_(" threads, scratch database ") << filename << std::endl << std::endl;
+    std::cout << std::left << std::setw(40) << "options" << std::right
+	<< std::setw(10) << "req/s"
+	<< std::setw(10) << "p50 us"
+	<< std::setw(10) << "p99 us"
+	<< std::setw(10) << "max us"
+	<< std::setw(8) << "failed"
+	<< std::setw(10) << "size KB"
+	<< std::setw(10) << "expire ms"
+	<< std::setw(10) << "after KB" << std::endl;
+
+    for (std::vector<std::string>::const_iterator p = combinations.begin(); p != combinations.end(); ++p) {
+	try {
+	    benchmark(*p, filename, keys, requests, threads);
+	} catch (Glib::ustring msg) {
+	    std::cout << std::left << std::setw(40) << *p << msg << std::endl;
+	    ::unlink(filename.c_str());
+	}
+    }
+
+    return 0;
+}
@@ -0,0 +1,321 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "decision_log.h"
+#include "statistics.h"
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cstdarg>
+#include <syslog.h>
+#include <unistd.h>
+#include <glibmm.h>
+
+/**
+ * number of records the queue can hold (has to be a power of two)
+ */
+#define DECISION_QUEUE_SIZE 1024
+
+/**
+ * maximum number of records written in one batch
+ */
+#define DECISION_BATCH_SIZE 128
+
+/**
+ * how long the writer thread sleeps if the queue is empty, in microseconds
+ */
+#define DECISION_WRITER_IDLE_US 100000
+
+namespace couriergrey {
+    /**
+     * a record in the queue
+     */
+    struct decision_record {
+	/**
+	 * sequence number of the cell, used to coordinate producers and the consumer
+	 */
+	volatile guint sequence;
+
+	/**
+	 * if this is a notice instead of a decision
+	 */
+	bool is_notice;
+
+	/**
+	 * when the record has been created
+	 */
+	std::time_t time;
+
+	/**
+	 * the envelope sender, or the text of a notice
+	 */
+	char text[256];
+
+	/**
+	 * the address of the sending MTA
+	 */
+	char client[64];
+
+	/**
+	 * number of recipients
+	 */
+	int recipient_count;
+
+	/**
+	 * decision branch (always a string literal)
+	 */
+	char const* branch;
+
+	/**
+	 * response code sent
+	 */
+	int response_code;
+
+	/**
+	 * seconds to wait before the message is accepted
+	 */
+	long wait_seconds;
+
+	/**
+	 * latency of the request
+	 */
+	long latency_us;
+    };
+
+    /**
+     * the queue of records
+     */
+    static decision_record decision_queue[DECISION_QUEUE_SIZE];
+
+    /**
+     * next position producers write to
+     */
+    static volatile guint enqueue_position = 0;
+
+    /**
+     * next position the writer thread reads from (only used by the writer thread)
+     */
+    static guint dequeue_position = 0;
+
+    /**
+     * if the writer thread should stop
+     */
+    static volatile gint writer_stopping = 0;
+
+    /**
+     * the writer thread
+     */
+    static Glib::Thread* writer_thread = NULL;
+
+    /**
+     * file decisions are written to, NULL if not writing decisions to a file
+     */
+    static std::FILE* decision_file = NULL;
+
+    /**
+     * if decisions are written to syslog
+     */
+    static bool decisions_to_syslog = false;
+
+    /**
+     * claim a cell of the queue
+     *
+     * @return the cell, NULL if the queue is full
+     */
+    static decision_record* claim_record(guint& position) {
+	for (;;) {
+	    position = g_atomic_int_get(reinterpret_cast<volatile gint*>(&enqueue_position));
+	    decision_record* record = &decision_queue[position % DECISION_QUEUE_SIZE];
+	    gint difference = static_cast<gint>(g_atomic_int_get(reinterpret_cast<volatile gint*>(&record->sequence)) - position);
+
+	    if (difference == 0) {
+		// cell is free, try to claim it
+		if (g_atomic_int_compare_and_exchange(reinterpret_cast<volatile gint*>(&enqueue_position), position, position + 1)) {
+		    return record;
+		}
+	    } else if (difference < 0) {
+		// cell still has not been read by the writer thread: queue is full
+		return NULL;
+	    }
+	    // else another producer claimed this cell, try again
+	}
+    }
+
+    /**
+     * publish a claimed cell to the writer thread
+     */
+    static void publish_record(decision_record* record, guint position) {
+	g_atomic_int_set(reinterpret_cast<volatile gint*>(&record->sequence), position + 1);
+    }
+
+    /**
+     * write a single record
+     */
+    static void write_record(decision_record const& record) {
+	if (record.is_notice) {
+	    ::syslog(LOG_NOTICE, "%s", record.text);
+	    return;
+	}
+
+	if (decisions_to_syslog) {
+	    ::syslog(LOG_INFO, "decision=%s code=%d sender=<%s> client=%s recipients=%d wait=%ld latency_us=%ld", record.branch, record.response_code, record.text, record.client, record.recipient_count, record.wait_seconds, record.latency_us);
+	    return;
+	}
+
+	struct std::tm time_tm;
+	gmtime_r(&record.time, &time_tm);
+	char time_string[32];
+	std::strftime(time_string, sizeof(time_string), "%Y-%m-%dT%H:%M:%SZ", &time_tm);
+	std::fprintf(decision_file, "%s decision=%s code=%d sender=<%s> client=%s recipients=%d wait=%ld latency_us=%ld\n", time_string, record.branch, record.response_code, record.text, record.client, record.recipient_count, record.wait_seconds, record.latency_us);
+    }
+
+    /**
+     * the writer thread: take records from the queue and write them in batches
+     */
+    static void write_records() {
+	for (;;) {
+	    int written = 0;
+	    while (written < DECISION_BATCH_SIZE) {
+		decision_record& record = decision_queue[dequeue_position % DECISION_QUEUE_SIZE];
+		if (g_atomic_int_get(reinterpret_cast<volatile gint*>(&record.sequence)) != static_cast<gint>(dequeue_position + 1)) {
+		    // no more records
+		    break;
+		}
+
+		write_record(record);
+
+		// release the cell for the producers
+		g_atomic_int_set(reinterpret_cast<volatile gint*>(&record.sequence), dequeue_position + DECISION_QUEUE_SIZE);
+		dequeue_position++;
+		written++;
+	    }
+
+	    if (written > 0 && decision_file) {
+		std::fflush(decision_file);
+	    }
+
+	    // sleep if we have nothing more to do
+	    if (written < DECISION_BATCH_SIZE) {
+		if (g_atomic_int_get(&writer_stopping)) {
+		    return;
+		}
+		::usleep(DECISION_WRITER_IDLE_US);
+	    }
+	}
+    }
+
+    void decision_log::start(std::string const& destination, bool shared_file) {
+	if (destination == "syslog") {
+	    decisions_to_syslog = true;
+	} else if (!destination.empty()) {
+	    decision_file = std::fopen(destination.c_str(), "a");
+	    if (!decision_file) {
+		throw Glib::ustring(N_("Cannot open decision log ")) + destination + ": " + std::strerror(errno);
+	    }
+	    if (shared_file) {
+		std::setvbuf(decision_file, NULL, _IOLBF, 0);
+	    }
+	}
+
+	for (guint i = 0; i < DECISION_QUEUE_SIZE; i++) {
+	    decision_queue[i].sequence = i;
+	}
+
+	writer_thread = Glib::Thread::create(sigc::ptr_fun(&write_records), true);
+    }
+
+    void decision_log::stop() {
+	if (!writer_thread) {
+	    return;
+	}
+
+	g_atomic_int_set(&writer_stopping, 1);
+	writer_thread->join();
+	writer_thread = NULL;
+
+	if (decision_file) {
+	    std::fclose(decision_file);
+	    decision_file = NULL;
+	}
+    }
+
+    void decision_log::decision(char const* sender, char const* client, int recipient_count, char const* branch, int response_code, long wait_seconds, long latency_us) {
+	if (!writer_thread || (!decision_file && !decisions_to_syslog)) {
+	    return;
+	}
+
+	guint position = 0;
+	decision_record* record = claim_record(position);
+	if (!record) {
+	    statistics::increment(statistics::decisions_dropped);
+	    return;
+	}
+
+	record->is_notice = false;
+	record->time = std::time(NULL);
+	std::strncpy(record->text, sender, sizeof(record->text)-1);
+	record->text[sizeof(record->text)-1] = '\0';
+	std::strncpy(record->client, client, sizeof(record->client)-1);
+	record->client[sizeof(record->client)-1] = '\0';
+	record->recipient_count = recipient_count;
+	record->branch = branch;
+	record->response_code = response_code;
+	record->wait_seconds = wait_seconds;
+	record->latency_us = latency_us;
+
+	publish_record(record, position);
+	statistics::increment(statistics::decisions_logged);
+    }
+
+    void decision_log::notice(char const* format, ...) {
+	std::va_list arguments;
+
+	// no writer thread yet (or anymore)? log directly
+	if (!writer_thread) {
+	    char text[256];
+	    va_start(arguments, format);
+	    std::vsnprintf(text, sizeof(text), format, arguments);
+	    va_end(arguments);
+	    ::syslog(LOG_NOTICE, "%s", text);
+	    return;
+	}
+
+	guint position = 0;
+	decision_record* record = claim_record(position);
+	if (!record) {
+	    statistics::increment(statistics::decisions_dropped);
+	    return;
+	}
+
+	record->is_notice = true;
+	record->time = std::time(NULL);
+	va_start(arguments, format);
+	std::vsnprintf(record->text, sizeof(record->text), format, arguments);
+	va_end(arguments);
+
+	publish_record(record, position);
+    }
+}
@@ -0,0 +1,86 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef DECISION_LOG_H
+#define DECISION_LOG_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <string>
+#include <ctime>
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * the decision_log writes a record for each decision and notices of the workers
+     *
+     * Workers put their records into a bounded lock-free queue, a single writer thread
+     * takes them from there and writes them in batches. If the queue is full, records
+     * are dropped (and counted) instead of blocking the worker.
+     *
+     * Notices are always written to syslog, decisions only if a destination for the
+     * decision log has been configured.
+     */
+    class decision_log {
+	public:
+	    /**
+	     * start the writer thread
+	     *
+	     * @param destination file to write decisions to, "syslog" to log them to syslog, empty to not log decisions
+	     * @param shared_file other processes write to the same file, only write complete lines
+	     * @throws Glib::ustring if the file cannot be opened
+	     */
+	    static void start(std::string const& destination, bool shared_file = false);
+
+	    /**
+	     * stop the writer thread after it has written all queued records
+	     */
+	    static void stop();
+
+	    /**
+	     * log a decision
+	     *
+	     * @param sender the envelope sender
+	     * @param client the address of the sending MTA
+	     * @param recipient_count number of envelope recipients
+	     * @param branch the decision branch that has been taken
+	     * @param response_code the response code that has been sent
+	     * @param wait_seconds how long the sender has to wait until the message is accepted
+	     * @param latency_us time between accepting the connection and answering in microseconds
+	     */
+	    static void decision(char const* sender, char const* client, int recipient_count, char const* branch, int response_code, long wait_seconds, long latency_us);
+
+	    /**
+	     * log a notice to syslog
+	     *
+	     * @param format printf() like format of the message
+	     */
+	    static void notice(char const* format, ...) __attribute__ ((format (printf, 1, 2)));
+    };
+}
+
+#endif // DECISION_LOG_H
@@ -0,0 +1,144 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef ENTRY_STORE_H
+#define ENTRY_STORE_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <ctime>
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * interface of the places greylisting entries are kept in
+     *
+     * Requests are processed against the local timestore or against a
+     * couriergrey-stored server using the store_client.
+     */
+    class entry_store {
+	public:
+	    virtual ~entry_store() {}
+
+	    /**
+	     * the data stored for a key
+	     */
+	    struct entry {
+		/**
+		 * time of the first delivery attempt
+		 */
+		std::time_t first_connect;
+
+		/**
+		 * time of the last delivery attempt
+		 */
+		std::time_t last_connect;
+
+		/**
+		 * the client network (address/prefix) that has been used in the key,
+		 * empty for entries stored by older versions
+		 */
+		std::string client_network;
+	    };
+
+	    /**
+	     * a key, referring to characters owned by the caller (e.g. a string in the request arena)
+	     */
+	    struct key {
+		/**
+		 * the characters of the key, not terminated
+		 */
+		char const* data;
+
+		/**
+		 * the number of characters
+		 */
+		std::size_t length;
+	    };
+
+	    /**
+	     * fetch the entries of several keys at once
+	     *
+	     * Keys without an entry get one with both times set to the current time.
+	     *
+	     * @param keys the keys to fetch
+	     * @param count the number of keys
+	     * @param values where to store the entries, in the order of the keys
+	     */
+	    virtual void fetch_entries(key const* keys, std::size_t count, entry* values) const = 0;
+
+	    /**
+	     * store the entries of several keys at once
+	     *
+	     * @param keys the keys to store
+	     * @param count the number of keys
+	     * @param values the entries to store, in the order of the keys
+	     */
+	    virtual void store_entries(key const* keys, std::size_t count, entry const* values) = 0;
+
+	    /**
+	     * fetch the entries of several keys given as strings
+	     *
+	     * @return the entries in the order of the keys
+	     */
+	    std::vector<entry> fetch_entries(std::vector<std::string> const& keys) const {
+		std::vector<key> const refs = refer_to(keys);
+		std::vector<entry> values(keys.size());
+		if (!keys.empty()) {
+		    fetch_entries(&refs[0], refs.size(), &values[0]);
+		}
+		return values;
+	    }
+
+	    /**
+	     * store the entries of several keys given as strings
+	     */
+	    void store_entries(std::vector<std::string> const& keys, std::vector<entry> const& values) {
+		std::vector<key> const refs = refer_to(keys);
+		if (!keys.empty()) {
+		    store_entries(&refs[0], refs.size(), &values[0]);
+		}
+	    }
+	private:
+	    /**
+	     * get keys referring to strings, valid as long as the strings are not changed
+	     */
+	    static std::vector<key> refer_to(std::vector<std::string> const& strings) {
+		std::vector<key> refs(strings.size());
+		for (std::vector<std::string>::size_type i = 0; i < strings.size(); i++) {
+		    refs[i].data = strings[i].data();
+		    refs[i].length = strings[i].length();
+		}
+		return refs;
+	    }
+    };
+}
+
+#endif // ENTRY_STORE_H
@@ -0,0 +1,283 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "file_reader.h"
+#include <cerrno>
+#include <glibmm.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_LIBURING
+#   include <liburing.h>
+#endif
+
+namespace couriergrey {
+    /**
+     * size of the chunks we read files in
+     */
+    static std::string::size_type const read_chunk_size = 16384;
+
+    /**
+     * maximum number of files we read using a single io_uring
+     */
+    static file_reader::size_type const max_ring_entries = 256;
+
+    file_reader::file_reader(request_arena& arena) : filenames(arena_allocator<arena_string>(arena)), limits(arena_allocator<std::string::size_type>(arena)), contents(arena_allocator<arena_string>(arena)) {
+    }
+
+    file_reader::size_type file_reader::add(arena_string const& filename, std::string::size_type limit) {
+	filenames.push_back(filename);
+	limits.push_back(limit);
+	contents.push_back(arena_string(contents.get_allocator()));
+
+	return filenames.size() - 1;
+    }
+
+    void file_reader::read_all() {
+	if (filenames.empty()) {
+	    return;
+	}
+
+	if (!read_all_uring()) {
+	    read_all_plain();
+	}
+    }
+
+    void file_reader::read_all_plain() {
+	for (size_type i = 0; i < filenames.size(); i++) {
+	    read_plain(i);
+	}
+    }
+
+    void file_reader::read_plain(size_type index) {
+	int fd = ::open(filenames[index].c_str(), O_RDONLY);
+	if (fd == -1) {
+	    return;
+	}
+
+	// continue behind what has already been read
+	if (!contents[index].empty() && ::lseek(fd, contents[index].length(), SEEK_SET) == -1) {
+	    ::close(fd);
+	    return;
+	}
+
+	// read directly into the content string
+	for (;;) {
+	    std::string::size_type length = contents[index].length();
+	    std::string::size_type to_read = read_chunk_size;
+	    if (limits[index] > 0) {
+		if (length >= limits[index]) {
+		    break;
+		}
+		if (limits[index] - length < to_read) {
+		    to_read = limits[index] - length;
+		}
+	    }
+
+	    contents[index].resize(length + to_read);
+	    ssize_t bytes_read = ::read(fd, &contents[index][length], to_read);
+	    contents[index].resize(length + (bytes_read > 0 ? bytes_read : 0));
+
+	    if (bytes_read < 0 && errno == EINTR) {
+		continue;
+	    }
+	    if (bytes_read <= 0) {
+		break;
+	    }
+	}
+
+	::close(fd);
+    }
+
+#ifdef HAVE_LIBURING
+    /**
+     * the io_uring of a worker thread, created when the thread reads files for the first time
+     */
+    class thread_ring {
+	public:
+	    thread_ring() : usable(false) {
+		// each file needs an open, a read and a close
+		if (::io_uring_queue_init(3 * max_ring_entries, &ring, 0) < 0) {
+		    // kernel has no io_uring support, or we are not allowed to use it
+		    return;
+		}
+
+		// the files are opened as direct descriptors, each in its own slot of this table
+		if (::io_uring_register_files_sparse(&ring, max_ring_entries) < 0) {
+		    ::io_uring_queue_exit(&ring);
+		    return;
+		}
+
+		usable = true;
+	    }
+
+	    ~thread_ring() {
+		disable();
+	    }
+
+	    /**
+	     * release the ring, the thread does not use io_uring anymore
+	     */
+	    void disable() {
+		if (usable) {
+		    ::io_uring_queue_exit(&ring);
+		    usable = false;
+		}
+	    }
+
+	    /**
+	     * the ring
+	     */
+	    struct ::io_uring ring;
+
+	    /**
+	     * if the ring can be used
+	     */
+	    bool usable;
+	private:
+	    /**
+	     * instances cannot be copied
+	     */
+	    thread_ring(thread_ring const&);
+
+	    /**
+	     * instances cannot be assigned
+	     */
+	    thread_ring& operator=(thread_ring const&);
+    };
+
+    /**
+     * the rings of the worker threads
+     */
+    static Glib::Private<thread_ring> thread_rings;
+
+    /**
+     * the operations submitted for each file, used to tell their completions apart
+     */
+    enum ring_operation {
+	ring_open = 0,
+	ring_read = 1,
+	ring_close = 2
+    };
+
+    /**
+     * prepare a submission for an operation on a file
+     */
+    static struct ::io_uring_sqe* prepare(struct ::io_uring* ring, file_reader::size_type index, ring_operation operation) {
+	struct ::io_uring_sqe* sqe = ::io_uring_get_sqe(ring);
+	::io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(index * 3 + operation));
+	return sqe;
+    }
+
+    bool file_reader::read_all_uring() {
+	size_type const count = filenames.size();
+
+	// for unusually many files the plain path is good enough
+	if (count > max_ring_entries) {
+	    return false;
+	}
+
+	thread_ring* state = thread_rings.get();
+	if (!state) {
+	    state = new thread_ring();
+	    thread_rings.set(state);
+	}
+	if (!state->usable) {
+	    return false;
+	}
+	struct ::io_uring* ring = &state->ring;
+
+	// open each file, read it up to its limit or a first chunk, and close it again, all linked
+	// together; a short read at the end of the file must not keep the file from being closed
+	std::vector<std::string::size_type, arena_allocator<std::string::size_type> > requested(count, 0, limits.get_allocator());
+	for (size_type i = 0; i < count; i++) {
+	    requested[i] = limits[i] > 0 ? limits[i] : read_chunk_size;
+	    contents[i].resize(requested[i]);
+
+	    struct ::io_uring_sqe* sqe = prepare(ring, i, ring_open);
+	    ::io_uring_prep_openat_direct(sqe, AT_FDCWD, filenames[i].c_str(), O_RDONLY | O_CLOEXEC, 0, i);
+	    sqe->flags |= IOSQE_IO_LINK;
+
+	    sqe = prepare(ring, i, ring_read);
+	    ::io_uring_prep_read(sqe, i, &contents[i][0], requested[i], 0);
+	    sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+
+	    sqe = prepare(ring, i, ring_close);
+	    ::io_uring_prep_close_direct(sqe, i);
+	}
+
+	int submitted = ::io_uring_submit_and_wait(ring, 3 * count);
+	bool unsupported = submitted < 0 || static_cast<size_type>(submitted) != 3 * count;
+	for (int done = 0; done < submitted; done++) {
+	    struct ::io_uring_cqe* cqe = NULL;
+	    if (::io_uring_wait_cqe(ring, &cqe) < 0) {
+		unsupported = true;
+		break;
+	    }
+
+	    size_type operation = reinterpret_cast<size_type>(::io_uring_cqe_get_data(cqe));
+	    size_type i = operation / 3;
+	    if (operation % 3 == ring_open && (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)) {
+		// direct descriptors are not known to this kernel
+		unsupported = true;
+	    } else if (operation % 3 == ring_read) {
+		std::string::size_type bytes_read = cqe->res > 0 ? cqe->res : 0;
+		contents[i].resize(bytes_read);
+
+		// a short read means we reached the end of the file
+		if (bytes_read < requested[i] || limits[i] > 0) {
+		    requested[i] = 0;
+		}
+	    }
+	    ::io_uring_cqe_seen(ring, cqe);
+	}
+
+	// io_uring did not work: do not try again in this thread, let read_all_plain() start from scratch
+	if (unsupported) {
+	    state->disable();
+	    for (size_type i = 0; i < count; i++) {
+		contents[i].clear();
+	    }
+	    return false;
+	}
+
+	// files longer than the first chunk are rare, read the rest of them directly
+	for (size_type i = 0; i < count; i++) {
+	    if (requested[i]) {
+		read_plain(i);
+	    }
+	}
+
+	return true;
+    }
+#else
+    bool file_reader::read_all_uring() {
+	return false;
+    }
+#endif
+}
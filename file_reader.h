@@ -0,0 +1,128 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef FILE_READER_H
+#define FILE_READER_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <string>
+#include <vector>
+#include <request_arena.h>
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * a file_reader reads a set of files in one go
+     *
+     * If couriergrey has been built with io_uring support, each file is opened,
+     * read and closed by a chain of linked operations, and the chains of all
+     * files are submitted to the kernel at once. Each thread keeps its ring for
+     * all its requests. Otherwise (or if the running kernel does not support
+     * io_uring) the files are read one after the other using plain read() calls.
+     *
+     * All memory used by the file_reader is taken from a request_arena.
+     */
+    class file_reader {
+	public:
+	    /**
+	     * the type used for indexes of the files
+	     */
+	    typedef std::vector<arena_string>::size_type size_type;
+
+	    /**
+	     * create an empty file_reader
+	     *
+	     * @param arena the arena to allocate memory from
+	     */
+	    file_reader(request_arena& arena);
+
+	    /**
+	     * queue a file for reading
+	     *
+	     * @param filename the file to read
+	     * @param limit maximum number of bytes to read, 0 to read the whole file
+	     * @return index of the file, to be used with content()
+	     */
+	    size_type add(arena_string const& filename, std::string::size_type limit = 0);
+
+	    /**
+	     * read all queued files
+	     *
+	     * Files that cannot be read result in empty content.
+	     */
+	    void read_all();
+
+	    /**
+	     * get the content that has been read for a file
+	     *
+	     * @param index the index returned by add()
+	     */
+	    arena_string const& content(size_type index) const { return contents[index]; }
+
+	    /**
+	     * number of queued files
+	     */
+	    size_type size() const { return filenames.size(); }
+	private:
+	    /**
+	     * the files to read
+	     */
+	    std::vector<arena_string, arena_allocator<arena_string> > filenames;
+
+	    /**
+	     * the read limits of the files
+	     */
+	    std::vector<std::string::size_type, arena_allocator<std::string::size_type> > limits;
+
+	    /**
+	     * the contents of the files
+	     */
+	    std::vector<arena_string, arena_allocator<arena_string> > contents;
+
+	    /**
+	     * read all files using io_uring
+	     *
+	     * @return false if io_uring is not available
+	     */
+	    bool read_all_uring();
+
+	    /**
+	     * read all files using read()
+	     */
+	    void read_all_plain();
+
+	    /**
+	     * read a file using read(), continuing behind the content already read
+	     *
+	     * @param index the index of the file
+	     */
+	    void read_plain(size_type index);
+    };
+}
+
+#endif // FILE_READER_H
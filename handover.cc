@@ -0,0 +1,210 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "handover.h"
+#include "statistics.h"
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <csignal>
+#include <syslog.h>
+#include <glibmm.h>
+
+/**
+ * the file descriptor a successor signals its readiness on, as courierfilter does for the first instance
+ */
+#define READY_FD 3
+
+/**
+ * the byte a successor writes when it is ready
+ */
+#define READY_MESSAGE 'R'
+
+namespace couriergrey {
+    /**
+     * the pipe the successor signals its readiness on, read end
+     */
+    static int ready_pipe = -1;
+
+    /**
+     * move a file descriptor above the one used to signal readiness
+     */
+    static int move_above_ready_fd(int fd) {
+	if (fd > READY_FD) {
+	    return fd;
+	}
+
+	int moved = ::fcntl(fd, F_DUPFD, READY_FD + 1);
+	::close(fd);
+	return moved;
+    }
+
+    /**
+     * write the state to hand over to an unlinked temporary file
+     *
+     * @return the file descriptor of the file
+     */
+    static int write_state() {
+	char state_file[] = LOCALSTATEDIR "/cache/" PACKAGE "/handover.XXXXXX";
+	int fd = ::mkstemp(state_file);
+	if (fd == -1) {
+	    throw Glib::ustring(N_("Could not create state file for the handover: ")) + std::strerror(errno);
+	}
+	::unlink(state_file);
+
+	std::string const state = statistics::format();
+	if (::write(fd, state.c_str(), state.length()) != static_cast<ssize_t>(state.length()) || ::lseek(fd, 0, SEEK_SET) != 0) {
+	    ::close(fd);
+	    throw Glib::ustring(N_("Could not write state file for the handover: ")) + std::strerror(errno);
+	}
+
+	return move_above_ready_fd(fd);
+    }
+
+    /**
+     * check if an argument is one of the options we add when starting a successor
+     */
+    static bool is_handover_option(char const* argument) {
+	return std::strncmp(argument, "--inheritsocket=", 16) == 0 || std::strncmp(argument, "--inheritstate=", 15) == 0;
+    }
+
+    pid_t handover::start_successor(int argc, char const** argv, int listen_fd) {
+	int state_fd = write_state();
+
+	// the successor needs the socket on another file descriptor than the one it signals readiness on
+	int passed_fd = listen_fd > READY_FD ? listen_fd : ::fcntl(listen_fd, F_DUPFD, READY_FD + 1);
+
+	// the arguments of the successor: ours plus the inherited file descriptors
+	std::vector<std::string> arguments;
+	for (int i = 0; i < argc; i++) {
+	    if (!is_handover_option(argv[i])) {
+		arguments.push_back(argv[i]);
+	    }
+	}
+	std::ostringstream inherit_socket;
+	inherit_socket << "--inheritsocket=" << passed_fd;
+	arguments.push_back(inherit_socket.str());
+	std::ostringstream inherit_state;
+	inherit_state << "--inheritstate=" << state_fd;
+	arguments.push_back(inherit_state.str());
+	std::vector<char*> exec_arguments;
+	for (std::vector<std::string>::iterator p = arguments.begin(); p != arguments.end(); ++p) {
+	    exec_arguments.push_back(const_cast<char*>(p->c_str()));
+	}
+	exec_arguments.push_back(NULL);
+
+	int pipe_fds[2];
+	if (::pipe(pipe_fds)) {
+	    ::close(state_fd);
+	    if (passed_fd != listen_fd) {
+		::close(passed_fd);
+	    }
+	    throw Glib::ustring(N_("Could not create pipe for the handover: ")) + std::strerror(errno);
+	}
+	pipe_fds[0] = move_above_ready_fd(pipe_fds[0]);
+	pipe_fds[1] = move_above_ready_fd(pipe_fds[1]);
+
+	pid_t successor = ::fork();
+	if (successor == 0) {
+	    // only async-signal-safe calls from here on, we have been forked by a threaded process
+	    ::close(pipe_fds[0]);
+	    ::dup2(pipe_fds[1], READY_FD);
+	    ::close(pipe_fds[1]);
+	    ::fcntl(passed_fd, F_SETFD, 0);
+	    ::fcntl(state_fd, F_SETFD, 0);
+
+	    ::execvp(exec_arguments[0], &exec_arguments[0]);
+	    ::_exit(127);
+	}
+
+	::close(pipe_fds[1]);
+	::close(state_fd);
+	if (passed_fd != listen_fd) {
+	    ::close(passed_fd);
+	}
+	if (successor == -1) {
+	    ::close(pipe_fds[0]);
+	    throw Glib::ustring(N_("Could not fork successor: ")) + std::strerror(errno);
+	}
+
+	ready_pipe = pipe_fds[0];
+	return successor;
+    }
+
+    bool handover::wait_for_successor(pid_t successor, int timeout_ms) {
+	struct pollfd ready;
+	std::memset(&ready, 0, sizeof(ready));
+	ready.fd = ready_pipe;
+	ready.events = POLLIN;
+
+	// the successor writes a byte when ready, if it fails we just see the pipe closing
+	char message = 0;
+	int ret = 0;
+	do {
+	    ret = ::poll(&ready, 1, timeout_ms);
+	} while (ret < 0 && errno == EINTR);
+	if (ret > 0 && ::read(ready_pipe, &message, 1) != 1) {
+	    message = 0;
+	}
+	::close(ready_pipe);
+	ready_pipe = -1;
+
+	if (message == READY_MESSAGE) {
+	    return true;
+	}
+
+	// the successor did not make it, do not leave a zombie or a half started instance
+	::kill(successor, SIGTERM);
+	::waitpid(successor, NULL, 0);
+	return false;
+    }
+
+    void handover::restore_state(int state_fd) {
+	std::string state;
+	char buffer[1024];
+	ssize_t bytes_read = 0;
+	while ((bytes_read = ::read(state_fd, buffer, sizeof(buffer))) > 0) {
+	    state.append(buffer, bytes_read);
+	}
+	::close(state_fd);
+
+	statistics::restore(state);
+    }
+
+    void handover::signal_ready() {
+	char message = READY_MESSAGE;
+	if (::write(READY_FD, &message, 1) != 1) {
+	    ::syslog(LOG_ERR, "Cannot tell the predecessor that we are ready: %s", std::strerror(errno));
+	}
+    }
+}
@@ -0,0 +1,81 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef HANDOVER_H
+#define HANDOVER_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <sys/types.h>
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * handing over the service to a new instance of couriergrey without downtime
+     *
+     * The running instance starts the (possibly upgraded) binary again, passing it
+     * the listening socket and a file with its state. Once the new instance is ready
+     * to accept connections, the old instance stops accepting, finishes the requests
+     * in flight and exits.
+     */
+    class handover {
+	public:
+	    /**
+	     * start a successor instance
+	     *
+	     * @param argc number of arguments the running instance has been started with
+	     * @param argv arguments the running instance has been started with
+	     * @param listen_fd the listening socket to pass on
+	     * @return the process id of the successor
+	     * @throws Glib::ustring if the successor could not be started
+	     */
+	    static pid_t start_successor(int argc, char const** argv, int listen_fd);
+
+	    /**
+	     * wait until the successor is ready to accept connections
+	     *
+	     * @param successor process id returned by start_successor()
+	     * @param timeout_ms how long to wait at most
+	     * @return true if the successor is ready, false if it failed to start up
+	     */
+	    static bool wait_for_successor(pid_t successor, int timeout_ms);
+
+	    /**
+	     * take over the state of the predecessor
+	     *
+	     * @param state_fd the file descriptor the state has been passed on
+	     */
+	    static void restore_state(int state_fd);
+
+	    /**
+	     * tell the predecessor that we are ready to accept connections
+	     */
+	    static void signal_ready();
+    };
+}
+
+#endif // HANDOVER_H
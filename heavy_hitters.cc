@@ -0,0 +1,81 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "heavy_hitters.h"
+
+namespace couriergrey {
+    heavy_hitters::heavy_hitters(std::size_t capacity) : capacity(capacity) {
+    }
+
+    void heavy_hitters::offer(std::string const& name, long count, long error) {
+	std::map<std::string, std::pair<long, long> >::iterator counter = counters.find(name);
+
+	// already counted
+	if (counter != counters.end()) {
+	    by_count.erase(std::make_pair(counter->second.first, name));
+	    counter->second.first += count;
+	    counter->second.second += error;
+	    by_count.insert(std::make_pair(counter->second.first, name));
+	    return;
+	}
+
+	// replace the least frequent item if there is no free place
+	if (counters.size() >= capacity) {
+	    if (capacity == 0) {
+		return;
+	    }
+
+	    std::pair<long, std::string> const least = *by_count.begin();
+	    by_count.erase(by_count.begin());
+	    counters.erase(least.second);
+	    count += least.first;
+	    error += least.first;
+	}
+
+	counters[name] = std::make_pair(count, error);
+	by_count.insert(std::make_pair(count, name));
+    }
+
+    void heavy_hitters::merge(heavy_hitters const& other) {
+	for (std::map<std::string, std::pair<long, long> >::const_iterator p = other.counters.begin(); p != other.counters.end(); ++p) {
+	    offer(p->first, p->second.first, p->second.second);
+	}
+    }
+
+    std::list<heavy_hitters::item> heavy_hitters::top(std::size_t n) const {
+	std::list<item> result;
+
+	for (std::set<std::pair<long, std::string> >::const_reverse_iterator p = by_count.rbegin(); p != by_count.rend() && result.size() < n; ++p) {
+	    item counted;
+	    counted.name = p->second;
+	    counted.count = p->first;
+	    counted.error = counters.find(p->second)->second.second;
+	    result.push_back(counted);
+	}
+
+	return result;
+    }
+}
@@ -0,0 +1,104 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef HEAVY_HITTERS_H
+#define HEAVY_HITTERS_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <string>
+#include <map>
+#include <set>
+#include <list>
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * finding the most frequent items of a stream in bounded memory (space-saving algorithm)
+     *
+     * At most capacity items are counted. An item seen when all places are taken
+     * replaces the item with the lowest count and inherits that count as its error,
+     * so counts are upper bounds and exact for items that have never been evicted.
+     */
+    class heavy_hitters {
+	public:
+	    /**
+	     * a counted item as returned by top()
+	     */
+	    struct item {
+		std::string name;
+		long count;	/**< upper bound of the number of occurrences */
+		long error;	/**< how much count may be too high */
+	    };
+
+	    /**
+	     * create an empty sketch
+	     *
+	     * @param capacity number of items counted at most
+	     */
+	    heavy_hitters(std::size_t capacity);
+
+	    /**
+	     * count an item
+	     *
+	     * @param name the item
+	     * @param count how often it has been seen
+	     * @param error how much count may be too high already
+	     */
+	    void offer(std::string const& name, long count = 1, long error = 0);
+
+	    /**
+	     * add the counts of another sketch
+	     */
+	    void merge(heavy_hitters const& other);
+
+	    /**
+	     * get the most frequent items
+	     *
+	     * @param n number of items to return at most
+	     * @return the items, most frequent first
+	     */
+	    std::list<item> top(std::size_t n) const;
+	private:
+	    /**
+	     * number of items counted at most
+	     */
+	    std::size_t capacity;
+
+	    /**
+	     * count and error of the counted items
+	     */
+	    std::map<std::string, std::pair<long, long> > counters;
+
+	    /**
+	     * the counted items ordered by their count
+	     */
+	    std::set<std::pair<long, std::string> > by_count;
+    };
+}
+
+#endif // HEAVY_HITTERS_H
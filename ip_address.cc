@@ -0,0 +1,123 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "ip_address.h"
+#include <cstring>
+#include <cstdlib>
+#include <stdexcept>
+#include <arpa/inet.h>
+
+namespace couriergrey {
+    ip_address::ip_address(std::string const& address) {
+	parse(address.c_str());
+    }
+
+    ip_address::ip_address(char const* address) {
+	parse(address);
+    }
+
+    void ip_address::parse(char const* address) {
+	// IPv4 addresses get mapped to IPv6 addresses
+	if (std::strchr(address, ':') == NULL) {
+	    std::memset(&this->address, 0, sizeof(this->address));
+	    this->address.s6_addr[10] = 0xff;
+	    this->address.s6_addr[11] = 0xff;
+	    if (::inet_pton(AF_INET, address, &this->address.s6_addr[12]) <= 0) {
+		throw std::invalid_argument("not a valid IPv4 or IPv6 address");
+	    }
+	    return;
+	}
+
+	if (::inet_pton(AF_INET6, address, &this->address) <= 0) {
+	    throw std::invalid_argument("not a valid IPv4 or IPv6 address");
+	}
+    }
+
+    bool ip_address::is_ipv4() const {
+	return IN6_IS_ADDR_V4MAPPED(&address);
+    }
+
+    ip_address ip_address::masked(int prefix) const {
+	if (prefix < 0)
+	    prefix = 0;
+	if (prefix > bits())
+	    prefix = bits();
+
+	// convert to a prefix of the IPv6 address
+	int netsize = prefix + 128 - bits();
+
+	ip_address result(*this);
+	for (int i = 0; i < 16; i++) {
+	    int remaining = netsize - 8*i;
+	    if (remaining >= 8)
+		continue;
+	    result.address.s6_addr[i] &= remaining <= 0 ? 0x00 : 0xff << (8 - remaining);
+	}
+
+	return result;
+    }
+
+    bool ip_address::is_in_net(ip_address const& network, int prefix) const {
+	if (is_ipv4() != network.is_ipv4())
+	    return false;
+
+	ip_address const masked_address = masked(prefix);
+	ip_address const masked_network = network.masked(prefix);
+
+	return std::memcmp(&masked_address.address, &masked_network.address, sizeof(address)) == 0;
+    }
+
+    std::string ip_address::str() const {
+	char result[INET6_ADDRSTRLEN];
+	format(result, sizeof(result));
+	return result;
+    }
+
+    void ip_address::format(char* buffer, std::size_t size) const {
+	if (is_ipv4()) {
+	    ::inet_ntop(AF_INET, &address.s6_addr[12], buffer, size);
+	} else {
+	    ::inet_ntop(AF_INET6, &address, buffer, size);
+	}
+    }
+
+    ip_address ip_address::parse_network(std::string const& network, int& prefix) {
+	std::string::size_type slash_pos = network.find('/');
+	ip_address result(network.substr(0, slash_pos));
+
+	prefix = result.bits();
+	if (slash_pos != std::string::npos) {
+	    char* end = NULL;
+	    long parsed_prefix = std::strtol(network.c_str() + slash_pos + 1, &end, 10);
+	    if (end == network.c_str() + slash_pos + 1 || *end != '\0' || parsed_prefix < 0 || parsed_prefix > result.bits()) {
+		throw std::invalid_argument("not a valid prefix length");
+	    }
+	    prefix = parsed_prefix;
+	}
+
+	return result;
+    }
+}
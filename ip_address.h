@@ -0,0 +1,123 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef IP_ADDRESS_H
+#define IP_ADDRESS_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <string>
+#include <cstddef>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * an IPv4 or IPv6 address
+     *
+     * IPv4 addresses are kept as mapped IPv6 addresses internally, but prefix lengths
+     * are always given relative to the address family (0 ... 32 for IPv4 addresses).
+     */
+    class ip_address {
+	public:
+	    /**
+	     * parse a textual address
+	     *
+	     * @throws std::invalid_argument if address is not valid
+	     */
+	    ip_address(std::string const& address);
+
+	    /**
+	     * parse a textual address
+	     *
+	     * @throws std::invalid_argument if address is not valid
+	     */
+	    ip_address(char const* address);
+
+	    /**
+	     * check if this is an IPv4 address
+	     */
+	    bool is_ipv4() const;
+
+	    /**
+	     * get the number of bits in an address of this family (32 or 128)
+	     */
+	    int bits() const { return is_ipv4() ? 32 : 128; }
+
+	    /**
+	     * get the network address for a prefix length
+	     *
+	     * @param prefix the prefix length, limited to the range of the address family
+	     */
+	    ip_address masked(int prefix) const;
+
+	    /**
+	     * check if the address is part of a network
+	     *
+	     * @param network the network address
+	     * @param prefix the prefix length of the network
+	     */
+	    bool is_in_net(ip_address const& network, int prefix) const;
+
+	    /**
+	     * get the textual representation of the address
+	     */
+	    std::string str() const;
+
+	    /**
+	     * write the textual representation of the address to a buffer
+	     *
+	     * @param buffer where to write the address to, should be at least INET6_ADDRSTRLEN bytes
+	     * @param size size of buffer
+	     */
+	    void format(char* buffer, std::size_t size) const;
+
+	    /**
+	     * parse a network in the form address/prefix, or a single address
+	     *
+	     * @param network the textual network
+	     * @param prefix where to store the prefix length, the full length of the address if no prefix is given
+	     * @throws std::invalid_argument if network is not valid
+	     */
+	    static ip_address parse_network(std::string const& network, int& prefix);
+	private:
+	    /**
+	     * the address
+	     */
+	    struct ::in6_addr address;
+
+	    /**
+	     * parse a textual address
+	     *
+	     * @throws std::invalid_argument if address is not valid
+	     */
+	    void parse(char const* address);
+    };
+}
+
+#endif // IP_ADDRESS_H
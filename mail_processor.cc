@@ -26,39 +26,48 @@
 
 #include "mail_processor.h"
 #include <cstring>
-#include <sstream>
-#include <fstream>
 
-namespace couriergrey {
-    void mail_processor::read_mail(const std::string& filename) {
-	std::ifstream mail(filename.c_str());
+/**
+ * maximum length of an unfolded header we check, longer headers get truncated
+ */
+#define MAX_HEADER_LENGTH 4096
 
-	std::string header_value;
+namespace couriergrey {
+    void mail_processor::parse_mail(char const* content, std::size_t length) {
+	char const* const end = content + length;
+	char const* line = content;
+	char header_value[MAX_HEADER_LENGTH+1];
 	bool first_received_header = true;
-	while (std::getline(mail, header_value)) {
+	while (line < end) {
 	    // check for end of header
-	    if (header_value.length() == 0) {
+	    if (*line == '\n') {
 		// empty line is end of header
 		break;
 	    }
 
-	    // check if the header is continued in the next line
-	    while (mail) {
-		int peeked_character = mail.peek();
+	    // unfold the header: take this line and all lines continuing it
+	    std::size_t header_length = 0;
+	    do {
+		char const* line_end = static_cast<char const*>(std::memchr(line, '\n', end - line));
+		if (!line_end) {
+		    line_end = end;
+		}
 
-		if (peeked_character != ' ' and peeked_character != '\t') {
-		    break;
+		std::size_t line_length = line_end - line;
+		if (line_length > MAX_HEADER_LENGTH - header_length) {
+		    line_length = MAX_HEADER_LENGTH - header_length;
 		}
+		std::memcpy(header_value + header_length, line, line_length);
+		header_length += line_length;
 
-		std::string continuing_line;
-		std::getline(mail, continuing_line);
-		header_value += continuing_line;
-	    }
+		line = line_end < end ? line_end + 1 : end;
+	    } while (line < end && (*line == ' ' || *line == '\t'));
+	    header_value[header_length] = '\0';
 
 	    // check if we got the first received header
-	    if (first_received_header && header_value.substr(0, 9) == "Received:") {
+	    if (first_received_header && std::strncmp(header_value, "Received:", 9) == 0) {
 		// has the message been received authenticated?
-		if (header_value.find("(AUTH: ") != std::string::npos) {
+		if (std::strstr(header_value, "(AUTH: ") != NULL) {
 		    authed = true;
 		}
 
@@ -70,25 +79,27 @@ namespace couriergrey {
 	    // Note: normally we would have to do case-insensitve matching, but as the header is always
 	    //       created by Courier we can just check for the casing that Courier uses.
 	    //       Case-sensitve matching is faster ...
-	    if (header_value.substr(0, 13) == "Received-SPF:" && header_value.find("SPF=MAILFROM;") != std::string::npos) {
+	    if (std::strncmp(header_value, "Received-SPF:", 13) == 0 && std::strstr(header_value, "SPF=MAILFROM;") != NULL) {
 		// okay ... we have to extract the SPF state
-		std::istringstream header_stream(header_value.substr(13));
-		std::string spf_state_string;
-		header_stream >> spf_state_string;
+		char* spf_state_string = header_value + 13;
+		while (*spf_state_string == ' ' || *spf_state_string == '\t') {
+		    spf_state_string++;
+		}
+		spf_state_string[std::strcspn(spf_state_string, " \t")] = '\0';
 
-		if (spf_state_string == "pass") {
+		if (std::strcmp(spf_state_string, "pass") == 0) {
 		    spf_envelope_sender_state = pass;
-		} else if (spf_state_string == "fail") {
+		} else if (std::strcmp(spf_state_string, "fail") == 0) {
 		    spf_envelope_sender_state = fail;
-		} else if (spf_state_string == "softfail") {
+		} else if (std::strcmp(spf_state_string, "softfail") == 0) {
 		    spf_envelope_sender_state = softfail;
-		} else if (spf_state_string == "neutral") {
+		} else if (std::strcmp(spf_state_string, "neutral") == 0) {
 		    spf_envelope_sender_state = neutral;
-		} else if (spf_state_string == "none") {
+		} else if (std::strcmp(spf_state_string, "none") == 0) {
 		    spf_envelope_sender_state = none;
-		} else if (spf_state_string == "temperror") {	// seems not to be created by courier
+		} else if (std::strcmp(spf_state_string, "temperror") == 0) {	// seems not to be created by courier
 		    spf_envelope_sender_state = temperror;
-		} else if (spf_state_string == "permerror") {	// seems not to be created by courier
+		} else if (std::strcmp(spf_state_string, "permerror") == 0) {	// seems not to be created by courier
 		    spf_envelope_sender_state = permerror;
 		}
 	    }
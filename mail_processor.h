@@ -28,6 +28,7 @@
 #endif
 
 #include <string>
+#include <cstddef>
 
 #ifndef N_
 #   define N_(n) (n)
@@ -60,9 +61,19 @@ namespace couriergrey {
 	    };
 
 	    /**
-	     * read a mail from a file
+	     * parse a mail (or the beginning of it, containing the header) that has already been read
 	     */
-	    void read_mail(const std::string& filename);
+	    void parse_mail(const std::string& content) { parse_mail(content.data(), content.length()); }
+
+	    /**
+	     * parse a mail (or the beginning of it, containing the header) that has already been read
+	     *
+	     * This does not allocate any memory.
+	     *
+	     * @param content the content of the mail
+	     * @param length the length of content
+	     */
+	    void parse_mail(char const* content, std::size_t length);
 
 	    /**
 	     * get the SPF state for the envelope sender
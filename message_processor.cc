@@ -26,199 +26,483 @@
 
 #include "message_processor.h"
 #include "timestore.h"
+#include "commit_queue.h"
+#include "store_client.h"
+#include "triplet_cache.h"
+#include "retry_limiter.h"
 #include "mail_processor.h"
+#include "file_reader.h"
+#include "ip_address.h"
+#include "decision_log.h"
+#include "request_arena.h"
+#include "allocation_counter.h"
+#include "statistics.h"
+#include "probes.h"
 #include <iostream>
 #include <cstring>
+#include <cstdlib>
+#include <cerrno>
 #include <unistd.h>
 #include <cstdio>
 #include <glibmm.h>
 #include <sstream>
 #include <fstream>
 #include <list>
+#include <vector>
 #include <ctime>
-#include <syslog.h>
 #include <stdexcept>
+#include <arpa/inet.h>
+#include <poll.h>
+
+/**
+ * number of bytes we read from the beginning of a message file
+ *
+ * Courier puts the headers we are interested in on top of the message, so we do not have to read
+ * huge headers completely.
+ */
+#define MAIL_HEADER_PREFIX_SIZE 65536
+
+/**
+ * the time of the last delivery attempt is only used to expire entries after days, so it is
+ * not written again if the cached value is less old than this, in seconds
+ */
+#define LAST_CONNECT_PRECISION 3600
 
 namespace couriergrey {
-    message_processor::message_processor(int fd, whitelist const& used_whitelist) : fd(fd), used_whitelist(used_whitelist) {}
+    /**
+     * fetch the entries of a request and store them again with the time of this delivery attempt
+     */
+    static void touch_entries(entry_store& store, entry_store::key const* keys, std::size_t count, timestore::entry* entries, std::time_t now, char const* client_network) {
+	// check when there have been the first delivery attempts for this mail
+	store.fetch_entries(keys, count, entries);
+
+	// update the content (first attempt + last access for cleanup) in the database
+	for (timestore::entry* entry = entries; entry != entries + count; ++entry) {
+	    entry->last_connect = now;
+	    entry->client_network = client_network;
+	}
+	store.store_entries(keys, count, entries);
+    }
+
+    message_processor::message_processor(int fd, whitelist const& used_whitelist, recipient_whitelist const& used_rcpt_whitelist, runtime_whitelist const& used_runtime_whitelist, settings const& config, admission_control& admission) : fd(fd), used_whitelist(used_whitelist), used_rcpt_whitelist(used_rcpt_whitelist), used_runtime_whitelist(used_runtime_whitelist), config(config), admission(admission), trace(fd) {
+	::clock_gettime(CLOCK_MONOTONIC, &accepted_at);
+    }
+
+    long message_processor::remaining_ms() const {
+	if (config.deadline_ms <= 0) {
+	    return -1;
+	}
+
+	struct ::timespec now;
+	::clock_gettime(CLOCK_MONOTONIC, &now);
+	long elapsed_ms = (now.tv_sec - accepted_at.tv_sec) * 1000L + (now.tv_nsec - accepted_at.tv_nsec) / 1000000L;
+	return elapsed_ms < config.deadline_ms ? config.deadline_ms - elapsed_ms : 0;
+    }
+
+    char const* message_processor::missed_deadline(char* response, std::size_t size) const {
+	statistics::increment(statistics::deadline_misses);
+
+	if (config.deadline_fail_open) {
+	    std::snprintf(response, size, "200 Accepting this mail, " PACKAGE " could not decide in time.");
+	    return "deadline_accepted";
+	}
+
+	std::snprintf(response, size, "451 " PACKAGE " could not decide in time. Please try again later.");
+	return "deadline_tempfailed";
+    }
 
     void message_processor::do_process() {
-	std::string data_from_socket;
+	admission.started();
+
+	// all transient data of this request is allocated in the arena of this thread
+	request_arena& arena = request_arena::for_this_thread();
+	arena.reset();
+	arena_allocator<char> allocator(arena);
+#ifdef COUNT_ALLOCATIONS
+	long allocations_before = allocation_counter::thread_allocations();
+#endif
+
+	arena_string data_from_socket(allocator);
+
+	// read the filenames from the socket, but do not wait beyond the deadline
+	while (data_from_socket.find("\n\n") == arena_string::npos) {
+	    struct pollfd socket_readable;
+	    std::memset(&socket_readable, 0, sizeof(socket_readable));
+	    socket_readable.fd = fd;
+	    socket_readable.events = POLLIN;
+	    if (::poll(&socket_readable, 1, remaining_ms()) == 0) {
+		break;
+	    }
 
-	// read the filenames from the socket
-	while (data_from_socket.find("\n\n") == std::string::npos) {
 	    char buffer[1024];
 	    ssize_t bytes_read = ::read(fd, buffer, sizeof(buffer));
 	    if (bytes_read <= 0) {
 		break;
 	    }
 
-	    data_from_socket += std::string(buffer, bytes_read);
+	    data_from_socket.append(buffer, bytes_read);
 	}
+	trace.mark(request_trace::socket_read);
+	COURIERGREY_PROBE2(request_framed, fd, data_from_socket.length());
+
+	// collect the control files, the message file is only read if its header is needed
+	arena_string message_file(allocator);
+	file_reader reader(arena);
+	for (arena_string::size_type line_start = 0; line_start < data_from_socket.length(); ) {
+	    arena_string::size_type line_end = data_from_socket.find('\n', line_start);
+	    if (line_end == arena_string::npos) {
+		line_end = data_from_socket.length();
+	    }
+	    arena_string one_file(data_from_socket, line_start, line_end - line_start, allocator);
+	    bool first_line = line_start == 0;
+	    line_start = line_end + 1;
 
-	// process the message
-	std::istringstream files(data_from_socket);
-	int filenum = 0;
-	std::string one_file;
-	bool authenticated_sender = false;
-	std::string sender_address;
-	std::string sending_mta;
-	std::list<std::string> recipients;
-	mail_processor mail;
-	while (std::getline(files, one_file)) {
 	    // the first line is the filename of the message file
-	    if (!filenum++) {
-		mail.read_mail(one_file);
-		if (mail.is_authed()) {
-		    authenticated_sender = true;
-		}
+	    if (first_line) {
+		message_file = one_file;
 		continue;
 	    }
 
 	    // skip the empty line at the end
-	    if (one_file == "") {
+	    if (one_file.empty()) {
 		continue;
 	    }
 
-	    // if we reach here it's a control file, open it ...
-	    std::ifstream infile(one_file.c_str());
+	    reader.add(one_file);
+	}
+
+	// we should no have all data we need to check this message
+	char response[512];
+	std::strcpy(response, "451 Default Response");
+	char const* decision = NULL;
+	long wait_seconds = 0;
+
+	// no time left to even read the control files?
+	if (deadline_exceeded()) {
+	    decision = missed_deadline(response, sizeof(response));
+	}
+
+	// read all the control files in one go
+	if (decision == NULL) {
+	    reader.read_all();
+	}
+	trace.mark(request_trace::files_read);
+
+	// stage 1: parse the control files
+	bool authenticated_sender = false;
+	arena_string sender_address(allocator);
+	arena_string sending_mta(allocator);
+	arena_string_list recipients(allocator);
+	for (file_reader::size_type filenum = 0; decision == NULL && filenum < reader.size(); filenum++) {
+	    arena_string const& content = reader.content(filenum);
 
 	    // read the control file line by line
-	    std::string one_line;
-	    while (std::getline(infile, one_line)) {
-		std::string linetype = one_line.substr(0, 1);
+	    for (arena_string::size_type line_start = 0; line_start < content.length(); ) {
+		arena_string::size_type line_end = content.find('\n', line_start);
+		if (line_end == arena_string::npos) {
+		    line_end = content.length();
+		}
+		char linetype = content[line_start];
+		arena_string::size_type value_start = line_start + 1;
+		arena_string::size_type value_length = line_end > value_start ? line_end - value_start : 0;
+		line_start = line_end + 1;
 
 		// is this line indicating that the sender has had an authenticated connection?
-		if (linetype == "i") {
+		if (linetype == 'i') {
 		    authenticated_sender = true;
 		    continue;
 		}
 
 		// is this line indicating the sender (envelope) address?
-		if (linetype == "s") {
-		    sender_address = one_line.substr(1);
+		if (linetype == 's') {
+		    sender_address.assign(content, value_start, value_length);
 		    continue;
 		}
 
 		// is this line the MTA the message has been received from?
-		if (linetype == "f") {
-		    sending_mta = one_line.substr(1);
+		if (linetype == 'f') {
+		    sending_mta.assign(content, value_start, value_length);
 		    continue;
 		}
 
 		// is this line indicating a recipient of the message?
-		if (linetype == "r") {
-		    recipients.push_back(one_line.substr(1));
+		if (linetype == 'r') {
+		    recipients.push_back(arena_string(content, value_start, value_length, allocator));
 		    continue;
 		}
 	    }
+	}
+
+	trace.mark(request_trace::control_parsed);
+
+	// stage 2: accept authenticated mails always
+	if (authenticated_sender) {
+	    std::strcpy(response, "200 Accepting authenticated mail");
+	    decision = "authenticated";
+	    statistics::increment(statistics::shortcut_authenticated);
+	}
+
+	// stage 3: is the sending MTA whitelisted?
+	if (decision == NULL && !sending_mta.empty()) {
+	    try {
+		arena_string address(sending_mta);
+		arena_string::size_type pos = address.find('[');
+		if (pos != arena_string::npos)
+		    address.erase(0, pos+1);
+		pos = address.find(']');
+		if (pos != arena_string::npos)
+		    address.erase(pos, arena_string::npos);
+		bool client_whitelisted = used_whitelist.is_whitelisted(address.c_str()) || used_runtime_whitelist.is_whitelisted(address.c_str());
+		COURIERGREY_PROBE2(whitelist_lookup, fd, client_whitelisted ? 1 : 0);
+		if (client_whitelisted) {
+		    std::strcpy(response, "200 Whitelisted sender");
+		    decision = "whitelisted_client";
+		    statistics::increment(statistics::shortcut_whitelisted_client);
+		}
+	    } catch (std::invalid_argument const&) {
+		decision_log::notice("Cannot parse sending MTA's address: %s", sending_mta.c_str());
+	    }
+	}
 
-	    // we're done with this control file, close it ...
-	    infile.close();
+	// stage 4: are all recipients whitelisted?
+	if (decision == NULL && !sending_mta.empty() && !recipients.empty()) {
+	    bool recipients_whitelisted = true;
+	    for (arena_string_list::const_iterator p = recipients.begin(); recipients_whitelisted && p != recipients.end(); ++p) {
+		recipients_whitelisted = used_rcpt_whitelist.is_whitelisted(p->data(), p->length());
+	    }
+	    if (recipients_whitelisted) {
+		std::strcpy(response, "200 Whitelisted recipient");
+		decision = "whitelisted_recipient";
+		statistics::increment(statistics::shortcut_whitelisted_recipient);
+	    }
 	}
 
-	// is sender whitelisted?
-	bool whitelisted = false;
-        try {
-            std::string address = sending_mta;
-            std::string::size_type pos = address.find('[');
-            if (pos != std::string::npos)
-                address.erase(0, pos+1);
-            pos = address.find(']');
-            if (pos != std::string::npos)
-                address.erase(pos, std::string::npos);
-            whitelisted = used_whitelist.is_whitelisted(address);
-        } catch (std::invalid_argument) {
-            ::syslog(LOG_NOTICE, "Cannot parse sending MTA's address: %s", sending_mta.c_str());
-        }
+	trace.mark(request_trace::whitelist_checked);
 
-	// we should no have all data we need to check this message
-	std::string response = "451 Default Response";
+	// no time left for reading the message header or the database?
+	if (decision == NULL && deadline_exceeded()) {
+	    decision = missed_deadline(response, sizeof(response));
+	}
 
-	// check if we can accept the message or if we should delay it
-	if (authenticated_sender) {
-	    // accept authenticated mails always
-	    response = "200 Accepting authenticated mail";
-	} else if (mail.get_spf_envelope_sender_state() == mail_processor::pass) {
-	    // accept SPF authenticated senders
-	    response = "200 Accepting this mail by SPF";
-	} else if (sending_mta == "") {
+	// stage 5: read the header of the message file to check for SPF authenticated senders
+	if (decision == NULL && !message_file.empty()) {
+	    COURIERGREY_PROBE1(read_mail_start, fd);
+	    file_reader header_reader(arena);
+	    header_reader.add(message_file, MAIL_HEADER_PREFIX_SIZE);
+	    header_reader.read_all();
+	    COURIERGREY_PROBE2(read_mail_done, fd, header_reader.content(0).length());
+	    statistics::increment(statistics::message_headers_read);
+
+	    mail_processor mail;
+	    arena_string const& header = header_reader.content(0);
+	    mail.parse_mail(header.data(), header.length());
+	    if (mail.is_authed()) {
+		std::strcpy(response, "200 Accepting authenticated mail");
+		decision = "authenticated";
+		statistics::increment(statistics::shortcut_authenticated);
+	    } else if (mail.get_spf_envelope_sender_state() == mail_processor::pass) {
+		std::strcpy(response, "200 Accepting this mail by SPF");
+		decision = "spf";
+		statistics::increment(statistics::shortcut_spf);
+	    }
+	    trace.mark(request_trace::header_read);
+	}
+
+	// stage 6: check that we have the data we need for greylisting
+	if (decision == NULL && sending_mta.empty()) {
 	    // this should not be possible, if it happens courier's interface might have changed
-	    response = "435 " PACKAGE " could not get the sending MTA's address.";
-	} else if (whitelisted) {
-	    // the sender has been whitelisted
-	    response = "200 Whitelisted sender";
-	} else if (recipients.size() < 1) {
+	    std::strcpy(response, "435 " PACKAGE " could not get the sending MTA's address.");
+	    decision = "no_client";
+	} else if (decision == NULL && recipients.size() < 1) {
 	    // this should not be possible, if it happens courier's interface might have changed
-	    response = "435 " PACKAGE " could not get the envelope recipient.";
-	} else {
-	    // do our actual magic of greylisting
-	    
+	    std::strcpy(response, "435 " PACKAGE " could not get the envelope recipient.");
+	    decision = "no_recipient";
+	}
+
+	// no time left for the database?
+	if (decision == NULL && deadline_exceeded()) {
+	    decision = missed_deadline(response, sizeof(response));
+	}
+
+	// stage 7: do our actual magic of greylisting
+	if (decision == NULL) {
 	    // extract the IP address from the sending_mta
-	    std::string::size_type pos = sending_mta.rfind("(");
-	    if (pos != std::string::npos) {
+	    arena_string::size_type pos = sending_mta.rfind("(");
+	    if (pos != arena_string::npos) {
 		sending_mta.erase(0, pos+1);
 	    }
 	    pos = sending_mta.find(")");
-	    if (pos != std::string::npos) {
+	    if (pos != arena_string::npos) {
 		sending_mta.erase(pos);
 	    }
 	    pos = sending_mta.rfind("[");
-	    if (pos != std::string::npos) {
+	    if (pos != arena_string::npos) {
 		sending_mta.erase(0, pos+1);
 	    }
 	    pos = sending_mta.find("]");
-	    if (pos != std::string::npos) {
+	    if (pos != arena_string::npos) {
 		sending_mta.erase(pos);
 	    }
-	    if (sending_mta.substr(0, 7) == "::ffff:") {
+	    if (sending_mta.compare(0, 7, "::ffff:") == 0) {
 		sending_mta.erase(0, 7);
 	    }
 
-	    // calculate identifier for this connection
-	    std::ostringstream mail_identifier;
-	    mail_identifier << sender_address << "/" << sending_mta;
-	    std::list<std::string>::const_iterator p;
-	    for (p=recipients.begin(); p!=recipients.end(); ++p) {
-		mail_identifier << "/" << *p;
+	    // aggregate the address to its network if configured
+	    char client_network[INET6_ADDRSTRLEN+4] = "";
+	    try {
+		ip_address client_address(sending_mta.c_str());
+		int prefix = client_address.is_ipv4() ? config.ipv4_prefix : config.ipv6_prefix;
+		if (prefix < 0 || prefix > client_address.bits()) {
+		    prefix = client_address.bits();
+		}
+
+		char network_address[INET6_ADDRSTRLEN];
+		client_address.masked(prefix).format(network_address, sizeof(network_address));
+		std::snprintf(client_network, sizeof(client_network), "%s/%d", network_address, prefix);
+
+		// keys for single addresses do not contain the prefix length
+		if (prefix < client_address.bits()) {
+		    sending_mta = client_network;
+		}
+	    } catch (std::invalid_argument const&) {
+		// no address we could parse, use it as it is
+	    }
+
+	    // normalize the sender, so that rewritten addresses of the same sender use the same key
+	    arena_string key_sender(sender_address);
+	    if (!key_sender.empty()) {
+		key_sender.resize(config.sender_normalization.normalize(&key_sender[0], key_sender.length()));
 	    }
 
-	    // open the database
-	    try {
-		timestore db;
+	    // calculate the identifiers for this connection, one for all recipients or one for each of them
+	    arena_string mail_identifier(allocator);
+	    mail_identifier.append(key_sender).append("/").append(sending_mta);
+	    arena_string_list key_strings(allocator);
+	    arena_string_list::const_iterator p;
+	    if (config.per_recipient) {
+		for (p=recipients.begin(); p!=recipients.end(); ++p) {
+		    key_strings.push_back(mail_identifier);
+		    key_strings.back().append("/").append(*p);
+		}
+	    } else {
+		for (p=recipients.begin(); p!=recipients.end(); ++p) {
+		    mail_identifier.append("/").append(*p);
+		}
+		key_strings.push_back(mail_identifier);
+	    }
+
+	    // the stores get the keys as references into the arena
+	    std::vector<entry_store::key, arena_allocator<entry_store::key> > keys(allocator);
+	    keys.reserve(key_strings.size());
+	    for (p=key_strings.begin(); p!=key_strings.end(); ++p) {
+		entry_store::key const ref = { p->data(), p->length() };
+		keys.push_back(ref);
+	    }
+
+	    // retrying too fast while still greylisted? answer from memory, without touching the database
+	    char const* const limited_client = client_network[0] ? client_network : sending_mta.c_str();
+	    long const limited_wait = retry_limiter::check(limited_client, &keys[0], keys.size(), std::time(NULL));
+	    if (limited_wait > 0) {
+		std::snprintf(response, sizeof(response), "451 You are greylisted, please try again in %ld s.", limited_wait);
+		decision = "retry_limited";
+		wait_seconds = limited_wait;
+		statistics::increment(statistics::retry_limited);
+	    } else {
+		// open the database
+		try {
+		    std::time_t now = std::time(NULL);
+		    std::vector<timestore::entry, arena_allocator<timestore::entry> > entries(keys.size(), timestore::entry(), allocator);
 
-		std::string mail_identifier_string = mail_identifier.str();
+		    // all recently written by any of the worker processes? no need to write them again yet,
+		    // unless this is the first connect that passes, which has to be recorded for the statistics and expiry
+		    bool all_cached = triplet_cache::is_enabled();
+		    for (std::size_t i = 0; all_cached && i < keys.size(); i++) {
+			all_cached = triplet_cache::lookup(keys[i].data, keys[i].length, entries[i]) && entries[i].client_network == client_network && now - entries[i].last_connect < LAST_CONNECT_PRECISION;
+			if (all_cached && entries[i].last_connect - entries[i].first_connect < 120 && now - entries[i].first_connect >= 120) {
+			    all_cached = false;
+			}
+		    }
 
-		// check when there has been the first delivery attempt for this mail
-		std::pair<std::time_t, std::time_t> value = db.fetch(mail_identifier_string);
-		std::time_t first_delivery = value.first;
+		    if (all_cached) {
+			statistics::increment(statistics::triplet_cache_hits);
+		    } else if (store_client::is_running()) {
+			// waiting for the store server must not take longer than the time left
+			store_client store(remaining_ms());
+			trace.mark(request_trace::database_opened);
+			touch_entries(store, &keys[0], keys.size(), &entries[0], now, client_network);
+		    } else if (commit_queue::is_running()) {
+			// read through the database kept open by the committer, and let it write
+			commit_queue queue(remaining_ms());
+			trace.mark(request_trace::database_opened);
+			touch_entries(queue, &keys[0], keys.size(), &entries[0], now, client_network);
+		    } else {
+			// opening the database must not take longer than the time left
+			timestore db(remaining_ms());
+			trace.mark(request_trace::database_opened);
+			touch_entries(db, &keys[0], keys.size(), &entries[0], now, client_network);
+		    }
+		    trace.mark(request_trace::database_done);
 
-		// update the content (first attempt + last access for cleanup) in the database
-		db.store(mail_identifier_string, first_delivery, std::time(NULL));
+		    // the mail is accepted once the youngest of its identifiers is old enough
+		    std::time_t first_delivery = 0;
+		    for (std::vector<timestore::entry, arena_allocator<timestore::entry> >::const_iterator entry = entries.begin(); entry != entries.end(); ++entry) {
+			if (entry->first_connect > first_delivery) {
+			    first_delivery = entry->first_connect;
+			}
+		    }
 
-		// check if the first attempt for this mail is old enought so that we can accept the mail
-		std::time_t seconds_to_wait = (first_delivery + 120) - std::time(NULL);
-		if (seconds_to_wait <= 0) {
-		    response = "200 Thank you, we accept this e-mail.";
-		} else {
-		    std::ostringstream response_stream;
-		    response_stream << "451 You are greylisted, please try again in " << seconds_to_wait << " s.";
-		    response = response_stream.str();
+		    // check if the first attempt for this mail is old enought so that we can accept the mail
+		    std::time_t seconds_to_wait = (first_delivery + 120) - std::time(NULL);
+		    if (seconds_to_wait <= 0) {
+			std::strcpy(response, "200 Thank you, we accept this e-mail.");
+			decision = "accepted";
+		    } else {
+			std::snprintf(response, sizeof(response), "451 You are greylisted, please try again in %ld s.", static_cast<long>(seconds_to_wait));
+			decision = "greylisted";
+			wait_seconds = seconds_to_wait;
+			retry_limiter::greylisted(limited_client, &keys[0], keys.size(), first_delivery + 120);
+		    }
+		} catch (Glib::ustring msg) {
+		    if (deadline_exceeded()) {
+			decision = missed_deadline(response, sizeof(response));
+		    } else {
+			std::snprintf(response, sizeof(response), "430 Greylisting DB could not be opened currently. Please try again later: %s", msg.c_str());
+			decision = "database_error";
+		    }
 		}
-	    } catch (Glib::ustring msg) {
-		response = "430 Greylisting DB could not be opened currently. Please try again later: ";
-		response += msg;
 	    }
 	}
 
-	// append a linefeed to the result
-	response += "\n";
+	// append a linefeed to the result (responses always leave room for it)
+	std::size_t response_length = std::strlen(response);
+	if (response_length > sizeof(response) - 2) {
+	    response_length = sizeof(response) - 2;
+	}
+	response[response_length++] = '\n';
+	response[response_length] = '\0';
 
 	// write the result
-	ssize_t written = ::write(fd, response.c_str(), response.length());
+	if (::write(fd, response, response_length) != static_cast<ssize_t>(response_length)) {
+	    decision_log::notice("Could not write the response: %s", std::strerror(errno));
+	}
+	trace.mark(request_trace::response_written);
+	int response_code = std::atoi(response);
+	trace.finish(response_code);
+
+	// log the decision
+	struct ::timespec now;
+	::clock_gettime(CLOCK_MONOTONIC, &now);
+	long latency_us = (now.tv_sec - accepted_at.tv_sec) * 1000000L + (now.tv_nsec - accepted_at.tv_nsec) / 1000;
+	COURIERGREY_PROBE3(response_written, fd, response_code, latency_us);
+	decision_log::decision(sender_address.c_str(), sending_mta.c_str(), recipients.size(), decision, response_code, wait_seconds, latency_us);
+
+#ifdef COUNT_ALLOCATIONS
+	statistics::add(statistics::request_allocations, allocation_counter::thread_allocations() - allocations_before);
+#endif
 
 	// close the socket
 	::close(fd);
+	admission.finished();
 
 	// free our instance again
 	delete this;
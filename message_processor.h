@@ -28,6 +28,13 @@
 #endif
 
 #include <whitelist.h>
+#include <recipient_whitelist.h>
+#include <runtime_whitelist.h>
+#include <settings.h>
+#include <request_trace.h>
+#include <admission_control.h>
+#include <ctime>
+#include <cstddef>
 
 #ifndef N_
 #   define N_(n) (n)
@@ -48,8 +55,13 @@ namespace couriergrey {
 	     * create a message_processor for an accepted domain socket
 	     *
 	     * @param fd the handle of the accepted domain socket
+	     * @param used_whitelist whitelist of sending MTAs
+	     * @param used_rcpt_whitelist whitelist of recipients
+	     * @param used_runtime_whitelist whitelist of sending MTAs managed using the admin socket
+	     * @param config runtime settings
+	     * @param admission admission control, that admitted this request
 	     */
-	    message_processor(int fd, whitelist const& used_whitelist);
+	    message_processor(int fd, whitelist const& used_whitelist, recipient_whitelist const& used_rcpt_whitelist, runtime_whitelist const& used_runtime_whitelist, settings const& config, admission_control& admission);
 
 	    /**
 	     * do the actual processing
@@ -67,6 +79,57 @@ namespace couriergrey {
 	     * whitelist to use
 	     */
 	    whitelist const& used_whitelist;
+
+	    /**
+	     * recipient whitelist to use
+	     */
+	    recipient_whitelist const& used_rcpt_whitelist;
+
+	    /**
+	     * whitelist managed using the admin socket
+	     */
+	    runtime_whitelist const& used_runtime_whitelist;
+
+	    /**
+	     * runtime settings
+	     */
+	    settings const& config;
+
+	    /**
+	     * admission control, that admitted this request
+	     */
+	    admission_control& admission;
+
+	    /**
+	     * trace of the processing stages of this request
+	     */
+	    request_trace trace;
+
+	    /**
+	     * when the connection has been accepted
+	     */
+	    struct ::timespec accepted_at;
+
+	    /**
+	     * get the time left until the deadline of this request
+	     *
+	     * @return remaining milliseconds, -1 if there is no deadline
+	     */
+	    long remaining_ms() const;
+
+	    /**
+	     * check if the deadline of this request has passed
+	     */
+	    bool deadline_exceeded() const { return config.deadline_ms > 0 && remaining_ms() == 0; }
+
+	    /**
+	     * set the response for a request that missed its deadline
+	     *
+	     * @param response buffer for the response
+	     * @param size size of the buffer
+	     * @return the decision branch
+	     */
+	    char const* missed_deadline(char* response, std::size_t size) const;
     };
 }
 
@@ -0,0 +1,187 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "prefork.h"
+#include "triplet_cache.h"
+#include <vector>
+#include <ctime>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <glibmm.h>
+
+/**
+ * the file descriptor courierfilter waits on until the filter is ready, only the master signals on it
+ */
+#define READY_FD 3
+
+/**
+ * a worker exiting faster after its start is restarted only after this delay, in seconds
+ */
+#define RESTART_DELAY 1
+
+namespace couriergrey {
+    /**
+     * process ids of the workers, 0 for a worker that is not running
+     */
+    static std::vector<pid_t> worker_pids;
+
+    /**
+     * when each of the workers has been started
+     */
+    static std::vector<std::time_t> worker_started;
+
+    /**
+     * if the calling process is a worker
+     */
+    static bool in_worker = false;
+
+    /**
+     * set when the workers are being stopped, exited workers are not restarted then
+     */
+    static bool workers_stopping = false;
+
+    /**
+     * fork a worker process
+     *
+     * @param index the number of the worker
+     * @return 0 in the worker, its process id in the master, -1 if the fork failed
+     */
+    static pid_t fork_worker(std::vector<pid_t>::size_type index) {
+	pid_t pid = ::fork();
+
+	if (pid == 0) {
+	    in_worker = true;
+	    worker_pids.clear();
+	    worker_started.clear();
+
+	    // the master signals when we are ready, and supervises the workers
+	    ::close(READY_FD);
+	    std::signal(SIGCHLD, SIG_DFL);
+	    return 0;
+	}
+
+	if (pid == -1) {
+	    ::syslog(LOG_ERR, "Cannot fork worker process: %m");
+	    worker_pids[index] = 0;
+	    return -1;
+	}
+
+	worker_pids[index] = pid;
+	worker_started[index] = std::time(NULL);
+	return pid;
+    }
+
+    bool prefork::start(int processes) {
+	worker_pids.assign(processes, 0);
+	worker_started.assign(processes, 0);
+
+	bool started = false;
+	for (int i = 0; i < processes; i++) {
+	    pid_t pid = fork_worker(i);
+	    if (pid == 0) {
+		return true;
+	    }
+	    if (pid > 0) {
+		started = true;
+	    }
+	}
+
+	if (!started) {
+	    throw Glib::ustring(N_("Could not start any worker process"));
+	}
+	return false;
+    }
+
+    bool prefork::restart_exited() {
+	for (std::vector<pid_t>::size_type i = 0; i < worker_pids.size(); i++) {
+	    int status = 0;
+	    if (worker_pids[i] != 0 && ::waitpid(worker_pids[i], &status, WNOHANG) != worker_pids[i]) {
+		continue;
+	    }
+
+	    // a worker that exited, or one that could not be forked last time
+	    if (worker_pids[i] != 0) {
+		if (WIFSIGNALED(status)) {
+		    ::syslog(LOG_ERR, "Worker process %d killed by signal %d", static_cast<int>(worker_pids[i]), WTERMSIG(status));
+		} else {
+		    ::syslog(LOG_NOTICE, "Worker process %d exited with status %d", static_cast<int>(worker_pids[i]), WEXITSTATUS(status));
+		}
+
+		// the slots it has been writing would be locked forever
+		triplet_cache::release(worker_pids[i]);
+		worker_pids[i] = 0;
+	    }
+
+	    if (workers_stopping) {
+		continue;
+	    }
+
+	    // do not restart a worker that keeps failing in a tight loop
+	    if (std::time(NULL) - worker_started[i] < RESTART_DELAY) {
+		::sleep(RESTART_DELAY);
+	    }
+
+	    if (fork_worker(i) == 0) {
+		return true;
+	    }
+	}
+
+	return false;
+    }
+
+    void prefork::signal_workers(int signum) {
+	for (std::vector<pid_t>::const_iterator p = worker_pids.begin(); p != worker_pids.end(); ++p) {
+	    if (*p != 0) {
+		::kill(*p, signum);
+	    }
+	}
+    }
+
+    void prefork::stop() {
+	workers_stopping = true;
+	signal_workers(SIGTERM);
+
+	for (std::vector<pid_t>::iterator p = worker_pids.begin(); p != worker_pids.end(); ++p) {
+	    if (*p == 0) {
+		continue;
+	    }
+
+	    int status = 0;
+	    while (::waitpid(*p, &status, 0) == -1 && errno == EINTR) {
+	    }
+	    triplet_cache::release(*p);
+	    *p = 0;
+	}
+    }
+
+    bool prefork::is_worker() {
+	return in_worker;
+    }
+}
@@ -0,0 +1,78 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef PREFORK_H
+#define PREFORK_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * running several worker processes accepting on the same socket
+     *
+     * The master process creates the socket and forks the workers, each of them
+     * accepting and processing requests as a single couriergrey process does. The
+     * master only supervises the workers: a worker that dies is restarted, without
+     * affecting the requests processed by the other workers.
+     */
+    class prefork {
+	public:
+	    /**
+	     * fork the worker processes
+	     *
+	     * @param processes number of worker processes
+	     * @return true in the worker processes, false in the master
+	     * @throws Glib::ustring if no worker could be started
+	     */
+	    static bool start(int processes);
+
+	    /**
+	     * restart the workers that have exited
+	     *
+	     * @return true in a restarted worker process, false in the master
+	     */
+	    static bool restart_exited();
+
+	    /**
+	     * send a signal to all workers
+	     */
+	    static void signal_workers(int signum);
+
+	    /**
+	     * terminate the workers and wait until they have finished their requests
+	     */
+	    static void stop();
+
+	    /**
+	     * check if the calling process is a worker process
+	     */
+	    static bool is_worker();
+    };
+}
+
+#endif // PREFORK_H
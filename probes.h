@@ -0,0 +1,49 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+/**
+ * static tracepoints for perf, bpftrace or systemtap
+ *
+ * If couriergrey has been configured with --enable-dtrace, the probes are
+ * compiled in as USDT probes of the provider "couriergrey". A probe is a
+ * single nop instruction as long as nobody is tracing it. Without
+ * --enable-dtrace the probes are removed completely.
+ */
+#ifdef ENABLE_DTRACE
+#   include <sys/sdt.h>
+#   define COURIERGREY_PROBE1(name, arg1) DTRACE_PROBE1(couriergrey, name, arg1)
+#   define COURIERGREY_PROBE2(name, arg1, arg2) DTRACE_PROBE2(couriergrey, name, arg1, arg2)
+#   define COURIERGREY_PROBE3(name, arg1, arg2, arg3) DTRACE_PROBE3(couriergrey, name, arg1, arg2, arg3)
+#else
+#   define COURIERGREY_PROBE1(name, arg1) do {} while (0)
+#   define COURIERGREY_PROBE2(name, arg1, arg2) do {} while (0)
+#   define COURIERGREY_PROBE3(name, arg1, arg2, arg3) do {} while (0)
+#endif
+
+#endif // PROBES_H
@@ -0,0 +1,167 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "recipient_whitelist.h"
+#include <fstream>
+#include <cstring>
+#include <syslog.h>
+
+namespace couriergrey {
+    /**
+     * lowercase an ASCII character (addresses are compared ASCII case insensitive)
+     */
+    static inline char to_lower(char c) {
+	return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+    }
+
+    recipient_whitelist::recipient_whitelist(std::string const& whitelistfile) : entry_count(0) {
+	parse_whitelist(whitelistfile);
+    }
+
+    ::uint32_t recipient_whitelist::hash(char const* data, std::size_t length) {
+	// FNV-1a
+	::uint32_t result = 2166136261u;
+	for (std::size_t i = 0; i < length; i++) {
+	    result ^= static_cast<unsigned char>(to_lower(data[i]));
+	    result *= 16777619u;
+	}
+	return result;
+    }
+
+    bool recipient_whitelist::contains(char const* data, std::size_t length) const {
+	if (entry_count == 0 || length == 0) {
+	    return false;
+	}
+
+	::uint32_t data_hash = hash(data, length);
+	std::size_t mask = slots.size() - 1;
+	for (std::size_t i = data_hash & mask; slots[i].length; i = (i + 1) & mask) {
+	    if (slots[i].hash != data_hash || slots[i].length != length) {
+		continue;
+	    }
+
+	    char const* entry = entry_data.data() + slots[i].offset;
+	    std::size_t pos = 0;
+	    while (pos < length && entry[pos] == to_lower(data[pos])) {
+		pos++;
+	    }
+	    if (pos == length) {
+		return true;
+	    }
+	}
+
+	return false;
+    }
+
+    bool recipient_whitelist::is_whitelisted(char const* address, std::size_t length) const {
+	// complete address whitelisted?
+	if (contains(address, length)) {
+	    return true;
+	}
+
+	// domain whitelisted?
+	std::size_t at_pos = length;
+	while (at_pos > 0 && address[at_pos-1] != '@') {
+	    at_pos--;
+	}
+	if (at_pos == 0) {
+	    return false;
+	}
+	return contains(address + at_pos - 1, length - at_pos + 1);
+    }
+
+    void recipient_whitelist::insert(std::string const& entry) {
+	if (contains(entry.data(), entry.length())) {
+	    return;
+	}
+
+	// keep the table at most half full
+	if ((entry_count + 1) * 2 > slots.size()) {
+	    std::vector<slot> old_slots;
+	    old_slots.swap(slots);
+
+	    slot empty_slot = { 0, 0, 0 };
+	    slots.resize(old_slots.empty() ? 64 : old_slots.size() * 2, empty_slot);
+
+	    std::size_t mask = slots.size() - 1;
+	    for (std::vector<slot>::const_iterator p = old_slots.begin(); p != old_slots.end(); ++p) {
+		if (!p->length) {
+		    continue;
+		}
+		std::size_t i = p->hash & mask;
+		while (slots[i].length) {
+		    i = (i + 1) & mask;
+		}
+		slots[i] = *p;
+	    }
+	}
+
+	slot new_slot;
+	new_slot.hash = hash(entry.data(), entry.length());
+	new_slot.offset = entry_data.length();
+	new_slot.length = entry.length();
+	entry_data += entry;
+
+	std::size_t mask = slots.size() - 1;
+	std::size_t i = new_slot.hash & mask;
+	while (slots[i].length) {
+	    i = (i + 1) & mask;
+	}
+	slots[i] = new_slot;
+	entry_count++;
+    }
+
+    void recipient_whitelist::parse_whitelist(std::string const& whitelistfile) {
+	std::ifstream wlfile(whitelistfile.c_str());
+
+	std::string line;
+	while (std::getline(wlfile, line)) {
+	    // remove comments
+	    std::string::size_type comment_start = line.find('#');
+	    if (comment_start != std::string::npos) {
+		line.erase(comment_start, std::string::npos);
+	    }
+
+	    // trim
+	    std::string::size_type first_nws = line.find_first_not_of(" \t\r");
+	    if (first_nws == std::string::npos)
+		continue;
+	    line.erase(0, first_nws);
+	    line.erase(line.find_last_not_of(" \t\r")+1, std::string::npos);
+
+	    // entries have to be addresses or domains
+	    if (line.find('@') == std::string::npos || line.find_first_of(" \t") != std::string::npos) {
+		::syslog(LOG_INFO, "read recipient whitelist line, which is neither an address nor a domain, skipping: %s", line.c_str());
+		continue;
+	    }
+
+	    for (std::string::size_type i = 0; i < line.length(); i++) {
+		line[i] = to_lower(line[i]);
+	    }
+	    insert(line);
+	}
+    }
+}
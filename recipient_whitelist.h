@@ -0,0 +1,135 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef RECIPIENT_WHITELIST_H
+#define RECIPIENT_WHITELIST_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * class storing recipient addresses, that should not be greylisted
+     *
+     * The file contains one entry per line, either a complete address (postmaster@example.com)
+     * or a domain prefixed by an at sign (@example.com). Matching is case insensitive.
+     *
+     * Entries are stored in an open addressing hash table, so that a lookup does not
+     * allocate memory and takes constant time independant of the number of entries.
+     */
+    class recipient_whitelist {
+	public:
+	    /**
+	     * create a recipient_whitelist instance
+	     *
+	     * @param whitelistfile the file to read the whitelist from
+	     */
+	    recipient_whitelist(std::string const& whitelistfile);
+
+	    /**
+	     * check if a recipient address is whitelisted
+	     *
+	     * This is the case if either the address or its domain is on the whitelist.
+	     */
+	    bool is_whitelisted(std::string const& address) const { return is_whitelisted(address.data(), address.length()); }
+
+	    /**
+	     * check if a recipient address is whitelisted
+	     *
+	     * @param address the address (does not need to be terminated)
+	     * @param length length of the address
+	     */
+	    bool is_whitelisted(char const* address, std::size_t length) const;
+
+	    /**
+	     * get the number of entries in the whitelist
+	     */
+	    std::size_t size() const { return entry_count; }
+	private:
+	    /**
+	     * a slot in the hash table
+	     */
+	    struct slot {
+		/**
+		 * hash of the entry
+		 */
+		::uint32_t hash;
+
+		/**
+		 * offset of the entry in entry_data
+		 */
+		::uint32_t offset;
+
+		/**
+		 * length of the entry, 0 for an empty slot
+		 */
+		::uint32_t length;
+	    };
+
+	    /**
+	     * all entries (lowercased) concatenated
+	     */
+	    std::string entry_data;
+
+	    /**
+	     * the hash table, its size is always a power of two
+	     */
+	    std::vector<slot> slots;
+
+	    /**
+	     * number of entries in the hash table
+	     */
+	    std::size_t entry_count;
+
+	    /**
+	     * calculate the case insensitive hash of a string
+	     */
+	    static ::uint32_t hash(char const* data, std::size_t length);
+
+	    /**
+	     * check if the (not yet lowercased) string is in the hash table
+	     */
+	    bool contains(char const* data, std::size_t length) const;
+
+	    /**
+	     * add an (already lowercased) entry to the hash table
+	     */
+	    void insert(std::string const& entry);
+
+	    /**
+	     * parse the whitelist file
+	     */
+	    void parse_whitelist(std::string const& whitelistfile);
+    };
+}
+
+#endif // RECIPIENT_WHITELIST_H
@@ -0,0 +1,102 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "request_arena.h"
+#include <cstdlib>
+#include <glibmm.h>
+
+/**
+ * alignment of the memory handed out by the arena
+ */
+#define ARENA_ALIGNMENT 16
+
+namespace couriergrey {
+    /**
+     * the arenas of the worker threads
+     */
+    static Glib::Private<request_arena> thread_arena;
+
+    request_arena::request_arena(std::size_t block_size) : block_size(block_size), first(NULL), current(NULL), used(0) {
+    }
+
+    request_arena::~request_arena() {
+	while (first) {
+	    block* next = first->next;
+	    std::free(first);
+	    first = next;
+	}
+    }
+
+    void* request_arena::allocate(std::size_t size) {
+	size = (size + ARENA_ALIGNMENT - 1) & ~static_cast<std::size_t>(ARENA_ALIGNMENT - 1);
+
+	// continue with the next block if the current one is full
+	while (!current || used + size > current->size) {
+	    if (current && current->next && current->next->size >= size) {
+		current = current->next;
+		used = 0;
+		continue;
+	    }
+
+	    // we need a new block, insert it after the current one
+	    std::size_t new_size = size > block_size ? size : block_size;
+	    block* new_block = static_cast<block*>(std::malloc(ARENA_ALIGNMENT + new_size));
+	    if (!new_block) {
+		throw std::bad_alloc();
+	    }
+	    new_block->size = new_size;
+	    if (current) {
+		new_block->next = current->next;
+		current->next = new_block;
+	    } else {
+		new_block->next = first;
+		first = new_block;
+	    }
+	    current = new_block;
+	    used = 0;
+	}
+
+	void* result = reinterpret_cast<char*>(current) + ARENA_ALIGNMENT + used;
+	used += size;
+	return result;
+    }
+
+    void request_arena::reset() {
+	current = first;
+	used = 0;
+    }
+
+    request_arena& request_arena::for_this_thread() {
+	request_arena* arena = thread_arena.get();
+
+	if (!arena) {
+	    arena = new request_arena();
+	    thread_arena.set(arena);
+	}
+
+	return *arena;
+    }
+}
@@ -0,0 +1,190 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef REQUEST_ARENA_H
+#define REQUEST_ARENA_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <cstddef>
+#include <new>
+#include <string>
+#include <list>
+#include <vector>
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * a request_arena is a monotonic memory arena for the transient data of a request
+     *
+     * Memory is taken from large blocks and never freed individually. When a request is
+     * done, the arena is reset and its blocks are reused by the next request, so that
+     * in the steady state processing a request does not allocate memory on the heap.
+     *
+     * Each worker thread has its own arena, see for_this_thread().
+     */
+    class request_arena {
+	public:
+	    /**
+	     * create an empty arena
+	     *
+	     * @param block_size minimum size of the blocks memory is allocated in
+	     */
+	    request_arena(std::size_t block_size = 65536);
+
+	    /**
+	     * destruct the arena, freeing all its blocks
+	     */
+	    ~request_arena();
+
+	    /**
+	     * allocate memory from the arena
+	     *
+	     * @param size number of bytes to allocate
+	     * @return suitably aligned memory, valid until the next reset()
+	     */
+	    void* allocate(std::size_t size);
+
+	    /**
+	     * forget all allocations, but keep the blocks for reuse
+	     */
+	    void reset();
+
+	    /**
+	     * get the arena of the calling thread
+	     */
+	    static request_arena& for_this_thread();
+	private:
+	    /**
+	     * arenas cannot be copied
+	     */
+	    request_arena(request_arena const&);
+
+	    /**
+	     * arenas cannot be assigned
+	     */
+	    request_arena& operator=(request_arena const&);
+
+	    /**
+	     * header of a block of memory, the usable memory follows
+	     */
+	    struct block {
+		/**
+		 * next block in the chain
+		 */
+		block* next;
+
+		/**
+		 * usable size of the block
+		 */
+		std::size_t size;
+	    };
+
+	    /**
+	     * minimum size of new blocks
+	     */
+	    std::size_t block_size;
+
+	    /**
+	     * first block of the chain
+	     */
+	    block* first;
+
+	    /**
+	     * block allocations are currently taken from
+	     */
+	    block* current;
+
+	    /**
+	     * bytes used in the current block
+	     */
+	    std::size_t used;
+    };
+
+    /**
+     * an STL allocator taking its memory from a request_arena
+     */
+    template<class T> class arena_allocator {
+	public:
+	    typedef T value_type;
+	    typedef T* pointer;
+	    typedef T const* const_pointer;
+	    typedef T& reference;
+	    typedef T const& const_reference;
+	    typedef std::size_t size_type;
+	    typedef std::ptrdiff_t difference_type;
+
+	    template<class U> struct rebind {
+		typedef arena_allocator<U> other;
+	    };
+
+	    arena_allocator(request_arena& arena) : arena(&arena) {}
+
+	    template<class U> arena_allocator(arena_allocator<U> const& other) : arena(other.get_arena()) {}
+
+	    pointer allocate(size_type n, void const* = 0) { return static_cast<pointer>(arena->allocate(n * sizeof(T))); }
+
+	    void deallocate(pointer, size_type) {}
+
+	    size_type max_size() const { return static_cast<size_type>(-1) / sizeof(T); }
+
+	    void construct(pointer p, T const& value) { new(static_cast<void*>(p)) T(value); }
+
+	    void destroy(pointer p) { p->~T(); }
+
+	    pointer address(reference r) const { return &r; }
+
+	    const_pointer address(const_reference r) const { return &r; }
+
+	    request_arena* get_arena() const { return arena; }
+	private:
+	    /**
+	     * the arena memory is taken from
+	     */
+	    request_arena* arena;
+    };
+
+    template<class T, class U> bool operator==(arena_allocator<T> const& a, arena_allocator<U> const& b) {
+	return a.get_arena() == b.get_arena();
+    }
+
+    template<class T, class U> bool operator!=(arena_allocator<T> const& a, arena_allocator<U> const& b) {
+	return a.get_arena() != b.get_arena();
+    }
+
+    /**
+     * a string allocated in a request_arena
+     */
+    typedef std::basic_string<char, std::char_traits<char>, arena_allocator<char> > arena_string;
+
+    /**
+     * a list of strings allocated in a request_arena
+     */
+    typedef std::list<arena_string, arena_allocator<arena_string> > arena_string_list;
+}
+
+#endif // REQUEST_ARENA_H
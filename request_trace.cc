@@ -0,0 +1,306 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "request_trace.h"
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <vector>
+#include <glibmm.h>
+
+/**
+ * number of finished traces kept in the ring buffer of each thread
+ */
+#define TRACE_RING_SIZE 256
+
+namespace couriergrey {
+    /**
+     * a finished trace as it is kept in the ring buffer
+     */
+    struct finished_trace {
+	/**
+	 * sequence number, odd while the slot is written
+	 */
+	volatile gint sequence;
+
+	/**
+	 * when the trace has been finished, microseconds on the monotonic clock
+	 */
+	gint64 finished_us;
+
+	/**
+	 * the socket of the request
+	 */
+	int fd;
+
+	/**
+	 * the response code sent
+	 */
+	int response_code;
+
+	/**
+	 * microseconds after accepting when each stage has been reached, -1 if not reached
+	 */
+	long stage_us[request_trace::stage_count];
+    };
+
+    /**
+     * names of the stages, as they are logged
+     */
+    static char const* const stage_names[request_trace::stage_count] = {
+	"accepted",
+	"socket_read",
+	"files_read",
+	"control_parsed",
+	"whitelist_checked",
+	"header_read",
+	"database_opened",
+	"database_done",
+	"response_written"
+    };
+
+    /**
+     * if tracing is enabled
+     */
+    static bool tracing_enabled = false;
+
+    /**
+     * requests taking longer than this number of microseconds are logged
+     */
+    static long slow_threshold_us = 0;
+
+    /**
+     * the slow request log
+     */
+    static std::FILE* slow_log = NULL;
+
+    /**
+     * serializes writes to the slow request log
+     */
+    static Glib::Mutex slow_log_mutex;
+
+    /**
+     * the ring buffer of the finished traces of a worker thread
+     *
+     * The workers are long-lived threads of a pool, so each of them gets a ring of its own and is
+     * the only writer of it. The sequence numbers of the slots only keep dump() from copying a
+     * slot while it is being written.
+     */
+    struct trace_ring {
+	/**
+	 * the finished traces
+	 */
+	finished_trace slots[TRACE_RING_SIZE];
+
+	/**
+	 * number of traces, that have been put into the ring buffer
+	 */
+	volatile gint next;
+
+	/**
+	 * if a thread currently owns the ring
+	 */
+	bool owned;
+    };
+
+    /**
+     * all rings that have been created, they are never freed but handed over to new threads
+     */
+    static std::vector<trace_ring*> trace_rings;
+
+    /**
+     * protects trace_rings and the ownership of the rings
+     */
+    static Glib::Mutex trace_rings_mutex;
+
+    /**
+     * give a ring back when its thread exits, keeping its traces for dump()
+     */
+    static void release_ring(void* ring) {
+	Glib::Mutex::Lock lock(trace_rings_mutex);
+	static_cast<trace_ring*>(ring)->owned = false;
+    }
+
+    /**
+     * the ring of the current thread
+     */
+    static Glib::Private<trace_ring> thread_ring(release_ring);
+
+    /**
+     * get the ring of the current thread, taking over a released one or creating a new one on first use
+     */
+    static trace_ring& get_thread_ring() {
+	trace_ring* ring = thread_ring.get();
+	if (ring) {
+	    return *ring;
+	}
+
+	Glib::Mutex::Lock lock(trace_rings_mutex);
+	for (std::vector<trace_ring*>::iterator p = trace_rings.begin(); p != trace_rings.end(); ++p) {
+	    if (!(*p)->owned) {
+		ring = *p;
+		break;
+	    }
+	}
+	if (!ring) {
+	    ring = new trace_ring;
+	    std::memset(ring, 0, sizeof(trace_ring));
+	    trace_rings.push_back(ring);
+	}
+	ring->owned = true;
+	thread_ring.set(ring);
+	return *ring;
+    }
+
+    /**
+     * order traces by the time they have been finished
+     */
+    static bool finished_before(finished_trace const& a, finished_trace const& b) {
+	return a.finished_us < b.finished_us;
+    }
+
+    /**
+     * write a trace to the slow request log (slow_log_mutex has to be held)
+     */
+    static void log_trace(char const* reason, finished_trace const& trace) {
+	std::time_t now = std::time(NULL);
+	struct std::tm now_tm;
+	gmtime_r(&now, &now_tm);
+	char now_string[32];
+	std::strftime(now_string, sizeof(now_string), "%Y-%m-%dT%H:%M:%SZ", &now_tm);
+
+	std::fprintf(slow_log, "%s %s fd=%d response=%d total=%ldus", now_string, reason, trace.fd, trace.response_code, trace.stage_us[request_trace::response_written]);
+
+	// the time spent in each stage is the difference to the previous stage that has been reached
+	long previous_us = 0;
+	for (int s = request_trace::accepted + 1; s < request_trace::stage_count; s++) {
+	    if (trace.stage_us[s] < 0) {
+		std::fprintf(slow_log, " %s=-", stage_names[s]);
+		continue;
+	    }
+	    std::fprintf(slow_log, " %s=%ldus", stage_names[s], trace.stage_us[s] - previous_us);
+	    previous_us = trace.stage_us[s];
+	}
+	std::fprintf(slow_log, "\n");
+    }
+
+    request_trace::request_trace(int fd) : active(tracing_enabled), fd(fd) {
+	if (active) {
+	    std::memset(stamps, 0, sizeof(stamps));
+	    mark(accepted);
+	}
+    }
+
+    void request_trace::finish(int response_code) {
+	if (!active) {
+	    return;
+	}
+
+	finished_trace trace;
+	trace.sequence = 0;
+	struct ::timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	trace.finished_us = static_cast<gint64>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+	trace.fd = fd;
+	trace.response_code = response_code;
+	for (int s = accepted; s < stage_count; s++) {
+	    if (stamps[s].tv_sec == 0 && stamps[s].tv_nsec == 0) {
+		trace.stage_us[s] = -1;
+		continue;
+	    }
+	    trace.stage_us[s] = (stamps[s].tv_sec - stamps[accepted].tv_sec) * 1000000L + (stamps[s].tv_nsec - stamps[accepted].tv_nsec) / 1000;
+	}
+
+	// fill the next slot of our own ring, we are its only writer
+	trace_ring& ring = get_thread_ring();
+	guint next = g_atomic_int_get(&ring.next);
+	finished_trace& slot = ring.slots[next % TRACE_RING_SIZE];
+	g_atomic_int_inc(&slot.sequence);
+	slot.finished_us = trace.finished_us;
+	slot.fd = trace.fd;
+	slot.response_code = trace.response_code;
+	std::memcpy(slot.stage_us, trace.stage_us, sizeof(slot.stage_us));
+	g_atomic_int_inc(&slot.sequence);
+	g_atomic_int_set(&ring.next, next + 1);
+
+	// log slow requests
+	if (trace.stage_us[response_written] > slow_threshold_us) {
+	    Glib::Mutex::Lock lock(slow_log_mutex);
+	    log_trace("slow", trace);
+	    std::fflush(slow_log);
+	}
+    }
+
+    void request_trace::enable(std::string const& slowlog, int threshold_ms) {
+	slow_log = std::fopen(slowlog.c_str(), "a");
+	if (!slow_log) {
+	    throw Glib::ustring(N_("Cannot open slow request log ")) + slowlog + ": " + std::strerror(errno);
+	}
+
+	slow_threshold_us = threshold_ms * 1000L;
+	tracing_enabled = true;
+    }
+
+    void request_trace::dump() {
+	if (!tracing_enabled) {
+	    return;
+	}
+
+	// collect the traces of all threads
+	std::vector<finished_trace> traces;
+	{
+	    Glib::Mutex::Lock lock(trace_rings_mutex);
+	    for (std::vector<trace_ring*>::const_iterator p = trace_rings.begin(); p != trace_rings.end(); ++p) {
+		trace_ring const& ring = **p;
+		guint next = g_atomic_int_get(&ring.next);
+		guint count = next < TRACE_RING_SIZE ? next : TRACE_RING_SIZE;
+		for (guint i = next - count; i != next; i++) {
+		    finished_trace const& slot = ring.slots[i % TRACE_RING_SIZE];
+
+		    // copy the slot, and skip it if it has been written while copying
+		    gint sequence = g_atomic_int_get(&slot.sequence);
+		    finished_trace trace;
+		    trace.finished_us = slot.finished_us;
+		    trace.fd = slot.fd;
+		    trace.response_code = slot.response_code;
+		    std::memcpy(trace.stage_us, slot.stage_us, sizeof(trace.stage_us));
+		    if (sequence % 2 || g_atomic_int_get(&slot.sequence) != sequence) {
+			continue;
+		    }
+		    traces.push_back(trace);
+		}
+	    }
+	}
+	std::sort(traces.begin(), traces.end(), finished_before);
+
+	Glib::Mutex::Lock lock(slow_log_mutex);
+	for (std::vector<finished_trace>::const_iterator t = traces.begin(); t != traces.end(); ++t) {
+	    log_trace("trace", *t);
+	}
+	std::fflush(slow_log);
+    }
+}
@@ -0,0 +1,119 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef REQUEST_TRACE_H
+#define REQUEST_TRACE_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <string>
+#include <ctime>
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * a request_trace records when a request passed the boundaries between its processing stages
+     *
+     * Finished traces are kept in a ring buffer per worker thread, that can be dumped on request. Traces of requests
+     * that took longer than a threshold are written to the slow request log immediately.
+     *
+     * Tracing is only active if a slow request log has been configured. Otherwise marking a stage
+     * is a single check of a flag.
+     */
+    class request_trace {
+	public:
+	    /**
+	     * the stage boundaries of a request
+	     */
+	    enum stage {
+		accepted,		/**< connection has been accepted */
+		socket_read,		/**< the filenames have been read from the socket */
+		files_read,		/**< the control files have been read */
+		control_parsed,		/**< the control files have been parsed */
+		whitelist_checked,	/**< the whitelists have been checked */
+		header_read,		/**< the header of the message has been read and checked */
+		database_opened,	/**< the database has been opened */
+		database_done,		/**< the database has been queried and updated */
+		response_written,	/**< the response has been written to the socket */
+		stage_count
+	    };
+
+	    /**
+	     * start a new trace, marking the accepted stage
+	     *
+	     * @param fd the socket of the request
+	     */
+	    request_trace(int fd);
+
+	    /**
+	     * mark that the request has reached a stage boundary
+	     */
+	    void mark(stage reached) {
+		if (active) {
+		    ::clock_gettime(CLOCK_MONOTONIC, &stamps[reached]);
+		}
+	    }
+
+	    /**
+	     * finish the trace, store it in the ring buffer and log it if it has been slow
+	     *
+	     * @param response_code the code of the response that has been sent
+	     */
+	    void finish(int response_code);
+
+	    /**
+	     * enable tracing
+	     *
+	     * @param slowlog file to write slow requests and dumped traces to
+	     * @param threshold_ms requests taking longer than this number of milliseconds are logged
+	     * @throws Glib::ustring if the slow request log cannot be opened
+	     */
+	    static void enable(std::string const& slowlog, int threshold_ms);
+
+	    /**
+	     * dump all traces in the ring buffers to the slow request log, oldest first
+	     */
+	    static void dump();
+	private:
+	    /**
+	     * if this trace is recording
+	     */
+	    bool active;
+
+	    /**
+	     * the socket of the request
+	     */
+	    int fd;
+
+	    /**
+	     * when the stage boundaries have been reached, zero if not reached
+	     */
+	    struct ::timespec stamps[stage_count];
+    };
+}
+
+#endif // REQUEST_TRACE_H
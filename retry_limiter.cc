@@ -0,0 +1,257 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "retry_limiter.h"
+#include <cstring>
+#include <cerrno>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <glibmm.h>
+
+/**
+ * number of client networks the limiter keeps track of
+ */
+#define RETRY_LIMITER_SLOTS 16384
+
+/**
+ * the tokens of a bucket are counted in thousandths of a retry
+ */
+#define RETRY_LIMITER_TOKEN 1000
+
+namespace couriergrey {
+    /**
+     * the bucket of a client network
+     */
+    struct retry_slot {
+	/**
+	 * the sequence lock, odd while the slot is written
+	 */
+	volatile gint sequence;
+
+	/**
+	 * hash of the client network, 0 if the slot is empty
+	 */
+	::uint64_t client_hash;
+
+	/**
+	 * hash of the keys the client has last been greylisted for
+	 */
+	::uint64_t keys_hash;
+
+	/**
+	 * when greylisting of these keys ends
+	 */
+	::int64_t release;
+
+	/**
+	 * when the bucket has last been refilled, in milliseconds of the monotonic clock
+	 */
+	::int64_t refilled_ms;
+
+	/**
+	 * tokens in the bucket, in thousandths of a retry
+	 */
+	::int64_t tokens;
+    };
+
+    /**
+     * the table of buckets in shared memory, NULL if the limiter is disabled
+     */
+    static retry_slot* buckets = NULL;
+
+    /**
+     * how many retries per minute a client may do
+     */
+    static int retry_rate = 0;
+
+    /**
+     * hash characters (FNV-1a), continuing a previous hash
+     */
+    static ::uint64_t add_hash(::uint64_t hash, char const* value, std::size_t length) {
+	for (char const* p = value; p != value + length; ++p) {
+	    hash ^= static_cast<unsigned char>(*p);
+	    hash *= 1099511628211ULL;
+	}
+	return hash;
+    }
+
+    /**
+     * hash a client network, never returning the hash of an empty slot
+     */
+    static ::uint64_t client_hash(char const* client_network) {
+	::uint64_t hash = add_hash(14695981039346656037ULL, client_network, std::strlen(client_network));
+	return hash ? hash : 1;
+    }
+
+    /**
+     * hash the keys of a request
+     */
+    static ::uint64_t keys_hash(entry_store::key const* keys, std::size_t count) {
+	::uint64_t hash = 14695981039346656037ULL;
+	for (entry_store::key const* p = keys; p != keys + count; ++p) {
+	    hash = add_hash(hash, p->data, p->length);
+	    hash ^= '\n';
+	    hash *= 1099511628211ULL;
+	}
+	return hash;
+    }
+
+    /**
+     * get the current time of the monotonic clock in milliseconds
+     */
+    static ::int64_t monotonic_ms() {
+	struct ::timespec now;
+	::clock_gettime(CLOCK_MONOTONIC, &now);
+	return static_cast< ::int64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+    }
+
+    /**
+     * lock a slot for writing, if nobody else is writing it
+     *
+     * @param sequence where to store the sequence number the slot has been locked at
+     */
+    static bool lock_slot(retry_slot* slot, gint& sequence) {
+	sequence = g_atomic_int_get(&slot->sequence);
+	return !(sequence & 1) && g_atomic_int_compare_and_exchange(&slot->sequence, sequence, sequence + 1);
+    }
+
+    /**
+     * unlock a slot locked by lock_slot()
+     */
+    static void unlock_slot(retry_slot* slot, gint sequence) {
+	g_atomic_int_set(&slot->sequence, sequence + 2);
+    }
+
+    void retry_limiter::start(int retries_per_minute) {
+	// shared with the worker processes we fork later, all slots are empty
+	void* table = ::mmap(NULL, RETRY_LIMITER_SLOTS * sizeof(retry_slot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (table == MAP_FAILED) {
+	    throw Glib::ustring(N_("Could not create the table of the retry limiter: ")) + std::strerror(errno);
+	}
+
+	buckets = static_cast<retry_slot*>(table);
+	retry_rate = retries_per_minute;
+    }
+
+    bool retry_limiter::is_enabled() {
+	return buckets != NULL;
+    }
+
+    long retry_limiter::check(char const* client_network, entry_store::key const* keys, std::size_t count, std::time_t now) {
+	if (!buckets) {
+	    return 0;
+	}
+
+	::uint64_t const client = client_hash(client_network);
+	retry_slot* slot = buckets + client % RETRY_LIMITER_SLOTS;
+
+	// somebody else is using the slot, do not wait for it
+	gint sequence = 0;
+	if (!lock_slot(slot, sequence)) {
+	    return 0;
+	}
+
+	// we only keep track of clients that have been greylisted
+	long wait = 0;
+	if (slot->client_hash == client) {
+	    ::int64_t const now_ms = monotonic_ms();
+	    ::int64_t const capacity = static_cast< ::int64_t>(retry_rate) * RETRY_LIMITER_TOKEN;
+
+	    slot->tokens += (now_ms - slot->refilled_ms) * retry_rate * RETRY_LIMITER_TOKEN / 60000;
+	    if (slot->tokens > capacity) {
+		slot->tokens = capacity;
+	    }
+	    slot->refilled_ms = now_ms;
+
+	    if (slot->tokens >= RETRY_LIMITER_TOKEN) {
+		slot->tokens -= RETRY_LIMITER_TOKEN;
+	    } else if (slot->release > now && slot->keys_hash == keys_hash(keys, count)) {
+		wait = slot->release - now;
+	    }
+	}
+
+	unlock_slot(slot, sequence);
+	return wait;
+    }
+
+    void retry_limiter::flush() {
+	if (!buckets) {
+	    return;
+	}
+
+	// a slot written meanwhile is flushed the next time
+	for (retry_slot* slot = buckets; slot < buckets + RETRY_LIMITER_SLOTS; slot++) {
+	    gint sequence = 0;
+	    if (lock_slot(slot, sequence)) {
+		slot->client_hash = 0;
+		unlock_slot(slot, sequence);
+	    }
+	}
+    }
+
+    int retry_limiter::tracked_clients() {
+	if (!buckets) {
+	    return 0;
+	}
+
+	int tracked = 0;
+	for (retry_slot const* slot = buckets; slot < buckets + RETRY_LIMITER_SLOTS; slot++) {
+	    if (slot->client_hash) {
+		tracked++;
+	    }
+	}
+	return tracked;
+    }
+
+    int retry_limiter::capacity() {
+	return buckets ? RETRY_LIMITER_SLOTS : 0;
+    }
+
+    void retry_limiter::greylisted(char const* client_network, entry_store::key const* keys, std::size_t count, std::time_t release) {
+	if (!buckets) {
+	    return;
+	}
+
+	::uint64_t const client = client_hash(client_network);
+	retry_slot* slot = buckets + client % RETRY_LIMITER_SLOTS;
+
+	gint sequence = 0;
+	if (!lock_slot(slot, sequence)) {
+	    return;
+	}
+
+	// a new client starts with a full bucket, less the request that has been greylisted
+	if (slot->client_hash != client) {
+	    slot->client_hash = client;
+	    slot->refilled_ms = monotonic_ms();
+	    slot->tokens = static_cast< ::int64_t>(retry_rate - 1) * RETRY_LIMITER_TOKEN;
+	}
+	slot->keys_hash = keys_hash(keys, count);
+	slot->release = release;
+
+	unlock_slot(slot, sequence);
+    }
+}
@@ -0,0 +1,109 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef RETRY_LIMITER_H
+#define RETRY_LIMITER_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <cstddef>
+#include <ctime>
+
+#include <entry_store.h>
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * detection of clients retrying greylisted mail too fast
+     *
+     * Each client network gets a token bucket, refilled at the configured number
+     * of retries per minute and holding at most that many tokens. Each request
+     * takes a token. A client without tokens that retries the same mail while it
+     * is still greylisted gets the temporary failure from memory, without reading
+     * or writing the database.
+     *
+     * The buckets are kept in a fixed size table in shared memory, that is mapped
+     * before the worker processes are forked in prefork mode. A client network is
+     * identified by a 64 bit hash and clients colliding in the table replace each
+     * other. Each slot is protected by a sequence lock like the slots of the
+     * triplet_cache; a request that finds its slot locked is processed normally
+     * instead of waiting.
+     */
+    class retry_limiter {
+	public:
+	    /**
+	     * create the table and enable the limiter
+	     *
+	     * @param retries_per_minute how often a client may retry per minute before it is answered from memory
+	     * @throws Glib::ustring if the table cannot be created
+	     */
+	    static void start(int retries_per_minute);
+
+	    /**
+	     * check if the limiter is enabled
+	     */
+	    static bool is_enabled();
+
+	    /**
+	     * forget all client networks, they start with full buckets again
+	     */
+	    static void flush();
+
+	    /**
+	     * get the number of client networks in the table
+	     */
+	    static int tracked_clients();
+
+	    /**
+	     * get the number of slots of the table, 0 if the limiter is disabled
+	     */
+	    static int capacity();
+
+	    /**
+	     * account a request of a client, and check if it can be answered from memory
+	     *
+	     * @param client_network the client network the request has been received from
+	     * @param keys the greylisting keys of the request
+	     * @param count the number of keys
+	     * @param now the current time
+	     * @return seconds the client still has to wait if it retries too fast while it is greylisted, 0 if the request has to be processed normally
+	     */
+	    static long check(char const* client_network, entry_store::key const* keys, std::size_t count, std::time_t now);
+
+	    /**
+	     * remember that a client has been greylisted
+	     *
+	     * @param client_network the client network the request has been received from
+	     * @param keys the greylisting keys of the request
+	     * @param count the number of keys
+	     * @param release when greylisting of the keys ends
+	     */
+	    static void greylisted(char const* client_network, entry_store::key const* keys, std::size_t count, std::time_t release);
+    };
+}
+
+#endif // RETRY_LIMITER_H
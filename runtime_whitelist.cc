@@ -0,0 +1,96 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "runtime_whitelist.h"
+#include <sstream>
+#include <stdexcept>
+
+namespace couriergrey {
+    void runtime_whitelist::add(std::string const& network, long ttl_seconds) {
+	int prefix = 0;
+	ip_address network_address("::");
+	try {
+	    network_address = ip_address::parse_network(network, prefix);
+	} catch (std::invalid_argument const&) {
+	    throw Glib::ustring(N_("Not a valid address or network: ")) + network;
+	}
+	std::time_t expires = ttl_seconds > 0 ? std::time(NULL) + ttl_seconds : 0;
+
+	Glib::RWLock::WriterLock lock(entries_lock);
+	for (std::vector<entry>::iterator p = entries.begin(); p != entries.end(); ++p) {
+	    if (p->text == network) {
+		p->expires = expires;
+		return;
+	    }
+	}
+	entries.push_back(entry(network, network_address, prefix, expires));
+    }
+
+    bool runtime_whitelist::remove(std::string const& network) {
+	Glib::RWLock::WriterLock lock(entries_lock);
+	for (std::vector<entry>::iterator p = entries.begin(); p != entries.end(); ++p) {
+	    if (p->text == network) {
+		entries.erase(p);
+		return true;
+	    }
+	}
+	return false;
+    }
+
+    void runtime_whitelist::clear() {
+	Glib::RWLock::WriterLock lock(entries_lock);
+	entries.clear();
+    }
+
+    std::string runtime_whitelist::list() const {
+	std::ostringstream result;
+	std::time_t now = std::time(NULL);
+
+	Glib::RWLock::ReaderLock lock(entries_lock);
+	for (std::vector<entry>::const_iterator p = entries.begin(); p != entries.end(); ++p) {
+	    if (p->expires == 0) {
+		result << p->text << " permanent" << std::endl;
+	    } else if (p->expires > now) {
+		result << p->text << " " << (p->expires - now) << "s" << std::endl;
+	    }
+	}
+
+	return result.str();
+    }
+
+    bool runtime_whitelist::is_whitelisted(char const* address) const {
+	ip_address const client(address);
+	std::time_t now = std::time(NULL);
+
+	Glib::RWLock::ReaderLock lock(entries_lock);
+	for (std::vector<entry>::const_iterator p = entries.begin(); p != entries.end(); ++p) {
+	    if ((p->expires == 0 || p->expires > now) && client.is_in_net(p->network, p->prefix)) {
+		return true;
+	    }
+	}
+	return false;
+    }
+}
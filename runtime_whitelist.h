@@ -0,0 +1,127 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef RUNTIME_WHITELIST_H
+#define RUNTIME_WHITELIST_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <string>
+#include <vector>
+#include <ctime>
+#include <glibmm.h>
+
+#include <ip_address.h>
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * whitelist of sending MTAs, that is changed at runtime using the admin socket
+     *
+     * Entries can have a time to live, after which they are ignored. Unlike the
+     * whitelist read from the file, this whitelist is kept in memory only.
+     */
+    class runtime_whitelist {
+	public:
+	    /**
+	     * add an entry, replacing an existing entry for the same network
+	     *
+	     * @param network a single address or address/prefix
+	     * @param ttl_seconds how long the entry is valid, 0 for no limit
+	     * @throws Glib::ustring if network is not valid
+	     */
+	    void add(std::string const& network, long ttl_seconds);
+
+	    /**
+	     * remove an entry
+	     *
+	     * @param network the network as it has been added
+	     * @return true if there has been an entry
+	     */
+	    bool remove(std::string const& network);
+
+	    /**
+	     * remove all entries
+	     */
+	    void clear();
+
+	    /**
+	     * list the valid entries, one per line with the seconds they remain valid
+	     */
+	    std::string list() const;
+
+	    /**
+	     * check if an address is whitelisted
+	     *
+	     * @param address the address to check
+	     * @throws std::invalid_argument if address is not a valid address
+	     */
+	    bool is_whitelisted(char const* address) const;
+	private:
+	    /**
+	     * an entry of the whitelist
+	     */
+	    struct entry {
+		/**
+		 * the network as it has been added
+		 */
+		std::string text;
+
+		/**
+		 * the network address
+		 */
+		ip_address network;
+
+		/**
+		 * the prefix length of the network
+		 */
+		int prefix;
+
+		/**
+		 * when the entry expires, 0 if it does not
+		 */
+		std::time_t expires;
+
+		/**
+		 * create an entry
+		 */
+		entry(std::string const& text, ip_address const& network, int prefix, std::time_t expires) : text(text), network(network), prefix(prefix), expires(expires) {}
+	    };
+
+	    /**
+	     * the entries
+	     */
+	    std::vector<entry> entries;
+
+	    /**
+	     * protecting entries, lookups take it as readers
+	     */
+	    mutable Glib::RWLock entries_lock;
+    };
+}
+
+#endif // RUNTIME_WHITELIST_H
@@ -0,0 +1,232 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "sender_normalizer.h"
+#include "statistics.h"
+#include <cstring>
+#include <cctype>
+#include <glibmm.h>
+
+/**
+ * the longest address we normalize (RFC 5321 limits paths to 256 octets)
+ */
+#define MAX_ADDRESS_LENGTH 512
+
+namespace couriergrey {
+    sender_normalizer::sender_normalizer(std::string const& rule_list) : rules(0) {
+	std::string::size_type start = 0;
+	while (start <= rule_list.length()) {
+	    std::string::size_type end = rule_list.find(',', start);
+	    if (end == std::string::npos) {
+		end = rule_list.length();
+	    }
+	    std::string const rule_name = rule_list.substr(start, end - start);
+	    start = end + 1;
+
+	    if (rule_name == "srs") {
+		rules |= srs;
+	    } else if (rule_name == "batv") {
+		rules |= batv;
+	    } else if (rule_name == "verp") {
+		rules |= verp;
+	    } else if (rule_name == "lowercase") {
+		rules |= lowercase;
+	    } else if (rule_name == "all") {
+		rules |= srs | batv | verp | lowercase;
+	    } else if (rule_name != "none" && !rule_name.empty()) {
+		throw Glib::ustring(N_("Unknown sender normalization rule: ")) + rule_name;
+	    }
+	}
+    }
+
+    /**
+     * check if a string starts with a prefix, ignoring case
+     */
+    static bool starts_with(char const* text, std::size_t length, char const* prefix) {
+	std::size_t prefix_length = std::strlen(prefix);
+	return length >= prefix_length && ::strncasecmp(text, prefix, prefix_length) == 0;
+    }
+
+    /**
+     * find a character in a string
+     *
+     * @return position of the character, length if not found
+     */
+    static std::size_t find_char(char const* text, std::size_t length, char c, std::size_t start = 0) {
+	for (std::size_t i = start; i < length; i++) {
+	    if (text[i] == c) {
+		return i;
+	    }
+	}
+	return length;
+    }
+
+    /**
+     * find the last @ of an address, separating the local part from the domain
+     *
+     * @return position of the @, length if there is none
+     */
+    static std::size_t find_at(char const* address, std::size_t length) {
+	for (std::size_t i = length; i > 0; i--) {
+	    if (address[i-1] == '@') {
+		return i-1;
+	    }
+	}
+	return length;
+    }
+
+    /**
+     * undo SRS rewriting, SRS0=hash=time=domain=local or SRS1=hash=forwarder==hash=time=domain=local
+     *
+     * @return new length of the address, length if it is not an SRS address
+     */
+    static std::size_t normalize_srs(char* address, std::size_t length, std::size_t at) {
+	std::size_t fields_start = 0;
+	if (starts_with(address, at, "SRS0") && at > 4 && std::strchr("=+-", address[4])) {
+	    fields_start = 5;
+	} else if (starts_with(address, at, "SRS1") && at > 4 && std::strchr("=+-", address[4])) {
+	    // the SRS0 fields follow the first "=="
+	    for (std::size_t i = 5; i + 1 < at; i++) {
+		if (address[i] == '=' && address[i+1] == '=') {
+		    fields_start = i + 2;
+		    break;
+		}
+	    }
+	}
+	if (fields_start == 0) {
+	    return length;
+	}
+
+	// skip hash and timestamp
+	std::size_t hash_end = find_char(address, at, '=', fields_start);
+	std::size_t time_end = find_char(address, at, '=', hash_end + 1);
+	std::size_t domain_end = find_char(address, at, '=', time_end + 1);
+	if (domain_end >= at || domain_end == time_end + 1 || domain_end + 1 == at) {
+	    return length;
+	}
+
+	// build local@domain
+	char normalized[MAX_ADDRESS_LENGTH];
+	std::size_t local_length = at - (domain_end + 1);
+	std::size_t domain_length = domain_end - (time_end + 1);
+	std::memcpy(normalized, address + domain_end + 1, local_length);
+	normalized[local_length] = '@';
+	std::memcpy(normalized + local_length + 1, address + time_end + 1, domain_length);
+
+	std::size_t normalized_length = local_length + 1 + domain_length;
+	std::memcpy(address, normalized, normalized_length);
+	statistics::increment(statistics::normalized_srs);
+	return normalized_length;
+    }
+
+    /**
+     * remove BATV tags, prvs=tag=local
+     *
+     * @return new length of the address, length if it is not a BATV address
+     */
+    static std::size_t normalize_batv(char* address, std::size_t length, std::size_t at) {
+	static char const* const schemes[] = { "prvs=", "msprvs1=", "btv1=", NULL };
+
+	for (char const* const* scheme = schemes; *scheme; scheme++) {
+	    if (!starts_with(address, at, *scheme)) {
+		continue;
+	    }
+
+	    std::size_t tag_end = find_char(address, at, '=', std::strlen(*scheme));
+	    if (tag_end + 1 >= at) {
+		return length;
+	    }
+
+	    std::memmove(address, address + tag_end + 1, length - (tag_end + 1));
+	    statistics::increment(statistics::normalized_batv);
+	    return length - (tag_end + 1);
+	}
+
+	return length;
+    }
+
+    /**
+     * remove VERP encoded recipients, local+recipient=domain
+     *
+     * @return new length of the address, length if it is not a VERP address
+     */
+    static std::size_t normalize_verp(char* address, std::size_t length, std::size_t at) {
+	std::size_t plus = find_char(address, at, '+');
+	if (plus == 0 || plus >= at || find_char(address, at, '=', plus) >= at) {
+	    return length;
+	}
+
+	std::memmove(address + plus, address + at, length - at);
+	statistics::increment(statistics::normalized_verp);
+	return length - (at - plus);
+    }
+
+    /**
+     * convert the domain to lowercase
+     */
+    static void normalize_case(char* address, std::size_t length, std::size_t at) {
+	bool changed = false;
+	for (std::size_t i = at + 1; i < length; i++) {
+	    if (std::isupper(static_cast<unsigned char>(address[i]))) {
+		address[i] = std::tolower(static_cast<unsigned char>(address[i]));
+		changed = true;
+	    }
+	}
+	if (changed) {
+	    statistics::increment(statistics::normalized_lowercase);
+	}
+    }
+
+    std::size_t sender_normalizer::normalize(char* address, std::size_t length) const {
+	if (rules == 0 || length > MAX_ADDRESS_LENGTH) {
+	    return length;
+	}
+
+	// without a domain (e.g. the null sender) there is nothing to normalize
+	std::size_t at = find_at(address, length);
+	if (at == length) {
+	    return length;
+	}
+
+	if (rules & srs) {
+	    length = normalize_srs(address, length, at);
+	    at = find_at(address, length);
+	}
+	if (rules & batv) {
+	    length = normalize_batv(address, length, at);
+	    at = find_at(address, length);
+	}
+	if (rules & verp) {
+	    length = normalize_verp(address, length, at);
+	    at = find_at(address, length);
+	}
+	if (rules & lowercase) {
+	    normalize_case(address, length, at);
+	}
+
+	return length;
+    }
+}
@@ -0,0 +1,87 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef SENDER_NORMALIZER_H
+#define SENDER_NORMALIZER_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <string>
+#include <cstddef>
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * normalizes envelope sender addresses before they are used in a greylisting key
+     *
+     * Mailing lists and forwarders rewrite the sender address for each delivery
+     * attempt or recipient. Without normalization each retry would get a new key
+     * and be delayed again. The rules are selected once at startup, normalizing an
+     * address works in place and does not allocate memory.
+     */
+    class sender_normalizer {
+	public:
+	    /**
+	     * the available rules
+	     */
+	    enum rule {
+		srs = 1,		/**< SRS0=hash=time=domain=local@forwarder becomes local@domain */
+		batv = 2,		/**< prvs=tag=local@domain (and msprvs1=, btv1=) becomes local@domain */
+		verp = 4,		/**< local+recipient=domain@domain becomes local@domain */
+		lowercase = 8		/**< the domain is converted to lowercase */
+	    };
+
+	    /**
+	     * create a normalizer that does not change addresses
+	     */
+	    sender_normalizer() : rules(0) {}
+
+	    /**
+	     * create a normalizer from a list of rules
+	     *
+	     * @param rule_list comma separated list of rule names (srs, batv, verp, lowercase), "all" or "none"
+	     * @throws Glib::ustring if a rule is unknown
+	     */
+	    sender_normalizer(std::string const& rule_list);
+
+	    /**
+	     * normalize an address in place
+	     *
+	     * @param address the address to normalize, does not need to be terminated
+	     * @param length length of the address
+	     * @return the length of the normalized address (never longer than the original)
+	     */
+	    std::size_t normalize(char* address, std::size_t length) const;
+	private:
+	    /**
+	     * the enabled rules, a combination of rule values
+	     */
+	    unsigned rules;
+    };
+}
+
+#endif // SENDER_NORMALIZER_H
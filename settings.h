@@ -0,0 +1,78 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <sender_normalizer.h>
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * runtime settings of the filter, as they have been given on the command line
+     */
+    struct settings {
+	/**
+	 * create settings with the default values
+	 */
+	settings() : ipv4_prefix(32), ipv6_prefix(128), deadline_ms(0), deadline_fail_open(false), per_recipient(false) {}
+
+	/**
+	 * prefix length IPv4 client addresses are aggregated to in the greylisting key
+	 */
+	int ipv4_prefix;
+
+	/**
+	 * prefix length IPv6 client addresses are aggregated to in the greylisting key
+	 */
+	int ipv6_prefix;
+
+	/**
+	 * time a request may take from accepting the connection to the response in milliseconds, 0 for no limit
+	 */
+	int deadline_ms;
+
+	/**
+	 * if requests missing their deadline are accepted instead of being tempfailed
+	 */
+	bool deadline_fail_open;
+
+	/**
+	 * how envelope senders are normalized before they are used in the greylisting key
+	 */
+	sender_normalizer sender_normalization;
+
+	/**
+	 * if each recipient has its own greylisting key instead of one key for all recipients of a message
+	 */
+	bool per_recipient;
+    };
+}
+
+#endif // SETTINGS_H
@@ -0,0 +1,101 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "statistics.h"
+#include <sstream>
+#include <cstdlib>
+#include <syslog.h>
+
+namespace couriergrey {
+    volatile gint statistics::counters[statistics::counter_count];
+
+    /**
+     * names of the counters, as they are reported
+     */
+    static char const* const counter_names[statistics::counter_count] = {
+	"requests_accepted",
+	"requests_shed",
+	"requests_in_flight",
+	"decisions_logged",
+	"decisions_dropped",
+	"request_allocations",
+	"shortcut_authenticated",
+	"shortcut_whitelisted_client",
+	"shortcut_whitelisted_recipient",
+	"shortcut_spf",
+	"message_headers_read",
+	"compactions",
+	"compactions_failed",
+	"deadline_misses",
+	"commit_batches",
+	"commit_writes",
+	"normalized_srs",
+	"normalized_batv",
+	"normalized_verp",
+	"normalized_lowercase",
+	"triplet_cache_hits",
+	"retry_limited"
+    };
+
+    char const* statistics::name(counter c) {
+	return counter_names[c];
+    }
+
+    std::string statistics::format() {
+	std::ostringstream result;
+
+	for (int c = 0; c < counter_count; c++) {
+	    if (c > 0) {
+		result << ' ';
+	    }
+	    result << counter_names[c] << '=' << get(static_cast<counter>(c));
+	}
+
+	return result.str();
+    }
+
+    void statistics::restore(std::string const& formatted) {
+	std::istringstream pairs(formatted);
+	std::string pair;
+	while (pairs >> pair) {
+	    std::string::size_type equal_pos = pair.find('=');
+	    if (equal_pos == std::string::npos) {
+		continue;
+	    }
+
+	    std::string const counter_name = pair.substr(0, equal_pos);
+	    for (int c = 0; c < counter_count; c++) {
+		if (c != requests_in_flight && counter_name == counter_names[c]) {
+		    add(static_cast<counter>(c), std::atoi(pair.c_str() + equal_pos + 1));
+		}
+	    }
+	}
+    }
+
+    void statistics::log() {
+	::syslog(LOG_INFO, "statistics: %s", format().c_str());
+    }
+}
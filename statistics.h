@@ -0,0 +1,119 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef STATISTICS_H
+#define STATISTICS_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <string>
+#include <glib.h>
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * counters about the operation of the filter
+     *
+     * Counters are updated using atomic operations, so they can be updated from
+     * any thread without locking.
+     */
+    class statistics {
+	public:
+	    /**
+	     * the available counters
+	     */
+	    enum counter {
+		requests_accepted,	/**< connections accepted on the filter socket */
+		requests_shed,		/**< connections answered with a tempfail because of overload */
+		requests_in_flight,	/**< requests accepted but not yet answered (gauge) */
+		decisions_logged,	/**< records queued for the decision log */
+		decisions_dropped,	/**< records dropped because the decision log queue was full */
+		request_allocations,	/**< heap allocations while processing requests (only with --enable-allocation-counter) */
+		shortcut_authenticated,	/**< requests accepted as authenticated */
+		shortcut_whitelisted_client, /**< requests accepted by the whitelist before the message has been read */
+		shortcut_whitelisted_recipient, /**< requests accepted by the recipient whitelist before the message has been read */
+		shortcut_spf,		/**< requests accepted by SPF before the database has been opened */
+		message_headers_read,	/**< requests that had to read the header of the message file */
+		compactions,		/**< online compactions of the database */
+		compactions_failed,	/**< online compactions of the database that failed */
+		deadline_misses,	/**< requests answered because their deadline has passed */
+		commit_batches,		/**< batches of writes committed by the commit queue */
+		commit_writes,		/**< writes committed by the commit queue */
+		normalized_srs,		/**< sender addresses with SRS rewriting undone */
+		normalized_batv,	/**< sender addresses with BATV tags removed */
+		normalized_verp,	/**< sender addresses with VERP encoded recipients removed */
+		normalized_lowercase,	/**< sender addresses with the domain converted to lowercase */
+		triplet_cache_hits,	/**< requests answered from the shared triplet cache without opening the database */
+		retry_limited,		/**< requests of clients retrying too fast answered without opening the database */
+		counter_count
+	    };
+
+	    /**
+	     * increment a counter
+	     */
+	    static void increment(counter c) { g_atomic_int_inc(&counters[c]); }
+
+	    /**
+	     * add to a counter
+	     */
+	    static void add(counter c, gint value) { g_atomic_int_add(&counters[c], value); }
+
+	    /**
+	     * get the current value of a counter
+	     */
+	    static gint get(counter c) { return g_atomic_int_get(&counters[c]); }
+
+	    /**
+	     * get the name of a counter
+	     */
+	    static char const* name(counter c);
+
+	    /**
+	     * format all counters as a single line of name=value pairs
+	     */
+	    static std::string format();
+
+	    /**
+	     * add counter values formatted by format(), e.g. by a previous instance
+	     *
+	     * Unknown counters and gauges are ignored.
+	     */
+	    static void restore(std::string const& formatted);
+
+	    /**
+	     * write all counters to syslog
+	     */
+	    static void log();
+	private:
+	    /**
+	     * the values of the counters
+	     */
+	    static volatile gint counters[counter_count];
+    };
+}
+
+#endif // STATISTICS_H
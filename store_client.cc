@@ -0,0 +1,511 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "store_client.h"
+#include "store_protocol.h"
+#include <map>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <glibmm.h>
+
+/**
+ * how long a request waits for the server if no timeout is given, in milliseconds
+ */
+#define STORE_DEFAULT_TIMEOUT_MS 10000
+
+/**
+ * how often the receiver thread checks if it should stop, in milliseconds
+ */
+#define STORE_POLL_INTERVAL_MS 500
+
+/**
+ * maximum number of entries in the local cache, unless it is resized
+ */
+#define STORE_CACHE_ENTRIES 65536
+
+namespace couriergrey {
+    /**
+     * a request waiting for its response
+     */
+    struct pending_request {
+	/**
+	 * if the response has been received or the request failed
+	 */
+	bool done;
+
+	/**
+	 * if the connection has been lost before the response has been received
+	 */
+	bool failed;
+
+	/**
+	 * the response after its id
+	 */
+	std::string response;
+    };
+
+    /**
+     * an entry in the local cache
+     */
+    struct cached_entry {
+	/**
+	 * the cached entry
+	 */
+	entry_store::entry value;
+
+	/**
+	 * when the entry expires, in milliseconds of the monotonic clock
+	 */
+	::int64_t expires_ms;
+    };
+
+    /**
+     * the location of the socket of the server
+     */
+    static std::string server_path;
+
+    /**
+     * how long entries are cached, in milliseconds
+     */
+    static int cache_ttl_ms = 0;
+
+    /**
+     * the connection to the server, -1 if not connected
+     */
+    static int connection = -1;
+
+    /**
+     * the id of the next request
+     */
+    static ::uint32_t next_id = 1;
+
+    /**
+     * the requests waiting for their response by id
+     */
+    static std::map< ::uint32_t, pending_request*> pending;
+
+    /**
+     * protecting connection, next_id and pending
+     */
+    static Glib::Mutex client_mutex;
+
+    /**
+     * signalled when responses have been received
+     */
+    static Glib::Cond response_ready;
+
+    /**
+     * held while a request is sent, so that requests are not interleaved
+     */
+    static Glib::Mutex send_mutex;
+
+    /**
+     * the local cache of entries
+     */
+    static std::map<std::string, cached_entry> cache;
+
+    /**
+     * maximum number of entries in the local cache, protected by cache_mutex
+     */
+    static std::map<std::string, cached_entry>::size_type cache_limit = STORE_CACHE_ENTRIES;
+
+    /**
+     * protecting cache and cache_limit
+     */
+    static Glib::Mutex cache_mutex;
+
+    /**
+     * the thread receiving the responses
+     */
+    static Glib::Thread* receiver_thread = NULL;
+
+    /**
+     * set to stop the receiver thread
+     */
+    static volatile gint receiver_stopping = 0;
+
+    /**
+     * get the current time of the monotonic clock in milliseconds
+     */
+    static ::int64_t monotonic_ms() {
+	struct ::timespec now;
+	::clock_gettime(CLOCK_MONOTONIC, &now);
+	return static_cast< ::int64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+    }
+
+    /**
+     * get an entry from the local cache
+     *
+     * @return false if the key is not cached or the cached entry has expired
+     */
+    static bool cache_lookup(std::string const& key, entry_store::entry& value) {
+	if (cache_ttl_ms <= 0) {
+	    return false;
+	}
+
+	Glib::Mutex::Lock lock(cache_mutex);
+	std::map<std::string, cached_entry>::const_iterator cached = cache.find(key);
+	if (cached == cache.end() || cached->second.expires_ms <= monotonic_ms()) {
+	    return false;
+	}
+	value = cached->second.value;
+	return true;
+    }
+
+    /**
+     * put an entry into the local cache
+     */
+    static void cache_store(std::string const& key, entry_store::entry const& value) {
+	if (cache_ttl_ms <= 0) {
+	    return;
+	}
+
+	::int64_t const now_ms = monotonic_ms();
+	Glib::Mutex::Lock lock(cache_mutex);
+	if (cache_limit == 0) {
+	    return;
+	}
+
+	// make room by dropping the expired entries, or all of them if none has expired
+	if (cache.size() >= cache_limit && cache.find(key) == cache.end()) {
+	    for (std::map<std::string, cached_entry>::iterator p = cache.begin(); p != cache.end(); ) {
+		if (p->second.expires_ms <= now_ms) {
+		    cache.erase(p++);
+		} else {
+		    ++p;
+		}
+	    }
+	    if (cache.size() >= cache_limit) {
+		cache.clear();
+	    }
+	}
+
+	cached_entry& cached = cache[key];
+	cached.value = value;
+	cached.expires_ms = now_ms + cache_ttl_ms;
+    }
+
+    /**
+     * connect to the server, client_mutex has to be held
+     *
+     * @throws Glib::ustring if the server cannot be reached
+     */
+    static void connect_server() {
+	struct sockaddr_un addr;
+	if (server_path.length() >= sizeof(addr.sun_path)) {
+	    throw Glib::ustring(N_("Store socket name to long: ")) + server_path;
+	}
+
+	int fd = ::socket(PF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+	    throw Glib::ustring(N_("Problem creating a unix domain socket: ")) + std::strerror(errno);
+	}
+
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	std::strncpy(addr.sun_path, server_path.c_str(), sizeof(addr.sun_path)-1);
+	if (::connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr))) {
+	    Glib::ustring msg = Glib::ustring(N_("Could not connect to store server ")) + server_path + ": " + std::strerror(errno);
+	    ::close(fd);
+	    throw msg;
+	}
+
+	connection = fd;
+    }
+
+    /**
+     * let all waiting requests fail, client_mutex has to be held
+     */
+    static void fail_pending() {
+	for (std::map< ::uint32_t, pending_request*>::iterator p = pending.begin(); p != pending.end(); ++p) {
+	    p->second->failed = true;
+	    p->second->done = true;
+	}
+	pending.clear();
+	response_ready.broadcast();
+    }
+
+    /**
+     * pass a received response to the request waiting for it
+     */
+    static void deliver(std::string const& payload) {
+	std::string::size_type position = 0;
+	::uint32_t id = 0;
+	if (!store_protocol::get_uint32(payload, position, id)) {
+	    return;
+	}
+
+	Glib::Mutex::Lock lock(client_mutex);
+	std::map< ::uint32_t, pending_request*>::iterator request = pending.find(id);
+	if (request == pending.end()) {
+	    // the request has timed out meanwhile
+	    return;
+	}
+	request->second->response.assign(payload, position, std::string::npos);
+	request->second->done = true;
+	pending.erase(request);
+	response_ready.broadcast();
+    }
+
+    /**
+     * the receiver thread
+     */
+    static void run_receiver() {
+	std::string received;
+
+	while (!g_atomic_int_get(&receiver_stopping)) {
+	    int fd = -1;
+	    {
+		Glib::Mutex::Lock lock(client_mutex);
+		fd = connection;
+	    }
+
+	    // wait for the next request to connect
+	    if (fd == -1) {
+		::poll(NULL, 0, STORE_POLL_INTERVAL_MS);
+		continue;
+	    }
+
+	    struct pollfd readable;
+	    std::memset(&readable, 0, sizeof(readable));
+	    readable.fd = fd;
+	    readable.events = POLLIN;
+	    if (::poll(&readable, 1, STORE_POLL_INTERVAL_MS) <= 0) {
+		continue;
+	    }
+
+	    char buffer[65536];
+	    ssize_t bytes_read = ::read(fd, buffer, sizeof(buffer));
+	    if (bytes_read < 0 && errno == EINTR) {
+		continue;
+	    }
+
+	    bool broken = bytes_read <= 0;
+	    if (!broken) {
+		received.append(buffer, bytes_read);
+		try {
+		    std::string payload;
+		    while (store_protocol::take_frame(received, payload)) {
+			deliver(payload);
+		    }
+		} catch (Glib::ustring) {
+		    broken = true;
+		}
+	    }
+
+	    // nobody must be sending on the connection while we close it
+	    if (broken) {
+		Glib::Mutex::Lock send_lock(send_mutex);
+		Glib::Mutex::Lock lock(client_mutex);
+		::close(fd);
+		connection = -1;
+		fail_pending();
+		received.erase();
+	    }
+	}
+    }
+
+    void store_client::start(std::string const& path, int cache_ttl) {
+	server_path = path;
+	cache_ttl_ms = cache_ttl;
+	g_atomic_int_set(&receiver_stopping, 0);
+	receiver_thread = Glib::Thread::create(sigc::ptr_fun(&run_receiver), true);
+    }
+
+    void store_client::flush_cache() {
+	Glib::Mutex::Lock lock(cache_mutex);
+	cache.clear();
+    }
+
+    void store_client::resize_cache(std::size_t max_entries) {
+	Glib::Mutex::Lock lock(cache_mutex);
+	cache_limit = max_entries;
+	if (cache.size() > cache_limit) {
+	    cache.clear();
+	}
+    }
+
+    std::size_t store_client::cached_entries() {
+	Glib::Mutex::Lock lock(cache_mutex);
+	return cache.size();
+    }
+
+    std::size_t store_client::cache_capacity() {
+	Glib::Mutex::Lock lock(cache_mutex);
+	return cache_ttl_ms > 0 ? cache_limit : 0;
+    }
+
+    void store_client::stop() {
+	if (!receiver_thread) {
+	    return;
+	}
+
+	g_atomic_int_set(&receiver_stopping, 1);
+	receiver_thread->join();
+	receiver_thread = NULL;
+
+	Glib::Mutex::Lock lock(client_mutex);
+	if (connection != -1) {
+	    ::close(connection);
+	    connection = -1;
+	}
+	fail_pending();
+    }
+
+    bool store_client::is_running() {
+	return receiver_thread != NULL;
+    }
+
+    store_client::store_client(int timeout_ms) : timeout_ms(timeout_ms < 0 ? STORE_DEFAULT_TIMEOUT_MS : timeout_ms) {
+    }
+
+    std::string store_client::call(std::string const& request) const {
+	pending_request waiting;
+	waiting.done = false;
+	waiting.failed = false;
+
+	::uint32_t id = 0;
+	{
+	    Glib::Mutex::Lock send_lock(send_mutex);
+
+	    int fd = -1;
+	    {
+		Glib::Mutex::Lock lock(client_mutex);
+		if (connection == -1) {
+		    connect_server();
+		}
+		id = next_id++;
+		pending[id] = &waiting;
+		fd = connection;
+	    }
+
+	    std::string payload;
+	    store_protocol::put_uint32(payload, id);
+	    payload.append(request);
+	    std::string frame;
+	    store_protocol::put_frame(frame, payload);
+
+	    // the responses of other requests are received meanwhile
+	    std::string::size_type sent = 0;
+	    while (sent < frame.length()) {
+		ssize_t bytes_sent = ::send(fd, frame.data() + sent, frame.length() - sent, MSG_NOSIGNAL);
+		if (bytes_sent < 0 && errno == EINTR) {
+		    continue;
+		}
+		if (bytes_sent <= 0) {
+		    Glib::ustring msg = Glib::ustring(N_("Could not send request to store server: ")) + std::strerror(errno);
+
+		    // let the receiver thread close the connection
+		    Glib::Mutex::Lock lock(client_mutex);
+		    pending.erase(id);
+		    ::shutdown(fd, SHUT_RDWR);
+		    throw msg;
+		}
+		sent += bytes_sent;
+	    }
+	}
+
+	Glib::Mutex::Lock lock(client_mutex);
+	Glib::TimeVal until;
+	until.assign_current_time();
+	until.add_milliseconds(timeout_ms);
+	while (!waiting.done) {
+	    if (!response_ready.timed_wait(client_mutex, until) && !waiting.done) {
+		pending.erase(id);
+		throw Glib::ustring(N_("Store server did not answer in time"));
+	    }
+	}
+	if (waiting.failed) {
+	    throw Glib::ustring(N_("Connection to store server lost"));
+	}
+
+	std::string::size_type position = 0;
+	::uint32_t status = 0;
+	if (!store_protocol::get_uint32(waiting.response, position, status)) {
+	    throw Glib::ustring(N_("Malformed response from store server"));
+	}
+	if (status != store_protocol::ok) {
+	    std::string message;
+	    store_protocol::get_string(waiting.response, position, message);
+	    throw Glib::ustring(N_("Store server failed: ")) + message;
+	}
+	return waiting.response.substr(position);
+    }
+
+    void store_client::fetch_entries(key const* keys, std::size_t count, entry* values) const {
+	// ask the server only for the keys we have not cached
+	std::vector<std::size_t> missing;
+	for (std::size_t i = 0; i < count; i++) {
+	    if (!cache_lookup(std::string(keys[i].data, keys[i].length), values[i])) {
+		missing.push_back(i);
+	    }
+	}
+	if (missing.empty()) {
+	    return;
+	}
+
+	std::string request;
+	store_protocol::put_uint32(request, store_protocol::fetch);
+	store_protocol::put_uint32(request, missing.size());
+	for (std::vector<std::size_t>::const_iterator p = missing.begin(); p != missing.end(); ++p) {
+	    store_protocol::put_string(request, std::string(keys[*p].data, keys[*p].length));
+	}
+
+	std::string const response = call(request);
+	std::string::size_type position = 0;
+	::uint32_t response_count = 0;
+	if (!store_protocol::get_uint32(response, position, response_count) || response_count != missing.size()) {
+	    throw Glib::ustring(N_("Malformed response from store server"));
+	}
+	for (std::vector<std::size_t>::const_iterator p = missing.begin(); p != missing.end(); ++p) {
+	    if (!store_protocol::get_entry(response, position, values[*p])) {
+		throw Glib::ustring(N_("Malformed response from store server"));
+	    }
+	    cache_store(std::string(keys[*p].data, keys[*p].length), values[*p]);
+	}
+    }
+
+    void store_client::store_entries(key const* keys, std::size_t count, entry const* values) {
+	std::string request;
+	store_protocol::put_uint32(request, store_protocol::store);
+	store_protocol::put_uint32(request, count);
+	for (std::size_t i = 0; i < count; i++) {
+	    store_protocol::put_string(request, std::string(keys[i].data, keys[i].length));
+	    store_protocol::put_entry(request, values[i]);
+	}
+
+	call(request);
+
+	for (std::size_t i = 0; i < count; i++) {
+	    cache_store(std::string(keys[i].data, keys[i].length), values[i]);
+	}
+    }
+}
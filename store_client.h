@@ -0,0 +1,139 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef STORE_CLIENT_H
+#define STORE_CLIENT_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+#include <entry_store.h>
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * access to the greylisting entries kept by a couriergrey-stored server
+     *
+     * All requests of the process share a single connection to the server. A
+     * request is sent as soon as it is made, without waiting for the responses
+     * to the requests of other threads; a receiver thread reads the responses
+     * and passes them to the waiting threads. The connection is established
+     * again by the next request after it has been lost.
+     *
+     * Fetched and stored entries are kept in a local cache for a short time, so
+     * that retries of a client do not always have to ask the server. Entries
+     * written by other clients of the server meanwhile are not seen before the
+     * cached entry expires.
+     */
+    class store_client : public entry_store {
+	public:
+	    /**
+	     * start the receiver thread
+	     *
+	     * @param path the location of the unix domain socket of the server
+	     * @param cache_ttl_ms how long entries are cached locally in milliseconds, 0 to not cache them
+	     */
+	    static void start(std::string const& path, int cache_ttl_ms);
+
+	    /**
+	     * stop the receiver thread and close the connection
+	     */
+	    static void stop();
+
+	    /**
+	     * check if the entries are kept by a server
+	     */
+	    static bool is_running();
+
+	    /**
+	     * drop all entries from the local cache
+	     */
+	    static void flush_cache();
+
+	    /**
+	     * change the maximum number of entries in the local cache
+	     *
+	     * The cache is flushed if it holds more entries.
+	     *
+	     * @param max_entries the new maximum, 0 to not cache entries anymore
+	     */
+	    static void resize_cache(std::size_t max_entries);
+
+	    /**
+	     * get the number of entries in the local cache
+	     */
+	    static std::size_t cached_entries();
+
+	    /**
+	     * get the maximum number of entries in the local cache, 0 if entries are not cached
+	     */
+	    static std::size_t cache_capacity();
+
+	    /**
+	     * create a client instance
+	     *
+	     * @param timeout_ms how long to wait for the server in milliseconds, -1 for the default
+	     */
+	    store_client(int timeout_ms = -1);
+
+	    using entry_store::fetch_entries;
+	    using entry_store::store_entries;
+
+	    /**
+	     * fetch the entries of several keys at once
+	     *
+	     * @throws Glib::ustring if the server cannot be reached or fails
+	     */
+	    void fetch_entries(key const* keys, std::size_t count, entry* values) const;
+
+	    /**
+	     * store the entries of several keys at once
+	     *
+	     * @throws Glib::ustring if the server cannot be reached or fails
+	     */
+	    void store_entries(key const* keys, std::size_t count, entry const* values);
+	private:
+	    /**
+	     * how long to wait for the server in milliseconds
+	     */
+	    int timeout_ms;
+
+	    /**
+	     * send a request and wait for its response
+	     *
+	     * @param request the request without its id
+	     * @return the response after its id and status
+	     * @throws Glib::ustring if the server cannot be reached or fails
+	     */
+	    std::string call(std::string const& request) const;
+    };
+}
+
+#endif // STORE_CLIENT_H
@@ -0,0 +1,124 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "store_protocol.h"
+#include <glibmm.h>
+
+namespace couriergrey {
+    void store_protocol::put_uint32(std::string& payload, ::uint32_t value) {
+	char bytes[4];
+	for (int i = 3; i >= 0; i--) {
+	    bytes[i] = static_cast<char>(value & 0xff);
+	    value >>= 8;
+	}
+	payload.append(bytes, sizeof(bytes));
+    }
+
+    void store_protocol::put_int64(std::string& payload, ::int64_t value) {
+	put_uint32(payload, static_cast< ::uint32_t>(static_cast< ::uint64_t>(value) >> 32));
+	put_uint32(payload, static_cast< ::uint32_t>(static_cast< ::uint64_t>(value) & 0xffffffffULL));
+    }
+
+    void store_protocol::put_string(std::string& payload, std::string const& value) {
+	put_uint32(payload, value.length());
+	payload.append(value);
+    }
+
+    void store_protocol::put_entry(std::string& payload, entry_store::entry const& value) {
+	put_int64(payload, value.first_connect);
+	put_int64(payload, value.last_connect);
+	put_string(payload, value.client_network);
+    }
+
+    bool store_protocol::get_uint32(std::string const& payload, std::string::size_type& position, ::uint32_t& value) {
+	if (payload.length() < 4 || position > payload.length() - 4) {
+	    return false;
+	}
+
+	value = 0;
+	for (int i = 0; i < 4; i++) {
+	    value = (value << 8) | static_cast<unsigned char>(payload[position++]);
+	}
+	return true;
+    }
+
+    bool store_protocol::get_int64(std::string const& payload, std::string::size_type& position, ::int64_t& value) {
+	::uint32_t high = 0;
+	::uint32_t low = 0;
+	if (!get_uint32(payload, position, high) || !get_uint32(payload, position, low)) {
+	    return false;
+	}
+
+	value = static_cast< ::int64_t>((static_cast< ::uint64_t>(high) << 32) | low);
+	return true;
+    }
+
+    bool store_protocol::get_string(std::string const& payload, std::string::size_type& position, std::string& value) {
+	::uint32_t length = 0;
+	if (!get_uint32(payload, position, length) || length > payload.length() - position) {
+	    return false;
+	}
+
+	value.assign(payload, position, length);
+	position += length;
+	return true;
+    }
+
+    bool store_protocol::get_entry(std::string const& payload, std::string::size_type& position, entry_store::entry& value) {
+	::int64_t first_connect = 0;
+	::int64_t last_connect = 0;
+	if (!get_int64(payload, position, first_connect) || !get_int64(payload, position, last_connect) || !get_string(payload, position, value.client_network)) {
+	    return false;
+	}
+
+	value.first_connect = first_connect;
+	value.last_connect = last_connect;
+	return true;
+    }
+
+    void store_protocol::put_frame(std::string& output, std::string const& payload) {
+	put_uint32(output, payload.length());
+	output.append(payload);
+    }
+
+    bool store_protocol::take_frame(std::string& received, std::string& payload) {
+	std::string::size_type position = 0;
+	::uint32_t length = 0;
+	if (!get_uint32(received, position, length)) {
+	    return false;
+	}
+	if (length > STORE_MAX_FRAME_LENGTH) {
+	    throw Glib::ustring(N_("Received a frame longer than allowed"));
+	}
+	if (received.length() - position < length) {
+	    return false;
+	}
+
+	payload.assign(received, position, length);
+	received.erase(0, position + length);
+	return true;
+    }
+}
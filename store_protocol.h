@@ -0,0 +1,150 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef STORE_PROTOCOL_H
+#define STORE_PROTOCOL_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <string>
+#include <stdint.h>
+
+#include <entry_store.h>
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+/**
+ * maximum length of a frame we accept, in bytes
+ */
+#define STORE_MAX_FRAME_LENGTH (16 * 1024 * 1024)
+
+namespace couriergrey {
+    /**
+     * encoding of the messages between the store_client and couriergrey-stored
+     *
+     * Each message is a frame: a 32 bit length followed by that many bytes of
+     * payload. All integers are in network byte order, strings are a 32 bit
+     * length followed by the bytes.
+     *
+     * A request consists of its id, the operation and the number of keys,
+     * followed by the keys (fetch) or by the keys each followed by its entry
+     * (store). A response consists of the id of its request and the status;
+     * the status ok is followed by the number of entries and the entries (fetch)
+     * or nothing (store), the status error by a message.
+     *
+     * Clients may send further requests before the responses to their previous
+     * ones have been received; the responses are sent in the order of the
+     * requests. An entry is encoded as first_connect and last_connect (64 bit
+     * each) and client_network.
+     */
+    class store_protocol {
+	public:
+	    /**
+	     * the operations of a request
+	     */
+	    enum operation {
+		fetch = 1,	/**< fetch the entries of keys */
+		store = 2	/**< store the entries of keys */
+	    };
+
+	    /**
+	     * the status of a response
+	     */
+	    enum status {
+		ok = 0,		/**< the request has been executed */
+		error = 1	/**< the request failed, a message follows */
+	    };
+
+	    /**
+	     * append a 32 bit integer to a payload
+	     */
+	    static void put_uint32(std::string& payload, ::uint32_t value);
+
+	    /**
+	     * append a 64 bit integer to a payload
+	     */
+	    static void put_int64(std::string& payload, ::int64_t value);
+
+	    /**
+	     * append a string to a payload
+	     */
+	    static void put_string(std::string& payload, std::string const& value);
+
+	    /**
+	     * append an entry to a payload
+	     */
+	    static void put_entry(std::string& payload, entry_store::entry const& value);
+
+	    /**
+	     * read a 32 bit integer from a payload
+	     *
+	     * @param position where to read, advanced behind the value
+	     * @return false if the payload is too short
+	     */
+	    static bool get_uint32(std::string const& payload, std::string::size_type& position, ::uint32_t& value);
+
+	    /**
+	     * read a 64 bit integer from a payload
+	     *
+	     * @param position where to read, advanced behind the value
+	     * @return false if the payload is too short
+	     */
+	    static bool get_int64(std::string const& payload, std::string::size_type& position, ::int64_t& value);
+
+	    /**
+	     * read a string from a payload
+	     *
+	     * @param position where to read, advanced behind the value
+	     * @return false if the payload is too short
+	     */
+	    static bool get_string(std::string const& payload, std::string::size_type& position, std::string& value);
+
+	    /**
+	     * read an entry from a payload
+	     *
+	     * @param position where to read, advanced behind the value
+	     * @return false if the payload is too short
+	     */
+	    static bool get_entry(std::string const& payload, std::string::size_type& position, entry_store::entry& value);
+
+	    /**
+	     * append a payload as a frame to the data to send
+	     */
+	    static void put_frame(std::string& output, std::string const& payload);
+
+	    /**
+	     * take the first complete frame from received data
+	     *
+	     * @param received the data received so far, the frame is removed from it
+	     * @param payload where to store the payload of the frame
+	     * @return true if there has been a complete frame
+	     * @throws Glib::ustring if the frame is longer than allowed
+	     */
+	    static bool take_frame(std::string& received, std::string& payload);
+    };
+}
+
+#endif // STORE_PROTOCOL_H
@@ -0,0 +1,455 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+/*
+ * store_test: start couriergrey-stored in a scratch directory and check the
+ * store protocol and the store_client against it, run by "make check"
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "store_client.h"
+#include "store_protocol.h"
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <glibmm.h>
+
+/**
+ * how long we wait for the server to create its socket, in milliseconds
+ */
+#define TEST_STARTUP_TIMEOUT_MS 5000
+
+/**
+ * how long we wait for the server to answer, in milliseconds
+ */
+#define TEST_RESPONSE_TIMEOUT_MS 5000
+
+/**
+ * number of threads sharing the connection of the store_client
+ */
+#define TEST_THREADS 8
+
+/**
+ * number of requests each thread sends
+ */
+#define TEST_ROUNDS 50
+
+using couriergrey::store_protocol;
+using couriergrey::store_client;
+using couriergrey::entry_store;
+
+/**
+ * number of failed checks
+ */
+static int failures = 0;
+
+/**
+ * protecting failures, checks are done by several threads
+ */
+static Glib::Mutex failures_mutex;
+
+/**
+ * count and report a failed check
+ */
+static void check(bool condition, std::string const& what) {
+    if (!condition) {
+	Glib::Mutex::Lock lock(failures_mutex);
+	std::cerr << "FAIL: " << what << std::endl;
+	failures++;
+    }
+}
+
+/**
+ * connect to the socket of the server
+ *
+ * @return the connected socket, -1 if the server cannot be reached
+ */
+static int connect_server(std::string const& path) {
+    int fd = ::socket(PF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+	return -1;
+    }
+
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+    if (::connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr))) {
+	::close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+/**
+ * start couriergrey-stored and wait until it accepts connections
+ *
+ * @return the process id of the server, -1 if it could not be started
+ */
+static pid_t start_server(std::string const& program, std::string const& directory, std::string const& socket_path) {
+    pid_t server = ::fork();
+    if (server == -1) {
+	return -1;
+    }
+    if (server == 0) {
+	std::string const socket_option = "--socket=" + socket_path;
+	std::string const directory_option = "--databasedir=" + directory;
+	::execl(program.c_str(), program.c_str(), socket_option.c_str(), directory_option.c_str(), static_cast<char*>(NULL));
+	std::cerr << "Could not execute " << program << ": " << std::strerror(errno) << std::endl;
+	::_exit(1);
+    }
+
+    for (int waited_ms = 0; waited_ms < TEST_STARTUP_TIMEOUT_MS; waited_ms += 10) {
+	int fd = connect_server(socket_path);
+	if (fd != -1) {
+	    ::close(fd);
+	    return server;
+	}
+	if (::waitpid(server, NULL, WNOHANG) == server) {
+	    return -1;
+	}
+	::usleep(10000);
+    }
+
+    ::kill(server, SIGKILL);
+    ::waitpid(server, NULL, 0);
+    return -1;
+}
+
+/**
+ * stop couriergrey-stored
+ *
+ * @return true if the server exited normally
+ */
+static bool stop_server(pid_t server) {
+    int status = 0;
+    ::kill(server, SIGTERM);
+    return ::waitpid(server, &status, 0) == server && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * read a frame from a connection to the server
+ *
+ * @return false if the connection has been closed before a frame has been complete
+ */
+static bool read_frame(int fd, std::string& received, std::string& payload) {
+    while (!store_protocol::take_frame(received, payload)) {
+	struct pollfd readable;
+	std::memset(&readable, 0, sizeof(readable));
+	readable.fd = fd;
+	readable.events = POLLIN;
+	if (::poll(&readable, 1, TEST_RESPONSE_TIMEOUT_MS) <= 0) {
+	    return false;
+	}
+
+	char buffer[4096];
+	ssize_t bytes_read = ::read(fd, buffer, sizeof(buffer));
+	if (bytes_read <= 0) {
+	    return false;
+	}
+	received.append(buffer, bytes_read);
+    }
+    return true;
+}
+
+/**
+ * write all data to a connection
+ */
+static bool write_all(int fd, std::string const& data) {
+    return ::write(fd, data.data(), data.length()) == static_cast<ssize_t>(data.length());
+}
+
+/**
+ * format a key used by the tests
+ */
+static std::string test_key(char const* prefix, int number) {
+    std::ostringstream key;
+    key << prefix << number;
+    return key.str();
+}
+
+/**
+ * check the encoding of the protocol, without a server
+ */
+static void test_encoding() {
+    entry_store::entry value;
+    value.first_connect = 1234567890;
+    value.last_connect = -1;
+    value.client_network = "192.0.2.0/24";
+
+    std::string payload;
+    store_protocol::put_uint32(payload, 42);
+    store_protocol::put_string(payload, "key");
+    store_protocol::put_entry(payload, value);
+
+    std::string received;
+    store_protocol::put_frame(received, payload);
+    store_protocol::put_frame(received, "second");
+
+    // a frame is only taken when it is complete
+    std::string partial = received.substr(0, 10);
+    std::string taken;
+    check(!store_protocol::take_frame(partial, taken) && partial.length() == 10, "incomplete frame is kept");
+
+    check(store_protocol::take_frame(received, taken) && taken == payload, "frame is taken");
+    std::string::size_type position = 0;
+    ::uint32_t id = 0;
+    std::string key;
+    entry_store::entry decoded;
+    check(store_protocol::get_uint32(taken, position, id) && id == 42, "integer is decoded");
+    check(store_protocol::get_string(taken, position, key) && key == "key", "string is decoded");
+    check(store_protocol::get_entry(taken, position, decoded) && decoded.first_connect == value.first_connect && decoded.last_connect == value.last_connect && decoded.client_network == value.client_network, "entry is decoded");
+    check(position == taken.length(), "payload is consumed");
+    check(store_protocol::take_frame(received, taken) && taken == "second" && received.empty(), "second frame is taken");
+
+    // a string claiming more bytes than there are
+    std::string truncated;
+    store_protocol::put_string(truncated, "truncated");
+    truncated.erase(truncated.length() - 1);
+    position = 0;
+    check(!store_protocol::get_string(truncated, position, key), "truncated string is rejected");
+    position = 0;
+    check(!store_protocol::get_uint32(std::string("abc"), position, id), "truncated integer is rejected");
+
+    // a frame longer than allowed
+    std::string oversized;
+    store_protocol::put_uint32(oversized, STORE_MAX_FRAME_LENGTH + 1);
+    bool thrown = false;
+    try {
+	store_protocol::take_frame(oversized, taken);
+    } catch (Glib::ustring) {
+	thrown = true;
+    }
+    check(thrown, "oversized frame is rejected");
+}
+
+/**
+ * send several requests before reading the responses, on a connection of our own
+ */
+static void test_pipelined_requests(std::string const& socket_path) {
+    int fd = connect_server(socket_path);
+    check(fd != -1, "connect to the server");
+    if (fd == -1) {
+	return;
+    }
+
+    entry_store::entry value;
+    value.first_connect = 1000;
+    value.last_connect = 2000;
+    value.client_network = "198.51.100.7/32";
+
+    std::string requests;
+    std::string request;
+    store_protocol::put_uint32(request, 1);
+    store_protocol::put_uint32(request, store_protocol::store);
+    store_protocol::put_uint32(request, 1);
+    store_protocol::put_string(request, "pipelined");
+    store_protocol::put_entry(request, value);
+    store_protocol::put_frame(requests, request);
+
+    request.erase();
+    store_protocol::put_uint32(request, 2);
+    store_protocol::put_uint32(request, store_protocol::fetch);
+    store_protocol::put_uint32(request, 1);
+    store_protocol::put_string(request, "pipelined");
+    store_protocol::put_frame(requests, request);
+
+    // a key whose length exceeds the request, answered with an error
+    request.erase();
+    store_protocol::put_uint32(request, 3);
+    store_protocol::put_uint32(request, store_protocol::fetch);
+    store_protocol::put_uint32(request, 1);
+    store_protocol::put_uint32(request, 100);
+    request.append("abc");
+    store_protocol::put_frame(requests, request);
+
+    check(write_all(fd, requests), "send pipelined requests");
+
+    std::string received;
+    std::string response;
+    std::string::size_type position = 0;
+    ::uint32_t id = 0;
+    ::uint32_t status = 0;
+    ::uint32_t count = 0;
+    check(read_frame(fd, received, response) && store_protocol::get_uint32(response, position, id) && store_protocol::get_uint32(response, position, status) && id == 1 && status == store_protocol::ok, "store is answered first");
+
+    position = 0;
+    entry_store::entry fetched;
+    check(read_frame(fd, received, response) && store_protocol::get_uint32(response, position, id) && store_protocol::get_uint32(response, position, status) && id == 2 && status == store_protocol::ok
+	    && store_protocol::get_uint32(response, position, count) && count == 1 && store_protocol::get_entry(response, position, fetched), "fetch is answered second");
+    check(fetched.first_connect == value.first_connect && fetched.last_connect == value.last_connect && fetched.client_network == value.client_network, "fetch returns the stored entry");
+
+    position = 0;
+    check(read_frame(fd, received, response) && store_protocol::get_uint32(response, position, id) && store_protocol::get_uint32(response, position, status) && id == 3 && status == store_protocol::error, "truncated key is answered with an error");
+
+    // the connection is dropped after a frame longer than allowed
+    std::string oversized;
+    store_protocol::put_uint32(oversized, STORE_MAX_FRAME_LENGTH + 1);
+    check(write_all(fd, oversized), "send oversized frame");
+    check(!read_frame(fd, received, response), "connection is closed after an oversized frame");
+
+    ::close(fd);
+}
+
+/**
+ * store and fetch entries of a thread using the shared connection of the store_client
+ */
+static void run_client_thread(int thread) {
+    for (int round = 0; round < TEST_ROUNDS; round++) {
+	std::vector<std::string> keys;
+	keys.push_back(test_key("thread", thread * TEST_ROUNDS + round));
+	keys.push_back(test_key("other", thread * TEST_ROUNDS + round));
+
+	try {
+	    store_client store(TEST_RESPONSE_TIMEOUT_MS);
+	    std::vector<entry_store::entry> values = store.fetch_entries(keys);
+	    check(values.size() == keys.size(), "fetch returns an entry for each key");
+	    if (values.size() != keys.size()) {
+		return;
+	    }
+	    for (std::vector<entry_store::entry>::iterator p = values.begin(); p != values.end(); ++p) {
+		p->first_connect = thread;
+		p->last_connect = round;
+		p->client_network = keys[0];
+	    }
+	    store.store_entries(keys, values);
+
+	    values = store.fetch_entries(keys);
+	    check(values.size() == keys.size() && values[1].first_connect == thread && values[1].last_connect == round && values[1].client_network == keys[0], "fetch returns what the thread stored");
+	} catch (Glib::ustring msg) {
+	    check(false, "store_client request: " + msg);
+	}
+    }
+}
+
+/**
+ * let several threads use the store_client at the same time
+ */
+static void test_concurrent_clients() {
+    std::vector<Glib::Thread*> threads;
+    for (int thread = 0; thread < TEST_THREADS; thread++) {
+	threads.push_back(Glib::Thread::create(sigc::bind(sigc::ptr_fun(&run_client_thread), thread), true));
+    }
+    for (std::vector<Glib::Thread*>::iterator p = threads.begin(); p != threads.end(); ++p) {
+	(*p)->join();
+    }
+}
+
+/**
+ * fetch an entry after the server has been restarted
+ *
+ * The request noticing the lost connection may fail, the next one has to succeed.
+ */
+static bool fetch_after_restart(std::string const& key, entry_store::entry& value) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+	try {
+	    store_client store(TEST_RESPONSE_TIMEOUT_MS);
+	    value = store.fetch_entries(std::vector<std::string>(1, key)).at(0);
+	    return true;
+	} catch (Glib::ustring) {
+	}
+    }
+    return false;
+}
+
+/**
+ * remove the scratch directory and the files the server created in it
+ */
+static void remove_directory(std::string const& directory) {
+    DIR* files = ::opendir(directory.c_str());
+    if (files) {
+	for (struct dirent* file = ::readdir(files); file; file = ::readdir(files)) {
+	    if (std::strcmp(file->d_name, ".") && std::strcmp(file->d_name, "..")) {
+		::unlink((directory + "/" + file->d_name).c_str());
+	    }
+	}
+	::closedir(files);
+    }
+    if (::rmdir(directory.c_str())) {
+	std::cerr << "Could not remove " << directory << ": " << std::strerror(errno) << std::endl;
+    }
+}
+
+int main() {
+    // the server built together with us, unless told otherwise
+    char const* program = std::getenv("COURIERGREY_STORED");
+    if (!program) {
+	program = "./couriergrey-stored";
+    }
+
+    char const* temp_directory = std::getenv("TMPDIR");
+    std::string directory = std::string(temp_directory ? temp_directory : "/tmp") + "/couriergrey-test.XXXXXX";
+    if (!::mkdtemp(&directory[0])) {
+	std::cerr << "Could not create scratch directory: " << std::strerror(errno) << std::endl;
+	return 1;
+    }
+    std::string const socket_path = directory + "/store";
+
+    Glib::thread_init();
+
+    test_encoding();
+
+    pid_t server = start_server(program, directory, socket_path);
+    check(server != -1, "start couriergrey-stored");
+    if (server != -1) {
+	test_pipelined_requests(socket_path);
+
+	store_client::start(socket_path, 0);
+	test_concurrent_clients();
+
+	// the entries are kept by the database, the client connects again
+	check(stop_server(server), "couriergrey-stored exits on SIGTERM");
+	server = start_server(program, directory, socket_path);
+	check(server != -1, "restart couriergrey-stored");
+
+	entry_store::entry value;
+	check(fetch_after_restart(test_key("other", 3 * TEST_ROUNDS + 7), value) && value.first_connect == 3 && value.last_connect == 7, "entry is fetched after the server has been restarted");
+	store_client::stop();
+
+	if (server != -1) {
+	    check(stop_server(server), "couriergrey-stored exits on SIGTERM after restart");
+	}
+    }
+
+    remove_directory(directory);
+
+    if (failures) {
+	std::cerr << failures << " checks failed" << std::endl;
+	return 1;
+    }
+    std::cout << "all checks passed" << std::endl;
+    return 0;
+}
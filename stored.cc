@@ -0,0 +1,425 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+/*
+ * couriergrey-stored: keep the greylisting entries for the couriergrey filters
+ * of several mail exchangers, which access them using their store_client
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "timestore.h"
+#include "store_protocol.h"
+#include "database.h"
+#include <iostream>
+#include <vector>
+#include <list>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <popt.h>
+#include <glibmm.h>
+
+/**
+ * listen backlog of the store socket
+ */
+#define STORE_SOCKET_BACKLOG 64
+
+/**
+ * how long a batch tries to open the database, in milliseconds
+ *
+ * All clients wait while we do, so a database locked by a maintenance run fails
+ * the batch instead of blocking the server.
+ */
+#define STORED_OPEN_TIMEOUT_MS 1000
+
+/**
+ * a connection of a client
+ */
+struct store_connection {
+    /**
+     * the socket of the connection
+     */
+    int fd;
+
+    /**
+     * data received that does not form a complete request yet
+     */
+    std::string received;
+
+    /**
+     * responses not yet sent
+     */
+    std::string output;
+
+    /**
+     * if the client closed the connection or the connection failed
+     */
+    bool closing;
+};
+
+/**
+ * a request taken from a connection
+ */
+struct store_request {
+    /**
+     * the connection the request has been received on
+     */
+    store_connection* connection;
+
+    /**
+     * the payload of the request
+     */
+    std::string payload;
+};
+
+/**
+ * set by the signal handler when we should stop
+ */
+static volatile std::sig_atomic_t terminate_requested = 0;
+
+/**
+ * signal handler for SIGTERM and SIGINT
+ */
+static void terminate_request(int) {
+    terminate_requested = 1;
+}
+
+/**
+ * install a signal handler
+ */
+static void install_handler(int signum, void (*handler)(int)) {
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = handler;
+    ::sigemptyset(&action.sa_mask);
+    ::sigaction(signum, &action, NULL);
+}
+
+/**
+ * create the listening socket, accessible by the user and the group running couriergrey-stored
+ */
+static int create_socket(std::string const& path) {
+    struct sockaddr_un addr;
+    if (path.length() >= sizeof(addr.sun_path)) {
+	throw Glib::ustring(N_("Store socket name to long: ")) + path;
+    }
+
+    // remove a socket left over by a previous instance
+    if (::unlink(path.c_str()) && errno != ENOENT) {
+	throw Glib::ustring(N_("Problem creating store socket at location ")) + path + ": " + std::strerror(errno);
+    }
+
+    int fd = ::socket(PF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+	throw Glib::ustring(N_("Problem creating a unix domain socket: ")) + std::strerror(errno);
+    }
+
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+    if (::bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr))
+	    || ::chmod(path.c_str(), S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)
+	    || ::listen(fd, STORE_SOCKET_BACKLOG)
+	    || ::fcntl(fd, F_SETFL, O_NONBLOCK)) {
+	Glib::ustring msg = Glib::ustring(N_("Could not create store socket ")) + path + ": " + std::strerror(errno);
+	::close(fd);
+	throw msg;
+    }
+
+    return fd;
+}
+
+/**
+ * format an error response
+ */
+static std::string error_response(::uint32_t id, std::string const& message) {
+    std::string response;
+    couriergrey::store_protocol::put_uint32(response, id);
+    couriergrey::store_protocol::put_uint32(response, couriergrey::store_protocol::error);
+    couriergrey::store_protocol::put_string(response, message);
+    return response;
+}
+
+/**
+ * execute a request
+ *
+ * @param db the database, NULL if it could not be opened
+ * @param open_error why the database could not be opened
+ * @return the response, empty if the request is too malformed to be answered
+ */
+static std::string execute(couriergrey::timestore* db, Glib::ustring const& open_error, std::string const& request) {
+    using couriergrey::store_protocol;
+
+    std::string::size_type position = 0;
+    ::uint32_t id = 0;
+    ::uint32_t operation = 0;
+    ::uint32_t count = 0;
+    if (!store_protocol::get_uint32(request, position, id)) {
+	return std::string();
+    }
+    if (!store_protocol::get_uint32(request, position, operation) || !store_protocol::get_uint32(request, position, count) || count > request.length()) {
+	return error_response(id, "malformed request");
+    }
+    if (!db) {
+	return error_response(id, open_error);
+    }
+
+    std::vector<std::string> keys(count);
+    std::vector<couriergrey::timestore::entry> values;
+    if (operation == store_protocol::store) {
+	values.resize(count);
+    }
+    for (::uint32_t i = 0; i < count; i++) {
+	if (!store_protocol::get_string(request, position, keys[i]) || (operation == store_protocol::store && !store_protocol::get_entry(request, position, values[i]))) {
+	    return error_response(id, "malformed request");
+	}
+    }
+
+    try {
+	std::string response;
+	store_protocol::put_uint32(response, id);
+	if (operation == store_protocol::fetch) {
+	    values = db->fetch_entries(keys);
+	    store_protocol::put_uint32(response, store_protocol::ok);
+	    store_protocol::put_uint32(response, values.size());
+	    for (std::vector<couriergrey::timestore::entry>::const_iterator p = values.begin(); p != values.end(); ++p) {
+		store_protocol::put_entry(response, *p);
+	    }
+	} else if (operation == store_protocol::store) {
+	    db->store_entries(keys, values);
+	    store_protocol::put_uint32(response, store_protocol::ok);
+	} else {
+	    return error_response(id, "unknown operation");
+	}
+	return response;
+    } catch (Glib::ustring msg) {
+	return error_response(id, msg);
+    }
+}
+
+/**
+ * execute a batch of requests using a single open of the database
+ */
+static void execute_batch(std::vector<store_request> const& batch) {
+    couriergrey::timestore* db = NULL;
+    Glib::ustring open_error;
+    try {
+	db = new couriergrey::timestore(STORED_OPEN_TIMEOUT_MS);
+    } catch (Glib::ustring msg) {
+	open_error = msg;
+    }
+
+    for (std::vector<store_request>::const_iterator p = batch.begin(); p != batch.end(); ++p) {
+	std::string const response = execute(db, open_error, p->payload);
+	if (response.empty()) {
+	    p->connection->closing = true;
+	    continue;
+	}
+	couriergrey::store_protocol::put_frame(p->connection->output, response);
+    }
+
+    delete db;
+}
+
+/**
+ * read what a client has sent
+ */
+static void receive(store_connection& connection) {
+    for (;;) {
+	char buffer[65536];
+	ssize_t bytes_read = ::read(connection.fd, buffer, sizeof(buffer));
+	if (bytes_read < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (bytes_read < 0 && errno == EAGAIN) {
+	    return;
+	}
+	if (bytes_read <= 0) {
+	    connection.closing = true;
+	    return;
+	}
+	connection.received.append(buffer, bytes_read);
+    }
+}
+
+/**
+ * send as much of the responses to a client as possible without blocking
+ */
+static void transmit(store_connection& connection) {
+    while (!connection.output.empty()) {
+	ssize_t bytes_sent = ::send(connection.fd, connection.output.data(), connection.output.length(), MSG_NOSIGNAL);
+	if (bytes_sent < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (bytes_sent < 0 && errno == EAGAIN) {
+	    return;
+	}
+	if (bytes_sent <= 0) {
+	    connection.closing = true;
+	    connection.output.erase();
+	    return;
+	}
+	connection.output.erase(0, bytes_sent);
+    }
+}
+
+int main(int argc, char const** argv) {
+    char const* socket_location = LOCALSTATEDIR "/cache/" PACKAGE "/store";
+    char const* database_options = "defaults";
+    char const* database_directory = NULL;
+    int max_batch = 256;
+    int ret = 0;
+
+    struct poptOption options[] = {
+	{ "socket", 's', POPT_ARG_STRING, &socket_location, 0, N_("location of the store socket"), "path"},
+	{ "databasedir", 0, POPT_ARG_STRING, &database_directory, 0, N_("directory of the greylisting database and the client index"), "path"},
+	{ "dboptions", 0, POPT_ARG_STRING, &database_options, 0, N_("storage parameters of the database (blocksize=, cachesize=, sync, nommap, preread, ownlock)"), "options"},
+	{ "maxbatch", 0, POPT_ARG_INT, &max_batch, 0, N_("maximum number of requests executed using a single open of the database"), "requests"},
+	POPT_AUTOHELP
+	POPT_TABLEEND
+    };
+
+    Glib::thread_init();
+
+    poptContext pCtx = poptGetContext(NULL, argc, argv, options, 0);
+    while ((ret = poptGetNextOpt(pCtx)) >= 0) {
+    }
+    if (ret < -1) {
+	std::cout << poptBadOption(pCtx, POPT_BADOPTION_NOALIAS) << ": " << poptStrerror(ret) << std::endl;
+	return 1;
+    }
+    if (max_batch < 1) {
+	std::cout << N_("The batch size has to be positive") << std::endl;
+	return 1;
+    }
+
+    int listening = -1;
+    try {
+	couriergrey::database::tune(couriergrey::database_tuning(database_options));
+	if (database_directory) {
+	    couriergrey::database::set_directory(database_directory);
+	}
+	listening = create_socket(socket_location);
+    } catch (Glib::ustring msg) {
+	std::cerr << msg << std::endl;
+	return 1;
+    }
+
+    install_handler(SIGTERM, terminate_request);
+    install_handler(SIGINT, terminate_request);
+
+    // keep the client index up to date in the background, not while answering requests
+    couriergrey::client_index::start_updater();
+
+    std::list<store_connection> connections;
+    while (!terminate_requested) {
+	// wait for requests, and for clients to take their responses
+	std::vector<struct pollfd> fds(1);
+	std::memset(&fds[0], 0, sizeof(fds[0]));
+	fds[0].fd = listening;
+	fds[0].events = POLLIN;
+	for (std::list<store_connection>::const_iterator p = connections.begin(); p != connections.end(); ++p) {
+	    struct pollfd connection_fd;
+	    std::memset(&connection_fd, 0, sizeof(connection_fd));
+	    connection_fd.fd = p->fd;
+	    connection_fd.events = (p->closing ? 0 : POLLIN) | (p->output.empty() ? 0 : POLLOUT);
+	    fds.push_back(connection_fd);
+	}
+	if (::poll(&fds[0], fds.size(), -1) <= 0) {
+	    continue;
+	}
+
+	// read from all clients that sent something
+	std::vector<struct pollfd>::const_iterator ready = fds.begin() + 1;
+	for (std::list<store_connection>::iterator p = connections.begin(); p != connections.end(); ++p, ++ready) {
+	    if (ready->revents & (POLLIN | POLLHUP | POLLERR)) {
+		receive(*p);
+	    }
+	}
+
+	// accept new clients
+	if (fds[0].revents & POLLIN) {
+	    int accepted = -1;
+	    while ((accepted = ::accept(listening, NULL, 0)) != -1) {
+		::fcntl(accepted, F_SETFL, O_NONBLOCK);
+		store_connection connection;
+		connection.fd = accepted;
+		connection.closing = false;
+		connections.push_back(connection);
+		receive(connections.back());
+	    }
+	}
+
+	// execute the requests of all clients together, in the order each client sent them
+	std::vector<store_request> batch;
+	for (std::list<store_connection>::iterator p = connections.begin(); p != connections.end(); ++p) {
+	    try {
+		store_request request;
+		request.connection = &*p;
+		while (couriergrey::store_protocol::take_frame(p->received, request.payload)) {
+		    batch.push_back(request);
+		    if (batch.size() >= static_cast<std::vector<store_request>::size_type>(max_batch)) {
+			execute_batch(batch);
+			batch.clear();
+		    }
+		}
+	    } catch (Glib::ustring) {
+		// a client not speaking our protocol
+		p->closing = true;
+		p->received.erase();
+	    }
+	}
+	if (!batch.empty()) {
+	    execute_batch(batch);
+	}
+
+	// send the responses, and drop the clients that are gone
+	for (std::list<store_connection>::iterator p = connections.begin(); p != connections.end(); ) {
+	    transmit(*p);
+	    if (p->closing && p->output.empty()) {
+		::close(p->fd);
+		connections.erase(p++);
+	    } else {
+		++p;
+	    }
+	}
+    }
+
+    for (std::list<store_connection>::iterator p = connections.begin(); p != connections.end(); ++p) {
+	::close(p->fd);
+    }
+    ::close(listening);
+    ::unlink(socket_location);
+    couriergrey::client_index::stop_updater();
+
+    return 0;
+}
@@ -25,59 +25,298 @@
 #endif
 
 #include "timestore.h"
+#include "commit_queue.h"
+#include "decision_log.h"
+#include "triplet_cache.h"
+#include "probes.h"
 #include <iostream>
 #include <sstream>
+#include <ctime>
+
+/**
+ * how many entries online expiry deletes while holding the database
+ */
+#define EXPIRE_BATCH_SIZE 100
+
+/**
+ * pause between two batches of online expiry, in milliseconds
+ */
+#define EXPIRE_BATCH_PAUSE_MS 100
+
+/**
+ * how long online expiry tries to open the database for a batch, in milliseconds
+ */
+#define EXPIRE_OPEN_TIMEOUT_MS 1000
 
 namespace couriergrey {
  
-    timestore::timestore() {
+    timestore::timestore(int open_timeout_ms) : db(open_timeout_ms, database::writer), index(false, open_timeout_ms) {
+    }
+
+    timestore::timestore(database::open_mode mode, int open_timeout_ms) : db(open_timeout_ms, mode), index(mode != database::writer, open_timeout_ms) {
     }
 
     timestore::~timestore() {
+	if (index_updates.empty()) {
+	    return;
+	}
+
+	// other writers need not wait for the index
+	db.close();
+
+	// nobody needs to wait for the index if it is updated in the background
+	if (client_index::updater_running()) {
+	    client_index::enqueue(index_updates);
+	    return;
+	}
+
+	try {
+	    index.update(index_updates);
+	} catch (Glib::ustring msg) {
+	    // the index can be rebuilt, the entries are what counts
+	    decision_log::notice("Could not update the client index: %s", msg.c_str());
+	}
+    }
+
+    void timestore::update_index(std::string const& client_network, std::string const& key, bool added) {
+	client_index::change update;
+	update.client_network = client_network;
+	update.key = key;
+	update.added = added;
+	index_updates.push_back(update);
     }
 
     std::pair<std::time_t, std::time_t> timestore::fetch(std::string const& key) const {
+	entry result = fetch_entry(key);
+
+	return std::pair<std::time_t, std::time_t>(result.first_connect, result.last_connect);
+    }
+
+    void timestore::fetch_entries(key const* keys, std::size_t count, entry* values) const {
+	for (std::size_t i = 0; i < count; i++) {
+	    std::string const name(keys[i].data, keys[i].length);
+	    values[i] = fetch_entry(name);
+	    fetched_networks[name] = values[i].client_network;
+	}
+    }
+
+    timestore::entry timestore::fetch_entry(std::string const& key) const {
+	entry result;
+
 	std::string database_value = db.fetch(key);
+	COURIERGREY_PROBE2(timestore_fetch, key.length(), database_value.empty() ? 0 : 1);
 
 	if (database_value.empty()) {
-	    std::time_t now = std::time(NULL);
-	    return std::pair<std::time_t, std::time_t>(now, now);
+	    result.first_connect = result.last_connect = std::time(NULL);
+	    return result;
 	}
 
 	std::istringstream value_stream(database_value);
-	
-	std::time_t first_connect;
-	std::time_t last_connect;
 
-	value_stream >> first_connect;
-	value_stream >> last_connect;
+	value_stream >> result.first_connect;
+	value_stream >> result.last_connect;
+	value_stream >> result.client_network;
 
-	return std::pair<std::time_t, std::time_t>(first_connect, last_connect);
+	return result;
     }
 
-    void timestore::store(std::string const& key, std::time_t first_connect, std::time_t last_connect) {
+    void timestore::store(std::string const& key, std::time_t first_connect, std::time_t last_connect, std::string const& client_network) {
+	COURIERGREY_PROBE2(timestore_store, key.length(), 0);
+
 	std::ostringstream value_stream;
 	value_stream << first_connect << ' ' << last_connect;
+	if (!client_network.empty()) {
+	    value_stream << ' ' << client_network;
+	}
 	db.store(key, value_stream.str());
+
+	if (triplet_cache::is_enabled()) {
+	    entry value;
+	    value.first_connect = first_connect;
+	    value.last_connect = last_connect;
+	    value.client_network = client_network;
+	    triplet_cache::store(key.data(), key.length(), value);
+	}
+
+	// the index only has to be updated if the client network changed
+	std::map<std::string, std::string>::const_iterator fetched = fetched_networks.find(key);
+	if (fetched == fetched_networks.end() || fetched->second != client_network) {
+	    if (fetched != fetched_networks.end() && !fetched->second.empty()) {
+		update_index(fetched->second, key, false);
+	    }
+	    if (!client_network.empty()) {
+		update_index(client_network, key, true);
+	    }
+	}
+    }
+
+    void timestore::store_entries(key const* keys, std::size_t count, entry const* values) {
+	// we hold the database open for writing, i.e. locked, during all writes
+	for (std::size_t i = 0; i < count; i++) {
+	    store(std::string(keys[i].data, keys[i].length), values[i].first_connect, values[i].last_connect, values[i].client_network);
+	}
+    }
+
+    void timestore::del(std::string const& key) {
+	std::string const client_network = fetch_entry(key).client_network;
+
+	db.del(key);
+	triplet_cache::invalidate(key.data(), key.length());
+
+	if (!client_network.empty()) {
+	    update_index(client_network, key, false);
+	}
+    }
+
+    void timestore::sync() {
+	db.sync();
     }
 
     std::list<std::string> timestore::get_keys() {
 	return db.get_keys();
     }
 
-    void timestore::expire(int days) {
+    /**
+     * check if an entry has to be expired
+     *
+     * Entries that have passed greylisting (i.e. the client retried after the
+     * greylisting delay of 120 s) are kept for days, the others only for
+     * unpassed_hours if given.
+     *
+     * @param days number of days to keep entries
+     * @param unpassed_hours number of hours to keep entries that never passed, 0 to keep them as long as passed ones
+     */
+    static bool is_expired(timestore::entry const& times, std::time_t now, int days, int unpassed_hours) {
+	if (unpassed_hours > 0 && times.last_connect - times.first_connect < 120) {
+	    return now - times.last_connect > unpassed_hours * 3600;
+	}
+	return now - times.last_connect > days * 86400;
+    }
+
+    int timestore::expire(int days, bool offline, int unpassed_hours) {
 	std::time_t now = std::time(NULL);
+	int expired = 0;
 
 	std::list<std::string> const keys = get_keys();
 	for (std::list<std::string>::const_iterator p = keys.begin(); p != keys.end(); ++p) {
-	    std::pair<std::time_t, std::time_t> times = fetch(*p);
+	    if (is_expired(fetch_entry(*p), now, days, unpassed_hours)) {
+		if (offline) {
+		    std::cout << "Expiring: " << *p << std::endl;
+		}
+		del(*p);
+		expired++;
+	    }
+	}
+
+	// reorganizing locks the database for long, the daemon compacts it online instead
+	if (offline) {
+	    db.reorganize();
+	}
+
+	return expired;
+    }
+
+    int timestore::expire_online(int days, int unpassed_hours) {
+	std::time_t const now = std::time(NULL);
+
+	// find the candidates without keeping the daemon from writing
+	std::list<std::string> candidates;
+	{
+	    timestore snapshot(database::snapshot);
+	    std::list<std::string> const keys = snapshot.get_keys();
+	    for (std::list<std::string>::const_iterator p = keys.begin(); p != keys.end(); ++p) {
+		if (is_expired(snapshot.fetch_entry(*p), now, days, unpassed_hours)) {
+		    candidates.push_back(*p);
+		}
+	    }
+	}
+
+	int expired = 0;
+	std::list<std::string>::const_iterator p = candidates.begin();
+	while (p != candidates.end()) {
+	    {
+		timestore db(EXPIRE_OPEN_TIMEOUT_MS);
+		for (int batched = 0; batched < EXPIRE_BATCH_SIZE && p != candidates.end(); ++batched, ++p) {
+		    // the client might have retried since the snapshot has been taken
+		    entry queued;
+		    if (commit_queue::lookup(*p, queued) || !is_expired(db.fetch_entry(*p), now, days, unpassed_hours)) {
+			continue;
+		    }
+		    db.del(*p);
+		    expired++;
+		}
+	    }
+
+	    // let the daemon write in between
+	    if (p != candidates.end()) {
+		struct ::timespec pause;
+		pause.tv_sec = EXPIRE_BATCH_PAUSE_MS / 1000;
+		pause.tv_nsec = (EXPIRE_BATCH_PAUSE_MS % 1000) * 1000000L;
+		::nanosleep(&pause, NULL);
+	    }
+	}
+
+	return expired;
+    }
+
+    bool timestore::contains(std::string const& key) const {
+	return !db.fetch(key).empty();
+    }
+
+    std::list<std::string> timestore::find_client(std::string const& network) {
+	std::list<std::string> result;
+
+	// find the keys written just before as well
+	client_index::flush();
+
+	std::list<std::pair<std::string, std::string> > const records = index.lookup(network);
+	for (std::list<std::pair<std::string, std::string> >::const_iterator p = records.begin(); p != records.end(); ++p) {
+	    // skip index records that are out of date
+	    if (fetch_entry(p->second).client_network == p->first) {
+		result.push_back(p->second);
+	    }
+	}
+
+	return result;
+    }
 
-	    if (now - times.second > days * 86400) {
-		std::cout << "Expiring: " << *p << std::endl;
-		db.del(*p);
+    std::list<std::string> timestore::purge_client(std::string const& network) {
+	std::list<std::string> result;
+
+	// find the keys written just before as well
+	client_index::flush();
+
+	std::list<std::pair<std::string, std::string> > const records = index.lookup(network);
+	for (std::list<std::pair<std::string, std::string> >::const_iterator p = records.begin(); p != records.end(); ++p) {
+	    // skip index records that are out of date, but drop them as well
+	    if (fetch_entry(p->second).client_network == p->first) {
+		db.del(p->second);
+		triplet_cache::invalidate(p->second.data(), p->second.length());
+		result.push_back(p->second);
+	    }
+	    update_index(p->first, p->second, false);
+	}
+
+	return result;
+    }
+
+    int timestore::rebuild_index() {
+	index.clear();
+
+	// add all keys at once, so that the record of each client network is written once
+	std::list<client_index::change> changes;
+	std::list<std::string> const keys = get_keys();
+	for (std::list<std::string>::const_iterator p = keys.begin(); p != keys.end(); ++p) {
+	    std::string const client_network = fetch_entry(*p).client_network;
+	    if (!client_network.empty()) {
+		changes.push_back(client_index::change());
+		changes.back().client_network = client_network;
+		changes.back().key = *p;
+		changes.back().added = true;
 	    }
 	}
+	index.update(changes);
 
-	db.reorganize();
+	return changes.size();
     }
 }
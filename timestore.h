@@ -29,9 +29,13 @@
 
 #include <string>
 #include <list>
+#include <map>
+#include <vector>
 #include <ctime>
 
+#include <entry_store.h>
 #include <database.h>
+#include <client_index.h>
 
 #ifndef N_
 #   define N_(n) (n)
@@ -41,15 +45,28 @@ namespace couriergrey {
     /**
      * class storing the learned data
      */
-    class timestore {
+    class timestore : public entry_store {
 	public:
 	    /**
 	     * create a timestore instance
+	     *
+	     * @param open_timeout_ms how long to try opening the database in milliseconds, -1 for the default retries
+	     */
+	    timestore(int open_timeout_ms = -1);
+
+	    /**
+	     * create a timestore instance only used for reading
+	     *
+	     * @param mode database::reader or database::snapshot, the client index is opened as reader
+	     * @param open_timeout_ms how long to try opening the database in milliseconds, -1 for the default retries
 	     */
-	    timestore();
+	    timestore(database::open_mode mode, int open_timeout_ms = -1);
 
 	    /**
 	     * destruct a timestore instance
+	     *
+	     * The client index is updated after the database has been released, by the updater
+	     * thread of the client index if it is running.
 	     */
 	    ~timestore();
 
@@ -58,27 +75,139 @@ namespace couriergrey {
 	     */
 	    std::pair<std::time_t, std::time_t> fetch(std::string const& key) const;
 
+	    /**
+	     * fetch the complete entry for a key
+	     */
+	    entry fetch_entry(std::string const& key) const;
+
+	    using entry_store::fetch_entries;
+
+	    /**
+	     * fetch the entries of several keys at once
+	     *
+	     * @param keys the keys to fetch
+	     * @param count the number of keys
+	     * @param values where to store the entries, in the order of the keys
+	     */
+	    void fetch_entries(key const* keys, std::size_t count, entry* values) const;
+
 	    /**
 	     * store a value to a key
+	     *
+	     * If the key has not been fetched by fetch_entries() before, the client
+	     * network is indexed again, and an index record of a previous client network
+	     * is only dropped when that network is purged.
+	     *
+	     * @param client_network the client network used in the key (address/prefix)
 	     */
-	    void store(std::string const& key, std::time_t first_connect, std::time_t last_connect);
+	    void store(std::string const& key, std::time_t first_connect, std::time_t last_connect, std::string const& client_network = std::string());
+
+	    using entry_store::store_entries;
+
+	    /**
+	     * store the entries of several keys at once
+	     *
+	     * @param keys the keys to store
+	     * @param count the number of keys
+	     * @param values the entries to store, in the order of the keys
+	     */
+	    void store_entries(key const* keys, std::size_t count, entry const* values);
+
+	    /**
+	     * delete the entry of a key
+	     */
+	    void del(std::string const& key);
+
+	    /**
+	     * write all changes to disk
+	     */
+	    void sync();
 
 	    /**
 	     * expire old entires in the timestamp
 	     *
+	     * Entries that have passed greylisting are kept for days, entries that
+	     * never passed it (e.g. of clients that never retried) can be expired
+	     * sooner in the same pass.
+	     *
 	     * @param days number of days to keep
+	     * @param offline if the database is not in use, the expired keys are printed and the database is reorganized then
+	     * @param unpassed_hours number of hours to keep entries that never passed greylisting, 0 to keep them for days as well
+	     * @return number of expired entries
 	     */
-	    void expire(int days);
+	    int expire(int days, bool offline = true, int unpassed_hours = 0);
+
+	    /**
+	     * expire old entries while the database is in use
+	     *
+	     * The candidates are searched in a snapshot of the database. They are then
+	     * deleted in small batches, each checked again and deleted while holding the
+	     * database only shortly, with a pause between the batches.
+	     *
+	     * @param days number of days to keep
+	     * @param unpassed_hours number of hours to keep entries that never passed greylisting, 0 to keep them for days as well
+	     * @return number of expired entries
+	     */
+	    static int expire_online(int days, int unpassed_hours = 0);
+
+	    /**
+	     * check if there is an entry for a key
+	     */
+	    bool contains(std::string const& key) const;
 
 	    /**
 	     * get all the keys in the timestore
 	     */
 	    std::list<std::string> get_keys();
+
+	    /**
+	     * get the keys of entries from a client address or network, using the client index
+	     *
+	     * @param network a single address or address/prefix
+	     * @throws Glib::ustring if network is not valid
+	     */
+	    std::list<std::string> find_client(std::string const& network);
+
+	    /**
+	     * delete all entries from a client address or network, using the client index
+	     *
+	     * @param network a single address or address/prefix
+	     * @return the deleted keys
+	     * @throws Glib::ustring if network is not valid
+	     */
+	    std::list<std::string> purge_client(std::string const& network);
+
+	    /**
+	     * rebuild the client index from all entries
+	     *
+	     * @return number of indexed entries
+	     */
+	    int rebuild_index();
 	private:
+	    /**
+	     * queue a change of the client index
+	     */
+	    void update_index(std::string const& client_network, std::string const& key, bool added);
+
 	    /**
 	     * The database we use
 	     */
 	    database db;
+
+	    /**
+	     * the index of the keys by client network
+	     */
+	    client_index index;
+
+	    /**
+	     * the client networks of the keys fetched by fetch_entries(), to know which stores change the index
+	     */
+	    mutable std::map<std::string, std::string> fetched_networks;
+
+	    /**
+	     * the changes of the client index not yet done
+	     */
+	    std::list<client_index::change> index_updates;
     };
 }
 
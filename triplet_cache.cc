@@ -0,0 +1,378 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include "triplet_cache.h"
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glibmm.h>
+
+/**
+ * magic bytes at the start of a cache file
+ */
+#define TRIPLET_CACHE_MAGIC "CGTRIPL1"
+
+/**
+ * number of slots a key can be stored in
+ */
+#define TRIPLET_CACHE_WAYS 4
+
+/**
+ * how often a reader retries to get a consistent copy of a slot that is written concurrently
+ */
+#define TRIPLET_CACHE_READ_RETRIES 16
+
+/**
+ * how often a writer retries to lock a slot to invalidate it, before emptying it without the lock
+ */
+#define TRIPLET_CACHE_LOCK_RETRIES 16
+
+namespace couriergrey {
+    /**
+     * the header of a cache file
+     */
+    struct triplet_cache_header {
+	char magic[8];
+	::uint32_t slot_count;
+	::uint32_t slot_size;
+    };
+
+    /**
+     * an entry in the cache
+     */
+    struct triplet_slot {
+	/**
+	 * the sequence lock, odd while the slot is written
+	 */
+	volatile gint sequence;
+
+	/**
+	 * process id of the process writing the slot
+	 */
+	volatile gint writer;
+
+	/**
+	 * hash of the key, 0 if the slot is empty
+	 */
+	::uint64_t key_hash;
+
+	::int64_t first_connect;
+	::int64_t last_connect;
+	char client_network[48];
+    };
+
+    /**
+     * the mapped cache file, NULL if no cache is used
+     */
+    static triplet_cache_header* mapped_cache = NULL;
+
+    /**
+     * the slots in the mapped cache
+     */
+    static triplet_slot* slots = NULL;
+
+    /**
+     * number of slots in the mapped cache
+     */
+    static ::uint32_t slot_count = 0;
+
+    /**
+     * hash a key (FNV-1a), never returning the hash of an empty slot
+     */
+    static ::uint64_t key_hash(char const* key, std::size_t length) {
+	::uint64_t hash = 14695981039346656037ULL;
+	for (char const* p = key; p != key + length; ++p) {
+	    hash ^= static_cast<unsigned char>(*p);
+	    hash *= 1099511628211ULL;
+	}
+	return hash ? hash : 1;
+    }
+
+    /**
+     * the first of the slots a key can be stored in
+     */
+    static triplet_slot* first_slot(::uint64_t hash) {
+	return slots + (hash % (slot_count / TRIPLET_CACHE_WAYS)) * TRIPLET_CACHE_WAYS;
+    }
+
+    /**
+     * get a consistent copy of a slot
+     *
+     * @return false if the slot has been written during all retries
+     */
+    static bool read_slot(triplet_slot* slot, triplet_slot& copy) {
+	for (int retry = 0; retry < TRIPLET_CACHE_READ_RETRIES; retry++) {
+	    gint sequence = g_atomic_int_get(&slot->sequence);
+	    if (sequence & 1) {
+		continue;
+	    }
+
+	    copy.key_hash = slot->key_hash;
+	    copy.first_connect = slot->first_connect;
+	    copy.last_connect = slot->last_connect;
+	    std::memcpy(copy.client_network, slot->client_network, sizeof(copy.client_network));
+
+	    if (g_atomic_int_get(&slot->sequence) == sequence) {
+		return true;
+	    }
+	}
+	return false;
+    }
+
+    /**
+     * lock a slot for writing, if nobody else is writing it
+     *
+     * @param sequence where to store the sequence number the slot has been locked at
+     */
+    static bool lock_slot(triplet_slot* slot, gint& sequence) {
+	sequence = g_atomic_int_get(&slot->sequence);
+	if ((sequence & 1) || !g_atomic_int_compare_and_exchange(&slot->sequence, sequence, sequence + 1)) {
+	    return false;
+	}
+	g_atomic_int_set(&slot->writer, ::getpid());
+	return true;
+    }
+
+    /**
+     * unlock a slot locked by lock_slot()
+     */
+    static void unlock_slot(triplet_slot* slot, gint sequence) {
+	g_atomic_int_set(&slot->writer, 0);
+	g_atomic_int_set(&slot->sequence, sequence + 2);
+    }
+
+    /**
+     * empty a slot if it holds a key
+     *
+     * If the slot stays locked by somebody else, it is emptied without the lock. A
+     * stale entry must never survive, losing the entry of a concurrent writer only
+     * costs a database lookup.
+     */
+    static void drop_slot(triplet_slot* slot, ::uint64_t hash) {
+	for (int retry = 0; retry < TRIPLET_CACHE_LOCK_RETRIES; retry++) {
+	    gint sequence = 0;
+	    if (lock_slot(slot, sequence)) {
+		if (slot->key_hash == hash) {
+		    slot->key_hash = 0;
+		}
+		unlock_slot(slot, sequence);
+		return;
+	    }
+	}
+
+	if (slot->key_hash == hash) {
+	    slot->key_hash = 0;
+	}
+    }
+
+    /**
+     * map a cache file
+     *
+     * @return true if the file is a valid cache and has been mapped
+     */
+    static bool map_cache(int fd) {
+	struct ::stat cache_stat;
+	if (::fstat(fd, &cache_stat) || static_cast<std::size_t>(cache_stat.st_size) < sizeof(triplet_cache_header)) {
+	    return false;
+	}
+
+	void* cache = ::mmap(NULL, cache_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (cache == MAP_FAILED) {
+	    return false;
+	}
+
+	triplet_cache_header* header = static_cast<triplet_cache_header*>(cache);
+	if (std::memcmp(header->magic, TRIPLET_CACHE_MAGIC, sizeof(header->magic)) != 0
+		|| header->slot_size != sizeof(triplet_slot)
+		|| header->slot_count < TRIPLET_CACHE_WAYS
+		|| sizeof(triplet_cache_header) + header->slot_count * sizeof(triplet_slot) != static_cast<std::size_t>(cache_stat.st_size)) {
+	    ::munmap(cache, cache_stat.st_size);
+	    return false;
+	}
+
+	mapped_cache = header;
+	slots = reinterpret_cast<triplet_slot*>(header + 1);
+	slot_count = header->slot_count;
+	return true;
+    }
+
+    void triplet_cache::create(std::string const& filename, unsigned entries) {
+	entries -= entries % TRIPLET_CACHE_WAYS;
+	if (entries < TRIPLET_CACHE_WAYS) {
+	    entries = TRIPLET_CACHE_WAYS;
+	}
+
+	std::string temp_location = filename + ".XXXXXX";
+	int fd = ::mkstemp(&temp_location[0]);
+	if (fd == -1) {
+	    throw Glib::ustring(N_("Could not create triplet cache ")) + filename + ": " + std::strerror(errno);
+	}
+
+	// the file is filled with zeros, i.e. all slots are empty
+	triplet_cache_header header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, TRIPLET_CACHE_MAGIC, sizeof(header.magic));
+	header.slot_count = entries;
+	header.slot_size = sizeof(triplet_slot);
+	if (::ftruncate(fd, sizeof(header) + entries * sizeof(triplet_slot)) || ::write(fd, &header, sizeof(header)) != sizeof(header)) {
+	    ::close(fd);
+	    ::unlink(temp_location.c_str());
+	    throw Glib::ustring(N_("Could not write triplet cache ")) + filename + ": " + std::strerror(errno);
+	}
+
+	bool mapped = map_cache(fd);
+	::close(fd);
+	if (!mapped || std::rename(temp_location.c_str(), filename.c_str())) {
+	    ::unlink(temp_location.c_str());
+	    throw Glib::ustring(N_("Could not map triplet cache ")) + filename;
+	}
+    }
+
+    bool triplet_cache::attach(std::string const& filename) {
+	int fd = ::open(filename.c_str(), O_RDWR);
+	if (fd == -1) {
+	    return false;
+	}
+
+	bool mapped = map_cache(fd);
+	::close(fd);
+	return mapped;
+    }
+
+    bool triplet_cache::is_enabled() {
+	return mapped_cache != NULL;
+    }
+
+    bool triplet_cache::lookup(char const* key, std::size_t length, timestore::entry& value) {
+	if (!mapped_cache) {
+	    return false;
+	}
+
+	::uint64_t hash = key_hash(key, length);
+	triplet_slot* slot = first_slot(hash);
+	for (int way = 0; way < TRIPLET_CACHE_WAYS; way++) {
+	    triplet_slot copy;
+	    if (read_slot(slot + way, copy) && copy.key_hash == hash) {
+		value.first_connect = copy.first_connect;
+		value.last_connect = copy.last_connect;
+		copy.client_network[sizeof(copy.client_network)-1] = '\0';
+		value.client_network = copy.client_network;
+		return true;
+	    }
+	}
+
+	return false;
+    }
+
+    void triplet_cache::store(char const* key, std::size_t length, timestore::entry const& value) {
+	if (!mapped_cache) {
+	    return;
+	}
+
+	// entries that do not fit must not be served from an older cached version
+	if (value.client_network.length() >= sizeof(slots->client_network)) {
+	    invalidate(key, length);
+	    return;
+	}
+
+	// use the slot of the key, or an empty one, or the one used least recently
+	::uint64_t hash = key_hash(key, length);
+	triplet_slot* slot = first_slot(hash);
+	triplet_slot* victim = NULL;
+	::int64_t victim_last_connect = 0;
+	for (int way = 0; way < TRIPLET_CACHE_WAYS; way++) {
+	    triplet_slot copy;
+	    if (!read_slot(slot + way, copy)) {
+		// the slot might hold an older entry of the key
+		invalidate(key, length);
+		return;
+	    }
+	    if (copy.key_hash == hash) {
+		victim = slot + way;
+		break;
+	    }
+	    if (victim == NULL || copy.key_hash == 0 || copy.last_connect < victim_last_connect) {
+		victim = slot + way;
+		victim_last_connect = copy.key_hash == 0 ? 0 : copy.last_connect;
+	    }
+	}
+
+	// somebody else is writing the slot, do not wait for it but drop what we have cached
+	gint sequence = 0;
+	if (victim == NULL || !lock_slot(victim, sequence)) {
+	    invalidate(key, length);
+	    return;
+	}
+
+	victim->key_hash = hash;
+	victim->first_connect = value.first_connect;
+	victim->last_connect = value.last_connect;
+	std::memset(victim->client_network, 0, sizeof(victim->client_network));
+	value.client_network.copy(victim->client_network, sizeof(victim->client_network)-1);
+
+	unlock_slot(victim, sequence);
+    }
+
+    void triplet_cache::invalidate(char const* key, std::size_t length) {
+	if (!mapped_cache) {
+	    return;
+	}
+
+	::uint64_t hash = key_hash(key, length);
+	triplet_slot* slot = first_slot(hash);
+	for (int way = 0; way < TRIPLET_CACHE_WAYS; way++) {
+	    triplet_slot copy;
+	    if (read_slot(slot + way, copy) && copy.key_hash != hash) {
+		continue;
+	    }
+	    drop_slot(slot + way, hash);
+	}
+    }
+
+    int triplet_cache::release(pid_t writer) {
+	if (!mapped_cache) {
+	    return 0;
+	}
+
+	int released = 0;
+	for (::uint32_t i = 0; i < slot_count; i++) {
+	    gint sequence = g_atomic_int_get(&slots[i].sequence);
+	    if ((sequence & 1) && g_atomic_int_get(&slots[i].writer) == writer) {
+		// the content is half written, drop it
+		slots[i].key_hash = 0;
+		g_atomic_int_set(&slots[i].writer, 0);
+		g_atomic_int_set(&slots[i].sequence, sequence + 1);
+		released++;
+	    }
+	}
+	return released;
+    }
+}
@@ -0,0 +1,124 @@
+/* ---------------------------------------------------------------------------
+ *  couriergrey - Greylisting filter for Courier
+ *  Copyright (C) 2007-2012  Matthias Wimmer <m@tthias.eu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ * ---------------------------------------------------------------------------
+ * vi: sw=4:tabstop=8
+ */
+
+#ifndef TRIPLET_CACHE_H
+#define TRIPLET_CACHE_H
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <string>
+#include <cstddef>
+#include <sys/types.h>
+
+#include <timestore.h>
+
+#ifndef N_
+#   define N_(n) (n)
+#endif
+
+namespace couriergrey {
+    /**
+     * a cache of greylisting entries in shared memory, used by the worker processes in prefork mode
+     *
+     * The cache is a memory mapped file with a fixed number of slots. Each slot is
+     * protected by a sequence lock: a writer makes the sequence number odd while it
+     * changes the slot, readers copy the slot and retry if the sequence number has
+     * changed meanwhile. Neither readers nor writers ever block each other.
+     *
+     * The database stays authoritative, the cache is only written after the
+     * database has been written. Keys are identified by a 64 bit hash only.
+     *
+     * Tools changing the database (e.g. --purgeip or --expire) attach to the cache of a
+     * running daemon and invalidate the entries they delete.
+     */
+    class triplet_cache {
+	public:
+	    /**
+	     * create a new, empty cache and map it
+	     *
+	     * The new cache replaces an existing one atomically, processes still using
+	     * the old one keep their mapping of it.
+	     *
+	     * @param filename where to create the cache
+	     * @param entries number of entries the cache can hold
+	     * @throws Glib::ustring if the cache cannot be created
+	     */
+	    static void create(std::string const& filename, unsigned entries);
+
+	    /**
+	     * map the cache of a running daemon, if there is one
+	     *
+	     * Also used by a daemon taking over from its predecessor, to keep the cache.
+	     *
+	     * @param filename where the cache has been created
+	     * @return true if the cache has been mapped
+	     */
+	    static bool attach(std::string const& filename);
+
+	    /**
+	     * check if a cache is mapped
+	     */
+	    static bool is_enabled();
+
+	    /**
+	     * get the cached entry of a key
+	     *
+	     * @param key the key to look for
+	     * @param length the length of the key
+	     * @param value where to store the entry
+	     * @return true if the key has been found
+	     */
+	    static bool lookup(char const* key, std::size_t length, timestore::entry& value);
+
+	    /**
+	     * cache the entry of a key, after it has been written to the database
+	     *
+	     * If the slot is being written by somebody else, the key is dropped from the
+	     * cache instead.
+	     *
+	     * @param key the key the entry has been written for
+	     * @param length the length of the key
+	     * @param value the entry that has been written
+	     */
+	    static void store(char const* key, std::size_t length, timestore::entry const& value);
+
+	    /**
+	     * remove a key from the cache, after it has been deleted from the database
+	     *
+	     * @param key the key that has been deleted
+	     * @param length the length of the key
+	     */
+	    static void invalidate(char const* key, std::size_t length);
+
+	    /**
+	     * release the slots a process has been writing when it died
+	     *
+	     * @param writer the process id of the dead process
+	     * @return number of released slots
+	     */
+	    static int release(pid_t writer);
+    };
+}
+
+#endif // TRIPLET_CACHE_H
@@ -38,71 +38,154 @@
 #include <glibmm.h>
 #include <sstream>
 #include <fstream>
-#include <list>
+#include <algorithm>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <stdint.h>
 #include <syslog.h>
 #include <netinet/in.h>
 #include <stdexcept>
 
+/**
+ * magic bytes at the beginning of a precompiled whitelist image
+ */
+#define WHITELIST_IMAGE_MAGIC "CGWLIMG1"
+
 namespace couriergrey {
+    /**
+     * the header of a precompiled whitelist image
+     *
+     * The header is followed by range_count whitelist::range records and entry_count
+     * whitelist::entry records. The checksum covers these records.
+     */
+    struct whitelist_image_header {
+	/**
+	 * WHITELIST_IMAGE_MAGIC
+	 */
+	char magic[8];
+
+	/**
+	 * modification time of the text file, the image has been compiled from
+	 */
+	::uint64_t source_mtime;
+
+	/**
+	 * size of the text file, the image has been compiled from
+	 */
+	::uint64_t source_size;
+
+	/**
+	 * number of ranges in the image
+	 */
+	::uint64_t range_count;
+
+	/**
+	 * number of entries in the image
+	 */
+	::uint64_t entry_count;
+
+	/**
+	 * FNV-1a checksum over the ranges and entries
+	 */
+	::uint32_t checksum;
+
+	/**
+	 * size of whitelist::entry on the system that compiled the image
+	 */
+	::uint32_t entry_size;
+    };
+
+    /**
+     * calculate the FNV-1a checksum of a memory region
+     *
+     * @param hash result of the previous region, if the checksum covers multiple regions
+     */
+    static ::uint32_t image_checksum(void const* data, std::size_t length, ::uint32_t hash = 2166136261u) {
+	unsigned char const* bytes = static_cast<unsigned char const*>(data);
+
+	for (std::size_t i = 0; i < length; i++) {
+	    hash ^= bytes[i];
+	    hash *= 16777619u;
+	}
+
+	return hash;
+    }
+
+    /**
+     * order ranges by their first address
+     */
+    static bool range_less(whitelist::range const& a, whitelist::range const& b) {
+	return std::memcmp(&a.first, &b.first, sizeof(a.first)) < 0;
+    }
+
     void whitelist::dump() const {
 	std::clog << "Dumping parsed whitelist:" << std::endl;
-	for (std::list<std::pair<struct ::in6_addr, int> >::const_iterator p = whitelisted_addresses.begin(); p!= whitelisted_addresses.end(); ++p) {
+	for (std::size_t i = 0; i < entry_count; i++) {
 	    char address[INET6_ADDRSTRLEN];
 
-	    ::inet_ntop(AF_INET6, &(p->first), address, sizeof(address));
+	    ::inet_ntop(AF_INET6, &(entries[i].address), address, sizeof(address));
 
-	    std::clog << address << "/" << (p->second) << std::endl;
+	    std::clog << address << "/" << (entries[i].netsize) << std::endl;
 	}
 
 	std::clog << "***** END *****" << std::endl;
     }
 
-    whitelist::whitelist(std::string const& whitelistfile) : whitelistfile(whitelistfile) {
+    whitelist::whitelist(std::string const& whitelistfile, std::string const& imagefile) : whitelistfile(whitelistfile), entries(NULL), entry_count(0), ranges(NULL), range_count(0), mapped_image(NULL), mapped_size(0) {
+	if (!imagefile.empty() && map_image(imagefile)) {
+	    return;
+	}
+
 	parse_whitelist();
     }
 
-    bool whitelist::is_whitelisted(Glib::ustring const& address) const {
-	// convert address
-	struct ::in6_addr parsed_address = parse_address(address);
-
-	// check if any whitelist entry matches
-	for (std::list<std::pair<struct ::in6_addr, int> >::const_iterator p = whitelisted_addresses.begin(); p!= whitelisted_addresses.end(); ++p) {
-	    if (is_in_same_net(parsed_address, p->first, p->second))
-		return true;
+    whitelist::~whitelist() {
+	if (mapped_image) {
+	    ::munmap(mapped_image, mapped_size);
+	    mapped_image = NULL;
 	}
-
-	return false;
     }
 
-    bool whitelist::is_in_same_net(struct ::in6_addr const& addr1, struct ::in6_addr const& addr2, int netsize) const {
-	int i = 0;
-
-	if (netsize > 128 || netsize < 0)
-	    throw std::invalid_argument("invalid netsize");
+    bool whitelist::is_whitelisted(char const* address) const {
+	// convert address
+	struct ::in6_addr parsed_address = parse_address(address);
 
-	for (i = 0; i < netsize/8; i++) {
-	    if (addr1.s6_addr[i] != addr2.s6_addr[i])
-		return false;
+	// find the last range starting at or before the address
+	std::size_t lower = 0;
+	std::size_t upper = range_count;
+	while (lower < upper) {
+	    std::size_t middle = lower + (upper - lower) / 2;
+	    if (std::memcmp(&ranges[middle].first, &parsed_address, sizeof(parsed_address)) <= 0) {
+		lower = middle + 1;
+	    } else {
+		upper = middle;
+	    }
+	}
+	if (lower == 0) {
+	    return false;
 	}
 
-	if (netsize%8 == 0)
-	    return true;
-
-	u_int8_t mask = 0xff << (8 - netsize%8);
-
-	return ((addr1.s6_addr[i]&mask) == (addr2.s6_addr[i]&mask));
+	// ranges do not overlap, so this is the only candidate
+	return std::memcmp(&parsed_address, &ranges[lower-1].last, sizeof(parsed_address)) <= 0;
     }
 
-    struct ::in6_addr whitelist::parse_address (Glib::ustring const& address) const {
-	// first try to parse as IPv6 address
+    struct ::in6_addr whitelist::parse_address (char const* address) const {
 	struct ::in6_addr parsed_address;
-	if (::inet_pton(AF_INET6, address.c_str(), &parsed_address) <= 0) {
-	    // not an IPv6 address, try as IPv4 address
-	    Glib::ustring mapped_ipv4 = "::ffff:";
-	    mapped_ipv4 += address;
-	    if (::inet_pton(AF_INET6, mapped_ipv4.c_str(), &parsed_address) <= 0) {
+
+	// IPv4 addresses get mapped to IPv6 addresses
+	if (std::strchr(address, ':') == NULL) {
+	    std::memset(&parsed_address, 0, sizeof(parsed_address));
+	    parsed_address.s6_addr[10] = 0xff;
+	    parsed_address.s6_addr[11] = 0xff;
+	    if (::inet_pton(AF_INET, address, &parsed_address.s6_addr[12]) <= 0) {
 		throw std::invalid_argument("not a valid IPv4 or IPv6 address");
 	    }
+	    return parsed_address;
+	}
+
+	if (::inet_pton(AF_INET6, address, &parsed_address) <= 0) {
+	    throw std::invalid_argument("not a valid IPv4 or IPv6 address");
 	}
 
 	return parsed_address;
@@ -138,8 +221,7 @@ namespace couriergrey {
 	    std::string::size_type netsize_pos = line.find('/');
 	    if (netsize_pos != std::string::npos) {
 		// parse network size
-		std::istringstream netsize_stream(line.substr(netsize_pos+1));
-		netsize_stream >> netsize;
+		netsize = std::atoi(line.c_str() + netsize_pos + 1);
 
 		// remove network size for further processing
 		line.erase(netsize_pos);
@@ -164,7 +246,7 @@ namespace couriergrey {
 
 	    // line should now be an address
 	    try {
-		struct ::in6_addr parsed_address = parse_address(line);
+		struct ::in6_addr parsed_address = parse_address(line.c_str());
 
 		// we may have to correct the netsize for IPv4 addresses if they have been specified in the range 0 ... 32
 		if (IN6_IS_ADDR_V4MAPPED(&parsed_address)) {
@@ -180,13 +262,135 @@ namespace couriergrey {
 		    netsize = 128;
 
 		// remember the address
-		std::pair<struct ::in6_addr, int> new_address_mask_pair(parsed_address, netsize);
-		whitelisted_addresses.push_back(new_address_mask_pair);
+		entry new_entry;
+		new_entry.address = parsed_address;
+		new_entry.netsize = netsize;
+		parsed_entries.push_back(new_entry);
 	    } catch (std::invalid_argument iae) {
 		::syslog(LOG_INFO, "read whitelist line, which could not be parsed as address, skipping: %s", line.c_str());
 	    }
 	}
 
 	wlfile.close();
+
+	// calculate the address range of each entry
+	std::vector<range> all_ranges;
+	all_ranges.reserve(parsed_entries.size());
+	for (std::vector<entry>::const_iterator p = parsed_entries.begin(); p != parsed_entries.end(); ++p) {
+	    range new_range;
+	    new_range.first = p->address;
+	    new_range.last = p->address;
+	    for (int i = 0; i < 16; i++) {
+		int bits = p->netsize - 8*i;
+		::uint8_t mask = bits >= 8 ? 0xff : bits <= 0 ? 0x00 : 0xff << (8 - bits);
+		new_range.first.s6_addr[i] &= mask;
+		new_range.last.s6_addr[i] |= ~mask;
+	    }
+	    all_ranges.push_back(new_range);
+	}
+
+	// sort and merge overlapping ranges, so that a lookup is a binary search
+	std::sort(all_ranges.begin(), all_ranges.end(), range_less);
+	for (std::vector<range>::const_iterator p = all_ranges.begin(); p != all_ranges.end(); ++p) {
+	    if (!parsed_ranges.empty() && std::memcmp(&p->first, &parsed_ranges.back().last, sizeof(p->first)) <= 0) {
+		if (std::memcmp(&p->last, &parsed_ranges.back().last, sizeof(p->last)) > 0) {
+		    parsed_ranges.back().last = p->last;
+		}
+		continue;
+	    }
+	    parsed_ranges.push_back(*p);
+	}
+
+	entries = parsed_entries.empty() ? NULL : &parsed_entries[0];
+	entry_count = parsed_entries.size();
+	ranges = parsed_ranges.empty() ? NULL : &parsed_ranges[0];
+	range_count = parsed_ranges.size();
+    }
+
+    bool whitelist::map_image(std::string const& imagefile) {
+	// stat the text file, the image has to be compiled from its current version
+	struct ::stat source_stat;
+	if (::stat(whitelistfile.c_str(), &source_stat)) {
+	    return false;
+	}
+
+	int fd = ::open(imagefile.c_str(), O_RDONLY);
+	if (fd == -1) {
+	    return false;
+	}
+
+	struct ::stat image_stat;
+	if (::fstat(fd, &image_stat) || static_cast<std::size_t>(image_stat.st_size) < sizeof(whitelist_image_header)) {
+	    ::close(fd);
+	    return false;
+	}
+
+	void* image = ::mmap(NULL, image_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (image == MAP_FAILED) {
+	    return false;
+	}
+
+	// validate the image
+	whitelist_image_header const* header = static_cast<whitelist_image_header const*>(image);
+	std::size_t payload_size = image_stat.st_size - sizeof(whitelist_image_header);
+	char const* payload = static_cast<char const*>(image) + sizeof(whitelist_image_header);
+	if (std::memcmp(header->magic, WHITELIST_IMAGE_MAGIC, sizeof(header->magic)) != 0
+		|| header->entry_size != sizeof(entry)
+		|| header->source_mtime != static_cast< ::uint64_t>(source_stat.st_mtime)
+		|| header->source_size != static_cast< ::uint64_t>(source_stat.st_size)
+		|| header->range_count > payload_size / sizeof(range)
+		|| header->entry_count > (payload_size - header->range_count * sizeof(range)) / sizeof(entry)
+		|| header->range_count * sizeof(range) + header->entry_count * sizeof(entry) != payload_size
+		|| header->checksum != image_checksum(payload, payload_size)) {
+	    ::syslog(LOG_NOTICE, "whitelist image %s is outdated or invalid, parsing %s instead", imagefile.c_str(), whitelistfile.c_str());
+	    ::munmap(image, image_stat.st_size);
+	    return false;
+	}
+
+	mapped_image = image;
+	mapped_size = image_stat.st_size;
+	range_count = header->range_count;
+	ranges = range_count ? reinterpret_cast<range const*>(payload) : NULL;
+	entry_count = header->entry_count;
+	entries = entry_count ? reinterpret_cast<entry const*>(payload + range_count * sizeof(range)) : NULL;
+
+	return true;
+    }
+
+    void whitelist::compile(std::string const& imagefile) const {
+	struct ::stat source_stat;
+	if (::stat(whitelistfile.c_str(), &source_stat)) {
+	    throw Glib::ustring(N_("Cannot access whitelist ")) + whitelistfile + ": " + std::strerror(errno);
+	}
+
+	whitelist_image_header header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, WHITELIST_IMAGE_MAGIC, sizeof(header.magic));
+	header.source_mtime = source_stat.st_mtime;
+	header.source_size = source_stat.st_size;
+	header.range_count = range_count;
+	header.entry_count = entry_count;
+	header.entry_size = sizeof(entry);
+
+	// ranges and entries are checksummed as one block
+	header.checksum = image_checksum(entries, entry_count * sizeof(entry), image_checksum(ranges, range_count * sizeof(range)));
+
+	// write to a temporary file first, and move it into place when complete
+	std::string temp_location = imagefile + ".tmp";
+	std::ofstream image(temp_location.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+	image.write(reinterpret_cast<char const*>(&header), sizeof(header));
+	image.write(reinterpret_cast<char const*>(ranges), range_count * sizeof(range));
+	image.write(reinterpret_cast<char const*>(entries), entry_count * sizeof(entry));
+	image.close();
+	if (!image) {
+	    ::unlink(temp_location.c_str());
+	    throw Glib::ustring(N_("Cannot write whitelist image ")) + temp_location;
+	}
+
+	if (std::rename(temp_location.c_str(), imagefile.c_str())) {
+	    ::unlink(temp_location.c_str());
+	    throw Glib::ustring(N_("Cannot move whitelist image to its location ")) + imagefile + ": " + std::strerror(errno);
+	}
     }
 }
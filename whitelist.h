@@ -30,7 +30,7 @@
 #include <stddef.h>
 #include <string>
 #include <glibmm.h>
-#include <list>
+#include <vector>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
@@ -41,51 +41,160 @@
 namespace couriergrey {
     /**
      * class storing IP address ranges, that are whitelisted
+     *
+     * The whitelist is either parsed from the text file, or mapped from a precompiled
+     * image of it (see compile()).
      */
     class whitelist {
 	public:
 	    /**
 	     * create a whitelist instance
+	     *
+	     * @param whitelistfile the text file containing the whitelist
+	     * @param imagefile precompiled image of the whitelist, that is used instead of
+	     * parsing whitelistfile if it is still up to date (empty string to not use an image)
+	     */
+	    whitelist(std::string const& whitelistfile, std::string const& imagefile = std::string());
+
+	    /**
+	     * destruct a whitelist instance
 	     */
-	    whitelist(std::string const& whitelistfile);
+	    ~whitelist();
 
 	    /**
 	     * check if an address is whitelisted
 	     */
-	    bool is_whitelisted(Glib::ustring const& address) const;
+	    bool is_whitelisted(Glib::ustring const& address) const { return is_whitelisted(address.c_str()); }
+
+	    /**
+	     * check if an address is whitelisted
+	     *
+	     * @throws std::invalid_argument if address is not a valid address
+	     */
+	    bool is_whitelisted(char const* address) const;
 
 	    /**
 	     * dump the whitelist to std::clog
 	     */
 	    void dump() const;
 
+	    /**
+	     * write a precompiled image of the whitelist
+	     *
+	     * @param imagefile where to write the image to
+	     * @throws Glib::ustring if the image cannot be written
+	     */
+	    void compile(std::string const& imagefile) const;
+
+	    /**
+	     * check if the whitelist has been mapped from a precompiled image
+	     */
+	    bool is_mapped() const { return mapped_image != NULL; }
+
+	    /**
+	     * a whitelist entry as it has been configured
+	     */
+	    struct entry {
+		/**
+		 * the (network) address
+		 */
+		struct ::in6_addr address;
+
+		/**
+		 * size of the network in bits
+		 */
+		int netsize;
+	    };
+
+	    /**
+	     * a range of whitelisted addresses, used for lookups
+	     */
+	    struct range {
+		/**
+		 * first address in the range
+		 */
+		struct ::in6_addr first;
+
+		/**
+		 * last address in the range
+		 */
+		struct ::in6_addr last;
+	    };
+
 	private:
+	    /**
+	     * whitelists cannot be copied (they might own a mapped image)
+	     */
+	    whitelist(whitelist const&);
+
+	    /**
+	     * whitelists cannot be assigned
+	     */
+	    whitelist& operator=(whitelist const&);
+
 	    /**
 	     * filename of the whitelist
 	     */
 	    std::string whitelistfile;
 
 	    /**
-	     * list of whitelisted addresses
+	     * whitelist entries, if parsed from the text file
+	     */
+	    std::vector<entry> parsed_entries;
+
+	    /**
+	     * merged, sorted and non-overlapping address ranges, if parsed from the text file
+	     */
+	    std::vector<range> parsed_ranges;
+
+	    /**
+	     * the whitelist entries (either pointing to parsed_entries or into the mapped image)
+	     */
+	    entry const* entries;
+
+	    /**
+	     * number of whitelist entries
 	     */
-	    std::list< std::pair<struct ::in6_addr, int> > whitelisted_addresses;
+	    std::size_t entry_count;
 
 	    /**
-	     * compare two IPv6 addresses if they are in the same network
+	     * the ranges for lookups (either pointing to parsed_ranges or into the mapped image)
 	     */
-	    bool is_in_same_net(struct ::in6_addr const& addr1, struct ::in6_addr const& addr2, int netsize) const;
+	    range const* ranges;
+
+	    /**
+	     * number of ranges
+	     */
+	    std::size_t range_count;
+
+	    /**
+	     * the mapped image, NULL if the whitelist has been parsed
+	     */
+	    void* mapped_image;
+
+	    /**
+	     * size of the mapped image
+	     */
+	    std::size_t mapped_size;
 
 	    /**
 	     * convert textual address to IPv6 binary address
 	     *
 	     * @throws std::invalid_argument if address is not valid
 	     */
-	    struct ::in6_addr parse_address(Glib::ustring const& address) const;
+	    struct ::in6_addr parse_address(char const* address) const;
 
 	    /**
 	     * parse the whitelist
 	     */
 	    void parse_whitelist();
+
+	    /**
+	     * map a precompiled whitelist image
+	     *
+	     * @return false if there is no valid and up to date image
+	     */
+	    bool map_image(std::string const& imagefile);
     };
 }
 